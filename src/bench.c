@@ -172,6 +172,28 @@ static int64_t timespec_sub(struct timespec a, struct timespec b)
 
 #define NSAMPLES 5
 
+/** Create a shared memory file for the benchmark in `map` */
+static struct shadow_fd *create_bench_file(struct fd_translation_map *map,
+		struct thread_pool *pool, size_t test_size)
+{
+	struct wmsg_open_file file_msg;
+	file_msg.remote_id = 0;
+	file_msg.file_size = (uint32_t)test_size;
+	file_msg.size_and_type = transfer_header(
+			sizeof(struct wmsg_open_file), WMSG_OPEN_FILE);
+
+	struct render_data render;
+	memset(&render, 0, sizeof(render));
+	render.disabled = true;
+	render.drm_fd = 1;
+	render.av_disabled = true;
+
+	struct bytebuf msg = {.size = sizeof(struct wmsg_open_file),
+			.data = (char *)&file_msg};
+	(void)apply_update(map, pool, &render, WMSG_OPEN_FILE, 0, &msg);
+	return get_shadow_for_rid(map, 0);
+}
+
 static struct bench_result run_sub_bench(bool first,
 		const struct compression_range *rng, int level,
 		float bandwidth_mBps, int n_worker_threads, unsigned int seed,
@@ -184,6 +206,7 @@ static struct bench_result run_sub_bench(bool first,
 	/* Setup a shadow structure */
 	struct thread_pool pool;
 	setup_thread_pool(&pool, rng->mode, level, n_worker_threads);
+	pool.raw_blocks = true;
 	if (first) {
 		printf("Running compression level benchmarks, assuming bandwidth=%g MB/s, with %d threads\n",
 				bandwidth_mBps, pool.nthreads);
@@ -191,23 +214,7 @@ static struct bench_result run_sub_bench(bool first,
 
 	struct fd_translation_map map;
 	setup_translation_map(&map, false);
-
-	struct wmsg_open_file file_msg;
-	file_msg.remote_id = 0;
-	file_msg.file_size = (uint32_t)test_size;
-	file_msg.size_and_type = transfer_header(
-			sizeof(struct wmsg_open_file), WMSG_OPEN_FILE);
-
-	struct render_data render;
-	memset(&render, 0, sizeof(render));
-	render.disabled = true;
-	render.drm_fd = 1;
-	render.av_disabled = true;
-
-	struct bytebuf msg = {.size = sizeof(struct wmsg_open_file),
-			.data = (char *)&file_msg};
-	(void)apply_update(&map, &pool, &render, WMSG_OPEN_FILE, 0, &msg);
-	struct shadow_fd *sfd = get_shadow_for_rid(&map, 0);
+	struct shadow_fd *sfd = create_bench_file(&map, &pool, test_size);
 
 	int iter = 0;
 	float samples[NSAMPLES];
@@ -219,12 +226,12 @@ static struct bench_result run_sub_bench(bool first,
 		memcpy(sfd->mem_mirror, image, test_size);
 		perturb(sfd->mem_local, test_size);
 		sfd->is_dirty = true;
+		mark_shadow_active(sfd);
 		damage_everything(&sfd->damage);
 
 		/* Create transfer queue */
 		struct transfer_queue transfer_data;
 		memset(&transfer_data, 0, sizeof(struct transfer_queue));
-		pthread_mutex_init(&transfer_data.async_recv_queue.lock, NULL);
 
 		struct timespec t0, t1;
 		clock_gettime(CLOCK_REALTIME, &t0);
@@ -247,10 +254,7 @@ static struct bench_result run_sub_bench(bool first,
 			bool has_task = request_work_task(&pool, &task, &done);
 			if (has_task) {
 				run_task(&task, &pool.threads[0]);
-
-				pthread_mutex_lock(&pool.work_mutex);
-				pool.tasks_in_progress--;
-				pthread_mutex_unlock(&pool.work_mutex);
+				finish_work_task(&pool, &task);
 			}
 
 			struct timespec cur_time;
@@ -279,10 +283,7 @@ static struct bench_result run_sub_bench(bool first,
 				}
 			} else {
 				/* Very short delay, for poll loop */
-				bool tasks_remaining = false;
-				pthread_mutex_lock(&pool.work_mutex);
-				tasks_remaining = pool.stack_count > 0;
-				pthread_mutex_unlock(&pool.work_mutex);
+				bool tasks_remaining = !done;
 
 				struct timespec delay_time;
 				delay_time.tv_sec = 0;
@@ -352,6 +353,241 @@ static struct bench_result run_sub_bench(bool first,
 	return res;
 }
 
+#ifdef HAS_ZSTD
+#define NDICT_FRAMES 8
+
+/** Send a sequence of perturbed versions of the image, with zstd, and return
+ * the total size of the messages for the second half of the frames, setting
+ * `*dict_size` to the total size of all dictionaries sent. */
+static size_t run_dict_sub_bench(bool with_dict, int n_worker_threads,
+		unsigned int seed, size_t test_size, void *image,
+		size_t *dict_size)
+{
+	srand(seed);
+
+	struct thread_pool pool;
+	setup_thread_pool(&pool, COMP_ZSTD, 5, n_worker_threads);
+	pool.zstd_dict = with_dict;
+
+	struct fd_translation_map map;
+	setup_translation_map(&map, false);
+	struct shadow_fd *sfd = create_bench_file(&map, &pool, test_size);
+
+	size_t total_size = 0;
+	*dict_size = 0;
+	for (int iter = 0; !shutdown_flag && iter < NDICT_FRAMES; iter++) {
+		memcpy(sfd->mem_local, image, test_size);
+		memcpy(sfd->mem_mirror, image, test_size);
+		perturb(sfd->mem_local, test_size);
+		sfd->is_dirty = true;
+		mark_shadow_active(sfd);
+		damage_everything(&sfd->damage);
+
+		struct transfer_queue transfer_data;
+		memset(&transfer_data, 0, sizeof(struct transfer_queue));
+
+		update_zstd_dictionary(&pool, &transfer_data);
+		collect_update(&pool, sfd, &transfer_data, false);
+		start_parallel_work(&pool, &transfer_data.async_recv_queue);
+		bool done = false;
+		while (!done) {
+			struct task_data task;
+			if (request_work_task(&pool, &task, &done)) {
+				run_task(&task, &pool.threads[0]);
+				finish_work_task(&pool, &task);
+			}
+		}
+		transfer_load_async(&transfer_data);
+		for (int i = transfer_data.start; i < transfer_data.end; i++) {
+			uint32_t header = *(uint32_t *)transfer_data.vecs[i]
+							  .iov_base;
+			size_t len = transfer_data.vecs[i].iov_len;
+			if (transfer_type(header) == WMSG_ZSTD_DICTIONARY) {
+				*dict_size += len;
+			} else if (iter >= NDICT_FRAMES / 2) {
+				total_size += len;
+			}
+		}
+
+		/* Let any dictionary training finish before the next frame,
+		 * as would happen when frames are further apart in time */
+		while (atomic_load(&pool.dict.stage) == DICT_FULL ||
+				atomic_load(&pool.dict.stage) ==
+						DICT_TRAINING) {
+			update_zstd_dictionary(&pool, &transfer_data);
+			struct task_data task;
+			if (request_work_task(&pool, &task, &done)) {
+				run_task(&task, &pool.threads[0]);
+				finish_work_task(&pool, &task);
+			} else {
+				struct timespec delay_time = {
+						.tv_sec = 0, .tv_nsec = 100000};
+				nanosleep(&delay_time, NULL);
+			}
+		}
+		finish_update(sfd);
+		cleanup_transfer_queue(&transfer_data);
+	}
+
+	cleanup_thread_pool(&pool);
+	cleanup_translation_map(&map);
+	return total_size;
+}
+
+/** Compare the compressed size of diffs for the text-like image, with and
+ * without a trained zstd dictionary */
+static void run_dict_bench(int n_worker_threads, unsigned int seed,
+		size_t test_size, void *text_image)
+{
+	size_t plain_dict_size = 0, dict_size = 0;
+	size_t plain_size = run_dict_sub_bench(false, n_worker_threads, seed,
+			test_size, text_image, &plain_dict_size);
+	size_t size = run_dict_sub_bench(true, n_worker_threads, seed,
+			test_size, text_image, &dict_size);
+	if (dict_size == 0) {
+		printf("Zstd dictionary, text-like image: no dictionary was trained within %d frames\n",
+				NDICT_FRAMES);
+		return;
+	}
+	printf("Zstd dictionary, text-like image: %zu bytes per %d frames without dictionary, %zu bytes with (%f of original), after sending %zu bytes of dictionaries\n",
+			plain_size, NDICT_FRAMES / 2, size,
+			(float)size / (float)plain_size, dict_size);
+}
+#endif
+
+/* The previous design for thread_msg_recv_buf, in which every operation
+ * takes the same lock; kept as a reference for the contention benchmark */
+struct locked_msg_queue {
+	struct iovec *data;
+	int zone_start, zone_end;
+	pthread_mutex_t lock;
+};
+
+struct queue_bench_producer {
+	pthread_t thread;
+	struct thread_msg_recv_buf *lock_free;
+	struct locked_msg_queue *locked;
+	int nmsgs;
+};
+
+static void *run_queue_bench_producer(void *arg)
+{
+	struct queue_bench_producer *p = arg;
+	static char payload[64];
+	for (int i = 0; i < p->nmsgs; i++) {
+		if (p->lock_free) {
+			transfer_async_add(p->lock_free, payload,
+					sizeof(payload));
+		} else {
+			pthread_mutex_lock(&p->locked->lock);
+			struct iovec *v =
+					&p->locked->data[p->locked->zone_end++];
+			v->iov_base = payload;
+			v->iov_len = sizeof(payload);
+			pthread_mutex_unlock(&p->locked->lock);
+		}
+	}
+	return NULL;
+}
+
+/** Measure the time per message for `nproducers` threads to hand `nmsgs`
+ * messages each to the main thread, which collects them concurrently.
+ * Returns a negative value on failure. */
+static float run_queue_bench(bool lock_free, int nproducers, int nmsgs)
+{
+	int total = nproducers * nmsgs;
+	struct thread_msg_recv_buf ring;
+	memset(&ring, 0, sizeof(ring));
+	struct locked_msg_queue locked;
+	memset(&locked, 0, sizeof(locked));
+	pthread_mutex_init(&locked.lock, NULL);
+	struct queue_bench_producer *producers =
+			calloc((size_t)nproducers, sizeof(*producers));
+	locked.data = calloc((size_t)total, sizeof(struct iovec));
+	float ret = -1.f;
+	if (!producers || !locked.data ||
+			transfer_async_ensure_size(&ring, total) == -1) {
+		goto cleanup;
+	}
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_REALTIME, &t0);
+	int nstarted = 0;
+	for (; nstarted < nproducers; nstarted++) {
+		producers[nstarted].lock_free = lock_free ? &ring : NULL;
+		producers[nstarted].locked = lock_free ? NULL : &locked;
+		producers[nstarted].nmsgs = nmsgs;
+		if (pthread_create(&producers[nstarted].thread, NULL,
+				    run_queue_bench_producer,
+				    &producers[nstarted]) != 0) {
+			break;
+		}
+	}
+	int received = 0, expected = nstarted * nmsgs;
+	while (received < expected) {
+		if (lock_free) {
+			struct iovec v;
+			struct shared_buffer *borrowed;
+			while (transfer_async_pop(&ring, &v, &borrowed)) {
+				received += v.iov_len > 0;
+			}
+		} else {
+			pthread_mutex_lock(&locked.lock);
+			int zstart = locked.zone_start;
+			int zend = locked.zone_end;
+			locked.zone_start = zend;
+			pthread_mutex_unlock(&locked.lock);
+			for (int i = zstart; i < zend; i++) {
+				received += locked.data[i].iov_len > 0;
+			}
+		}
+	}
+	for (int i = 0; i < nstarted; i++) {
+		pthread_join(producers[i].thread, NULL);
+	}
+	clock_gettime(CLOCK_REALTIME, &t1);
+	if (nstarted == nproducers) {
+		ret = (1e9f * (float)(t1.tv_sec - t0.tv_sec) +
+				      (float)(t1.tv_nsec - t0.tv_nsec)) /
+		      (float)total;
+	}
+
+cleanup:
+	free(ring.data);
+	free(locked.data);
+	free(producers);
+	pthread_mutex_destroy(&locked.lock);
+	return ret;
+}
+
+static void run_queue_benches(int n_worker_threads)
+{
+	int nthreads = n_worker_threads;
+	if (nthreads <= 0) {
+		nthreads = max(get_hardware_thread_count() / 2, 1);
+	}
+	/* As in the thread pool, the main thread also consumes messages */
+	int nproducers = max(nthreads - 1, 1);
+	float median[2], hiqr[2];
+	for (int k = 0; k < 2; k++) {
+		float samples[NSAMPLES];
+		for (int i = 0; i < NSAMPLES; i++) {
+			samples[i] = run_queue_bench(k == 0, nproducers, 65536);
+			if (samples[i] < 0) {
+				wp_error("Failed to run queue benchmark");
+				return;
+			}
+		}
+		qsort(samples, NSAMPLES, sizeof(float), float_compare);
+		median[k] = samples[NSAMPLES / 2];
+		hiqr[k] = (samples[(NSAMPLES * 3) / 4] -
+					  samples[NSAMPLES / 4]) /
+			  2;
+	}
+	printf("Worker message queue, %d producers: lock-free %f+/-%f ns/msg, locked %f+/-%f ns/msg\n",
+			nproducers, median[0], hiqr[0], median[1], hiqr[1]);
+}
+
 int run_bench(float bandwidth_mBps, uint32_t test_size, int n_worker_threads)
 {
 	/* 4MB test image - 1024x1024x4. Any smaller, and unrealistic caching
@@ -360,6 +596,8 @@ int run_bench(float bandwidth_mBps, uint32_t test_size, int n_worker_threads)
 	clock_gettime(CLOCK_REALTIME, &tp);
 
 	srand((unsigned int)tp.tv_nsec);
+	run_queue_benches(n_worker_threads);
+
 	void *text_image = create_text_like_image(test_size);
 	void *vid_image = create_video_like_image(test_size);
 	if (!text_image || !vid_image) {
@@ -368,6 +606,10 @@ int run_bench(float bandwidth_mBps, uint32_t test_size, int n_worker_threads)
 		wp_error("Failed to allocate test images");
 		return EXIT_FAILURE;
 	}
+#ifdef HAS_ZSTD
+	run_dict_bench(n_worker_threads, (unsigned int)tp.tv_nsec, test_size,
+			text_image);
+#endif
 
 	/* Q: store an array of all the modes -> outputs */
 	// Then sort that array
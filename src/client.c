@@ -148,6 +148,9 @@ static void apply_conn_header(uint32_t header, struct main_config *config)
 			config->no_gpu = true;
 		}
 	}
+	if (config) {
+		config->raw_blocks = (header & CONN_RAW_BLOCKS_BIT) != 0;
+	}
 	// todo: consider allowing to disable video encoding
 }
 
@@ -74,6 +74,17 @@ void *map_dmabuf(struct gbm_bo *bo, bool write, void **map_handle,
 	(void)exp_stride;
 	return NULL;
 }
+void *map_dmabuf_rows(struct gbm_bo *bo, uint32_t row_start, uint32_t row_end,
+		bool write, void **map_handle, uint32_t *exp_stride)
+{
+	(void)bo;
+	(void)row_start;
+	(void)row_end;
+	(void)write;
+	(void)map_handle;
+	(void)exp_stride;
+	return NULL;
+}
 int unmap_dmabuf(struct gbm_bo *bo, void *map_handle)
 {
 	(void)bo;
@@ -325,6 +336,12 @@ void destroy_dmabuf(struct gbm_bo *bo)
 
 void *map_dmabuf(struct gbm_bo *bo, bool write, void **map_handle,
 		uint32_t *exp_stride)
+{
+	return map_dmabuf_rows(
+			bo, 0, UINT32_MAX, write, map_handle, exp_stride);
+}
+void *map_dmabuf_rows(struct gbm_bo *bo, uint32_t row_start, uint32_t row_end,
+		bool write, void **map_handle, uint32_t *exp_stride)
 {
 	if (!bo) {
 		wp_error("Tried to map null gbm_bo");
@@ -339,6 +356,12 @@ void *map_dmabuf(struct gbm_bo *bo, bool write, void **map_handle,
 	uint32_t stride;
 	uint32_t width = gbm_bo_get_width(bo);
 	uint32_t height = gbm_bo_get_height(bo);
+	row_end = (uint32_t)minu(row_end, height);
+	if (row_start >= row_end) {
+		wp_error("Tried to map empty row range [%u, %u) of dmabuf",
+				row_start, row_end);
+		return NULL;
+	}
 	/* As of writing, with amdgpu, GBM_BO_TRANSFER_WRITE invalidates
 	 * regions not written to during the mapping, while iris preserves
 	 * the original buffer contents. GBM documentation does not say which
@@ -347,8 +370,8 @@ void *map_dmabuf(struct gbm_bo *bo, bool write, void **map_handle,
 	 * both drivers. */
 	uint32_t flags = write ? GBM_BO_TRANSFER_READ_WRITE
 			       : GBM_BO_TRANSFER_READ;
-	void *data = gbm_bo_map(
-			bo, 0, 0, width, height, flags, &stride, map_handle);
+	void *data = gbm_bo_map(bo, 0, row_start, width, row_end - row_start,
+			flags, &stride, map_handle);
 	if (!data) {
 		// errno is useless here
 		wp_error("Failed to map dmabuf");
@@ -80,6 +80,10 @@ void destroy_dmabuf(struct gbm_bo *bo);
 /** Map a DMABUF for reading or for writing */
 void *map_dmabuf(struct gbm_bo *bo, bool write, void **map_handle,
 		uint32_t *exp_stride);
+/** Map only rows [row_start, row_end) of a DMABUF; the result points to the
+ * start of row `row_start` */
+void *map_dmabuf_rows(struct gbm_bo *bo, uint32_t row_start, uint32_t row_end,
+		bool write, void **map_handle, uint32_t *exp_stride);
 int unmap_dmabuf(struct gbm_bo *bo, void *map_handle);
 /** The handle values are unique among the set of currently active buffer
  * objects. To compare a set of buffer objects, produce handles in a batch, and
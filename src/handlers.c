@@ -79,6 +79,10 @@ struct damage_list {
 	struct damage_record *list;
 	int len;
 	int size;
+	/* The surface state with which the damage was committed */
+	int32_t scale;
+	int32_t transform;
+	bool viewport;
 };
 
 #define SURFACE_DAMAGE_BACKLOG 7
@@ -94,6 +98,17 @@ struct obj_wl_surface {
 	uint32_t attached_buffer_id; /* protocol object id */
 	int32_t scale;
 	int32_t transform;
+	/* Set once a wp_viewport is created for the surface. Its crop and
+	 * scale state is not tracked */
+	bool has_viewport;
+};
+
+struct obj_wl_callback {
+	struct wp_object base;
+	/* Created by wl_surface.frame, rather than wl_display.sync */
+	bool is_frame;
+	/* The done event was held back from the application */
+	bool done_held;
 };
 
 struct obj_wlr_screencopy_frame {
@@ -199,6 +214,7 @@ static const struct wp_interface *const global_interfaces[] = {
 		&intf_wl_shm,
 		&intf_wl_subcompositor,
 		&intf_wp_presentation,
+		&intf_wp_viewporter,
 		&intf_xdg_wm_base,
 		&intf_zwlr_data_control_manager_v1,
 		&intf_zwlr_export_dmabuf_manager_v1,
@@ -222,6 +238,7 @@ static const struct wp_interface *const non_global_interfaces[] = {
 		&intf_wl_shm_pool,
 		&intf_wl_surface,
 		&intf_wp_presentation_feedback,
+		&intf_wp_viewport,
 		&intf_zwlr_data_control_offer_v1,
 		&intf_zwlr_data_control_source_v1,
 		&intf_zwlr_export_dmabuf_frame_v1,
@@ -310,6 +327,8 @@ struct wp_object *create_wp_object(uint32_t id, const struct wp_interface *type)
 		sz = sizeof(struct obj_wl_buffer);
 	} else if (type == &intf_wl_surface) {
 		sz = sizeof(struct obj_wl_surface);
+	} else if (type == &intf_wl_callback) {
+		sz = sizeof(struct obj_wl_callback);
 	} else if (type == &intf_zwlr_screencopy_frame_v1) {
 		sz = sizeof(struct obj_wlr_screencopy_frame);
 	} else if (type == &intf_wp_presentation) {
@@ -359,9 +378,30 @@ void do_wl_display_evt_error(struct context *ctx, struct wp_object *object_id,
 			code, message ? message : "<no message>");
 	(void)ctx;
 }
+/* Append the current message to those held back from the application */
+static bool hold_message(struct context *ctx)
+{
+	struct char_window *held = &ctx->g->held_frame_events;
+	if (buf_ensure_size(held->zone_end + ctx->message_length, 1,
+			    &held->size, (void **)&held->data) == -1) {
+		wp_error("Failed to allocate space to hold back a message");
+		return false;
+	}
+	memcpy(held->data + held->zone_end, ctx->message,
+			(size_t)ctx->message_length);
+	held->zone_end += ctx->message_length;
+	ctx->drop_this_msg = true;
+	return true;
+}
 void do_wl_display_evt_delete_id(struct context *ctx, uint32_t id)
 {
 	struct wp_object *obj = tracker_get(ctx->tracker, id);
+	if (obj && obj->type == &intf_wl_callback &&
+			((struct obj_wl_callback *)obj)->done_held &&
+			ctx->g->held_frame_events.zone_end > 0) {
+		/* The id may only be reused after the done event arrives */
+		(void)hold_message(ctx);
+	}
 	/* ensure this isn't miscalled to have wl_display delete itself */
 	if (obj && obj != ctx->obj) {
 		tracker_remove(ctx->tracker, obj);
@@ -493,6 +533,18 @@ fail:
 }
 
 void do_wl_buffer_evt_release(struct context *ctx) { (void)ctx; }
+void do_wl_callback_evt_done(struct context *ctx, uint32_t callback_data)
+{
+	(void)callback_data;
+	struct obj_wl_callback *callback = (struct obj_wl_callback *)ctx->obj;
+	if (ctx->on_display_side || !callback->is_frame ||
+			!ctx->g->inflight_throttle) {
+		return;
+	}
+	/* The application is sending data faster than the channel takes
+	 * it, so delay its next frame */
+	callback->done_held = hold_message(ctx);
+}
 int get_shm_bytes_per_pixel(uint32_t format)
 {
 	switch (format) {
@@ -708,6 +760,124 @@ static void rotate_damage_lists(struct obj_wl_surface *surface)
 			(SURFACE_DAMAGE_BACKLOG - 1) * sizeof(uint64_t));
 	surface->attached_buffer_uids[0] = 0;
 }
+void do_wl_surface_req_frame(struct context *ctx, struct wp_object *callback)
+{
+	(void)ctx;
+	if (callback) {
+		((struct obj_wl_callback *)callback)->is_frame = true;
+	}
+}
+/* Can damage in surface coordinates from `list` be mapped onto the buffer
+ * using only the current buffer scale and transform? This is not the case if
+ * a viewport may crop or scale the buffer, or if the scale or transform
+ * changed since the damage was committed. */
+static bool surface_damage_maps_to_buffer(const struct obj_wl_surface *surface,
+		const struct damage_list *list)
+{
+	bool has_surface_damage = false;
+	for (int j = 0; j < list->len; j++) {
+		has_surface_damage |= !list->list[j].buffer_coordinates;
+	}
+	if (!has_surface_damage) {
+		return true;
+	}
+	return !list->viewport && list->scale == surface->scale &&
+	       list->transform == surface->transform;
+}
+/* Mark the parts of a buffer that changed since it was last committed to the
+ * surface, by replaying the damage of all commits since then. Returns false
+ * if this is not known, in which case the entire buffer should be marked. */
+static bool replay_surface_damage(struct context *ctx,
+		struct obj_wl_surface *surface, struct shadow_fd *sfd,
+		int32_t offset, int32_t stride, int bpp, int32_t width,
+		int32_t height)
+{
+	if (surface->scale <= 0) {
+		wp_error("Invalid buffer scale during commit (%d), assuming everything damaged",
+				surface->scale);
+		return false;
+	}
+	if (surface->transform < 0 || surface->transform >= 8) {
+		wp_error("Invalid buffer transform during commit (%d), assuming everything damaged",
+				surface->transform);
+		return false;
+	}
+
+	/* The damage specified as of wl_surface commit indicates which region
+	 * of the surface has changed between the last commit and the current
+	 * one. However, the last time the attached buffer was used may have
+	 * been several commits ago, so we need to replay all the damage up
+	 * to the current point. */
+	int age = -1;
+	int n_damaged_rects = surface->damage_lists[0].len;
+	for (int j = 1; j < SURFACE_DAMAGE_BACKLOG; j++) {
+		if (surface->attached_buffer_uids[0] ==
+				surface->attached_buffer_uids[j]) {
+			age = j;
+			break;
+		}
+		n_damaged_rects += surface->damage_lists[j].len;
+	}
+	if (age == -1) {
+		/* cannot find last time buffer+surface combo was used */
+		return false;
+	}
+	for (int k = 0; k < age; k++) {
+		if (!surface_damage_maps_to_buffer(surface,
+				    &surface->damage_lists[k])) {
+			return false;
+		}
+	}
+	if (n_damaged_rects == 0) {
+		/* the buffer is unchanged since it was last committed */
+		return true;
+	}
+
+	struct ext_interval *damage_array = malloc(
+			sizeof(struct ext_interval) * (size_t)n_damaged_rects);
+	if (!damage_array) {
+		wp_error("Failed to allocate damage array");
+		return false;
+	}
+	int i = 0;
+
+	// Translate damage stack into damage records for the fd buffer
+	for (int k = 0; k < age; k++) {
+		const struct damage_list *frame_damage =
+				&surface->damage_lists[k];
+		for (int j = 0; j < frame_damage->len; j++) {
+			int xlow, xhigh, ylow, yhigh;
+			compute_damage_coordinates(&xlow, &xhigh, &ylow, &yhigh,
+					&frame_damage->list[j], width, height,
+					frame_damage->transform,
+					frame_damage->scale);
+
+			/* Clip the damage rectangle to the containing
+			 * buffer. */
+			xlow = clamp(xlow, 0, width);
+			xhigh = clamp(xhigh, 0, width);
+			ylow = clamp(ylow, 0, height);
+			yhigh = clamp(yhigh, 0, height);
+			if (xlow >= xhigh || ylow >= yhigh) {
+				continue;
+			}
+
+			damage_array[i].start = offset + stride * ylow +
+						bpp * xlow;
+			damage_array[i].rep = yhigh - ylow;
+			damage_array[i].stride = stride;
+			damage_array[i].width = bpp * (xhigh - xlow);
+			i++;
+		}
+	}
+
+	if (i > 0) {
+		merge_damage_records(&sfd->damage, i, damage_array,
+				&ctx->g->threads.merge_policy);
+	}
+	free(damage_array);
+	return true;
+}
 void do_wl_surface_req_commit(struct context *ctx)
 {
 	struct obj_wl_surface *surface = (struct obj_wl_surface *)ctx->obj;
@@ -737,9 +907,11 @@ void do_wl_surface_req_commit(struct context *ctx)
 	}
 	struct obj_wl_buffer *buf = (struct obj_wl_buffer *)obj;
 	surface->attached_buffer_uids[0] = buf->unique_id;
+	surface->damage_lists[0].scale = surface->scale;
+	surface->damage_lists[0].transform = surface->transform;
+	surface->damage_lists[0].viewport = surface->has_viewport;
 	if (buf->type == BUF_DMA) {
-		rotate_damage_lists(surface);
-
+		int bpp = get_shm_bytes_per_pixel(buf->dmabuf_format);
 		for (int i = 0; i < buf->dmabuf_nplanes; i++) {
 			struct shadow_fd *sfd = buf->dmabuf_buffers[i];
 			if (!sfd) {
@@ -754,10 +926,25 @@ void do_wl_surface_req_commit(struct context *ctx)
 				continue;
 			}
 
-			// detailed damage tracking is not yet supported
 			sfd->is_dirty = true;
-			damage_everything(&sfd->damage);
+			mark_shadow_active(sfd);
+			ctx->g->buffer_committed = true;
+			/* Only single plane RGBA-type buffers are diffed
+			 * row by row; video encodes entire frames */
+			bool by_rows = sfd->type == FDC_DMABUF &&
+				       buf->dmabuf_nplanes == 1 && bpp != -1;
+			/* Damage is recorded in the layout used over the
+			 * wire, which starts at the plane (the import
+			 * already applies its offset), with its stride */
+			int32_t stride = (int32_t)sfd->dmabuf_info.strides[0];
+			if (!by_rows || !replay_surface_damage(ctx, surface,
+							sfd, 0, stride, bpp,
+							buf->dmabuf_width,
+							buf->dmabuf_height)) {
+				damage_everything(&sfd->damage);
+			}
 		}
+		rotate_damage_lists(surface);
 		return;
 	} else if (buf->type != BUF_SHM) {
 		wp_error("wp_buffer is backed neither by DMA nor SHM, not yet supported");
@@ -774,97 +961,28 @@ void do_wl_surface_req_commit(struct context *ctx)
 		return;
 	}
 	sfd->is_dirty = true;
+	mark_shadow_active(sfd);
+	ctx->g->buffer_committed = true;
 	int bpp = get_shm_bytes_per_pixel(buf->shm_format);
 	if (bpp == -1) {
 		wp_error("Encountered unknown/planar/subsampled wl_shm format %x; marking entire buffer",
 				buf->shm_format);
-		goto backup;
-	}
-	if (surface->scale <= 0) {
-		wp_error("Invalid buffer scale during commit (%d), assuming everything damaged",
-				surface->scale);
-		goto backup;
-	}
-	if (surface->transform < 0 || surface->transform >= 8) {
-		wp_error("Invalid buffer transform during commit (%d), assuming everything damaged",
-				surface->transform);
-		goto backup;
-	}
-
-	/* The damage specified as of wl_surface commit indicates which region
-	 * of the surface has changed between the last commit and the current
-	 * one. However, the last time the attached buffer was used may have
-	 * been several commits ago, so we need to replay all the damage up
-	 * to the current point. */
-	int age = -1;
-	int n_damaged_rects = surface->damage_lists[0].len;
-	for (int j = 1; j < SURFACE_DAMAGE_BACKLOG; j++) {
-		if (surface->attached_buffer_uids[0] ==
-				surface->attached_buffer_uids[j]) {
-			age = j;
-			break;
-		}
-		n_damaged_rects += surface->damage_lists[j].len;
-	}
-	if (age == -1) {
-		/* cannot find last time buffer+surface combo was used */
-		goto backup;
-	}
-
-	struct ext_interval *damage_array = malloc(
-			sizeof(struct ext_interval) * (size_t)n_damaged_rects);
-	if (!damage_array) {
-		wp_error("Failed to allocate damage array");
-		goto backup;
-	}
-	int i = 0;
-
-	// Translate damage stack into damage records for the fd buffer
-	for (int k = 0; k < age; k++) {
-		const struct damage_list *frame_damage =
-				&surface->damage_lists[k];
-		for (int j = 0; j < frame_damage->len; j++) {
-			int xlow, xhigh, ylow, yhigh;
-			compute_damage_coordinates(&xlow, &xhigh, &ylow, &yhigh,
-					&frame_damage->list[j], buf->shm_width,
-					buf->shm_height, surface->transform,
-					surface->scale);
-
-			/* Clip the damage rectangle to the containing
-			 * buffer. */
-			xlow = clamp(xlow, 0, buf->shm_width);
-			xhigh = clamp(xhigh, 0, buf->shm_width);
-			ylow = clamp(ylow, 0, buf->shm_height);
-			yhigh = clamp(yhigh, 0, buf->shm_height);
-
-			damage_array[i].start = buf->shm_offset +
-						buf->shm_stride * ylow +
-						bpp * xlow;
-			damage_array[i].rep = yhigh - ylow;
-			damage_array[i].stride = buf->shm_stride;
-			damage_array[i].width = bpp * (xhigh - xlow);
-			i++;
-		}
+	} else if (replay_surface_damage(ctx, surface, sfd, buf->shm_offset,
+				   buf->shm_stride, bpp, buf->shm_width,
+				   buf->shm_height)) {
+		rotate_damage_lists(surface);
+		return;
 	}
 
-	merge_damage_records(&sfd->damage, i, damage_array,
-			ctx->g->threads.diff_alignment_bits);
-	free(damage_array);
-	rotate_damage_lists(surface);
-backup:
-	if (1) {
-		/* damage the entire buffer (but no other part of the shm_pool)
-		 */
-		struct ext_interval full_surface_damage;
-		full_surface_damage.start = buf->shm_offset;
-		full_surface_damage.rep = 1;
-		full_surface_damage.stride = 0;
-		full_surface_damage.width = buf->shm_stride * buf->shm_height;
-		merge_damage_records(&sfd->damage, 1, &full_surface_damage,
-				ctx->g->threads.diff_alignment_bits);
-	}
+	/* damage the entire buffer (but no other part of the shm_pool) */
+	struct ext_interval full_surface_damage;
+	full_surface_damage.start = buf->shm_offset;
+	full_surface_damage.rep = 1;
+	full_surface_damage.stride = 0;
+	full_surface_damage.width = buf->shm_stride * buf->shm_height;
+	merge_damage_records(&sfd->damage, 1, &full_surface_damage,
+			&ctx->g->threads.merge_policy);
 	rotate_damage_lists(surface);
-	return;
 }
 static void append_damage_record(struct obj_wl_surface *surface, int32_t x,
 		int32_t y, int32_t width, int32_t height,
@@ -918,6 +1036,19 @@ void do_wl_surface_req_set_buffer_scale(struct context *ctx, int32_t scale)
 	struct obj_wl_surface *surface = (struct obj_wl_surface *)ctx->obj;
 	surface->scale = scale;
 }
+void do_wp_viewporter_req_get_viewport(struct context *ctx,
+		struct wp_object *id, struct wp_object *surface)
+{
+	(void)ctx;
+	(void)id;
+	if (!surface || surface->type != &intf_wl_surface) {
+		wp_error("Viewport is not being created for a wl_surface");
+		return;
+	}
+	/* Damage in surface coordinates can no longer be mapped onto the
+	 * buffer, since the crop and scale state is not tracked */
+	((struct obj_wl_surface *)surface)->has_viewport = true;
+}
 void do_wl_keyboard_evt_keymap(
 		struct context *ctx, uint32_t format, int fd, uint32_t size)
 {
@@ -974,16 +1105,29 @@ void do_wl_shm_req_create_pool(
 		return;
 	}
 
-	struct shadow_fd *sfd = translate_fd(&ctx->g->map, &ctx->g->render, fd,
-			FDC_FILE, fdsz, NULL, false);
+	/* Clients may create several pools from the same file, in which case
+	 * they share a single shadow structure, and copy on the other side */
+	struct shadow_fd *sfd = get_shadow_for_same_file(&ctx->g->map, fd);
+	if (!sfd) {
+		sfd = translate_fd(&ctx->g->map, &ctx->g->render, fd, FDC_FILE,
+				fdsz, NULL, false);
+	}
 	if (!sfd) {
 		return;
 	}
+	if (sfd->refcount.protocol > 0) {
+		/* increment for each extra time this fd will be sent */
+		shadow_incref_transfer(sfd);
+		if (!ctx->on_display_side) {
+			extend_shm_shadow(&ctx->g->threads, sfd, (size_t)size);
+		}
+	} else {
+		/* We only send shm_pool updates when the buffers created from
+		 * the pool are used. Some applications make the pool >> actual
+		 * buffers, so this can reduce communication by a lot*/
+		reset_damage(&sfd->damage);
+	}
 	the_shm_pool->owned_buffer = shadow_incref_protocol(sfd);
-	/* We only send shm_pool updates when the buffers created from the
-	 * pool are used. Some applications make the pool >> actual buffers,
-	 * so this can reduce communication by a lot*/
-	reset_damage(&sfd->damage);
 }
 
 void do_wl_shm_pool_req_resize(struct context *ctx, int32_t size)
@@ -1073,6 +1217,7 @@ void do_zwlr_screencopy_frame_v1_evt_ready(struct context *ctx,
 		return;
 	}
 	sfd->is_dirty = true;
+	mark_shadow_active(sfd);
 	/* The protocol guarantees that the buffer attributes match
 	 * those of the written frame */
 	const struct ext_interval interval = {.start = buffer->shm_offset,
@@ -1080,7 +1225,7 @@ void do_zwlr_screencopy_frame_v1_evt_ready(struct context *ctx,
 			.stride = 0,
 			.rep = 1};
 	merge_damage_records(&sfd->damage, 1, &interval,
-			ctx->g->threads.diff_alignment_bits);
+			&ctx->g->threads.merge_policy);
 
 	(void)tv_sec_lo;
 	(void)tv_sec_hi;
@@ -1865,6 +2010,7 @@ void do_zwlr_export_dmabuf_frame_v1_evt_ready(struct context *ctx,
 		struct shadow_fd *sfd = frame->objects[i].buffer;
 		if (sfd) {
 			sfd->is_dirty = true;
+			mark_shadow_active(sfd);
 			damage_everything(&sfd->damage);
 		}
 	}
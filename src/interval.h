@@ -53,14 +53,51 @@ struct interval {
 	int32_t end;
 };
 
-#define DAMAGE_EVERYTHING ((struct interval *)-1)
+#define DAMAGE_EVERYTHING ((struct ext_interval *)-1)
+
+/** The `k`th subinterval of `e`, widened to multiples of
+ * `1 << alignment_bits` */
+static inline struct interval ext_interval_row(
+		const struct ext_interval e, int k, int alignment_bits)
+{
+	int32_t mask = (1 << alignment_bits) - 1;
+	int32_t start = e.start + k * e.stride;
+	return (struct interval){.start = start & ~mask,
+			.end = (start + e.width + mask) & ~mask};
+}
+/** The number of `1 << alignment_bits` sized blocks covered by the
+ * subintervals of `e`, each widened as by ext_interval_row */
+int ext_interval_blocks(const struct ext_interval e, int alignment_bits);
+
+/** Lower bound for the damage merge margin. This must be larger than 8, or
+ * diffs will explode; and at least twice the largest diff alignment, so that
+ * subintervals which are kept separate do not overlap once widened to it */
+#define MIN_MERGE_MARGIN 128
+
+/** How merge_damage_records should trade off the size of the damage list
+ * against the time spent merging it and the number of bytes to be diffed */
+struct merge_policy {
+	/** Gaps smaller than this are merged; at least MIN_MERGE_MARGIN */
+	int margin;
+	/** Maximum number of extended intervals to sort in one call; past
+	 * this, all damage is replaced by its span */
+	int max_entries;
+	/** Maximum number of subintervals to merge in one call; past this,
+	 * groups of extended intervals are replaced by their span */
+	int max_rows;
+	/** Time after which a call stops merging groups, in nanoseconds */
+	int64_t time_limit_ns;
+};
 
 /** Interval-based damage tracking. If damage is NULL, there is
  * no recorded damage. If damage is DAMAGE_EVERYTHING, the entire
  * region should be updated. If ndamage_intvs > 0, then
- * damage points to an array of struct interval objects. */
+ * damage points to an array of struct ext_interval objects, sorted by
+ * start position; their subintervals are separated by at least the merge
+ * margin of the policy used, and those of different entries do not
+ * interleave. */
 struct damage {
-	struct interval *damage;
+	struct ext_interval *damage;
 	int ndamage_intvs;
 
 	int64_t acc_damage_stat;
@@ -69,11 +106,15 @@ struct damage {
 
 /** Given an array of extended intervals, update the base damage structure
  * so that it contains a reasonably small disjoint set of extended intervals
- * which contains the old base set and the new set. Before merging, all
- * interval boundaries will be rounded to the next multiple of
- * `1 << alignment_bits`. */
+ * which contains the old base set and the new set. Extended intervals are
+ * kept as they are unless their span comes within the merge margin of
+ * another's; only such groups are split into subintervals, merged, and
+ * run-length encoded again; past the policy's limits, groups (or all of the
+ * damage) are instead replaced by their span. The margin is large enough
+ * that subintervals stay disjoint when widened to the diff alignment. */
 void merge_damage_records(struct damage *base, int nintervals,
-		const struct ext_interval *const new_list, int alignment_bits);
+		const struct ext_interval *const new_list,
+		const struct merge_policy *policy);
 /** Set damage to empty  */
 void reset_damage(struct damage *base);
 /** Expand damage to cover everything */
@@ -184,6 +184,26 @@ size_t construct_diff_core(interval_diff_fn_t idiff_fn, int alignment_bits,
 	}
 	return cursor * sizeof(uint32_t);
 }
+size_t construct_diff_strided(interval_diff_fn_t idiff_fn, int alignment_bits,
+		const struct ext_interval *__restrict__ damaged_intervals,
+		int n_intervals, void *__restrict__ base,
+		const void *__restrict__ changed, void *__restrict__ diff)
+{
+	uint32_t *diff_blocks = (uint32_t *)diff;
+	size_t cursor = 0;
+	for (int i = 0; i < n_intervals; i++) {
+		struct ext_interval e = damaged_intervals[i];
+		for (int k = 0; k < e.rep; k++) {
+			struct interval row =
+					ext_interval_row(e, k, alignment_bits);
+			size_t bend = (size_t)row.end >> alignment_bits;
+			size_t bstart = (size_t)row.start >> alignment_bits;
+			cursor += (*idiff_fn)(24, changed, base,
+					diff_blocks + cursor, bstart, bend);
+		}
+	}
+	return cursor * sizeof(uint32_t);
+}
 size_t construct_diff_trailing(size_t size, int alignment_bits,
 		char *__restrict__ base, const char *__restrict__ changed,
 		char *__restrict__ diff)
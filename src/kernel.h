@@ -29,6 +29,7 @@
 #include <stdint.h>
 
 struct interval;
+struct ext_interval;
 typedef size_t (*interval_diff_fn_t)(const int diff_window_size,
 		const void *__restrict__ imod, void *__restrict__ ibase,
 		uint32_t *__restrict__ diff, size_t i, const size_t i_end);
@@ -51,6 +52,13 @@ size_t construct_diff_core(interval_diff_fn_t idiff_fn, int alignment_bits,
 		const struct interval *__restrict__ damaged_intervals,
 		int n_intervals, void *__restrict__ base,
 		const void *__restrict__ changed, void *__restrict__ diff);
+/** As construct_diff_core, for the subintervals of extended intervals, each
+ * widened to multiples of 1<<alignment_bits; these widened subintervals
+ * should be disjoint and lie within the buffers. */
+size_t construct_diff_strided(interval_diff_fn_t idiff_fn, int alignment_bits,
+		const struct ext_interval *__restrict__ damaged_intervals,
+		int n_intervals, void *__restrict__ base,
+		const void *__restrict__ changed, void *__restrict__ diff);
 /** If the bytes after the last multiple of 1<<alignment_bits differ, copy
  * them over base and append the to the diff */
 size_t construct_diff_trailing(size_t size, int alignment_bits,
@@ -34,6 +34,12 @@ struct main_config {
 	int n_worker_threads;
 	enum compression_mode compression;
 	int compression_level;
+	bool adaptive_level;
+	bool zstd_prefix;
+	bool zstd_dict;
+	/** Whether the other side can apply WMSG_BUFFER_FILL_RAW and
+	 * WMSG_BUFFER_DIFF_RAW messages */
+	bool raw_blocks;
 	bool no_gpu;
 	bool only_linear_dmabuf;
 	bool video_if_possible;
@@ -41,6 +47,15 @@ struct main_config {
 	enum video_coding_fmt video_fmt;
 	bool prefer_hwvideo;
 	bool old_video_mode;
+	/** Run the channel->program direction on its own thread */
+	bool thread_per_direction;
+	/** On the application side, the number of bytes sent to the channel
+	 * which may be unacknowledged before the application is slowed down;
+	 * zero for no limit */
+	size_t max_inflight;
+	/** On the application side, while the channel is congested, hold
+	 * back buffer commits so that their updates are merged */
+	bool coalesce;
 };
 struct globals {
 	const struct main_config *config;
@@ -48,6 +63,19 @@ struct globals {
 	struct render_data render;
 	struct message_tracker tracker;
 	struct thread_pool threads;
+	/** If not null, the lock which the thread handling each direction
+	 * holds while it uses the above, except when running tasks */
+	pthread_mutex_t *state_lock;
+	/** Set while the application has more data in flight than permitted;
+	 * frame callback events are then kept in `held_frame_events` */
+	bool inflight_throttle;
+	struct char_window held_frame_events;
+	/** Set once a parsed message may have changed buffer contents, like a
+	 * wl_surface.commit; the message then starts at `commit_offset` in
+	 * the parser's output, and its fds at `commit_nfds` in the fd queue */
+	bool buffer_committed;
+	int commit_offset;
+	int commit_nfds;
 };
 
 /** Main processing loop
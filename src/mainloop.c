@@ -36,6 +36,16 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef HAS_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef HAS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
 // The maximum number of fds libwayland can recvmsg at once
 #define MAX_LIBWAY_FDS 28
 static ssize_t iovec_read(
@@ -176,6 +186,23 @@ static void untranslate_ids(struct fd_translation_map *map, int nids,
 }
 
 enum wm_state { WM_WAITING_FOR_PROGRAM, WM_WAITING_FOR_CHANNEL, WM_TERMINAL };
+/** Measurements of the channel, used to adjust the compression level when it
+ * was chosen to be automatic */
+struct level_control {
+	bool enabled;
+	int min_level, max_level;
+	/** Estimated rate at which the channel accepts data, in bytes/sec;
+	 * zero until the channel has been seen to block */
+	double drain_rate;
+	/** Total time, in this cycle, between writes that left data queued
+	 * and the next writes, and the amount those next writes sent */
+	int64_t blocked_ns;
+	int64_t blocked_bytes;
+	/** If set, the last write left data queued, as of `blocked_since` */
+	bool blocked;
+	struct timespec blocked_since;
+};
+
 /** This state corresponds to the in-progress transfer from the program
  * (compositor or application) and its pipes/buffers to the channel. */
 struct way_msg_state {
@@ -184,7 +211,9 @@ struct way_msg_state {
 	/** Window zone contains the message data which has been read
 	 * but not yet parsed/copied to proto_write */
 	struct char_window proto_read;
-	/** Buffer of complete protocol messages to be written to the channel */
+	/** Buffer of complete protocol messages to be written to the channel;
+	 * while the channel is congested, this holds the messages of several
+	 * reads */
 	struct char_window proto_write;
 
 	/** Queue of fds to be used by protocol parser */
@@ -195,8 +224,16 @@ struct way_msg_state {
 	struct transfer_queue transfers;
 	/** bytes written in this cycle, for debug */
 	int total_written;
+	/** Bytes of the last cycle's messages that were still queued when it
+	 * ended, and the value this had when the current cycle started. A
+	 * cycle may only end before its messages are written if those of
+	 * the last cycle were, so at most two cycles overlap. */
+	size_t drain_left;
+	size_t cycle_drain;
 	/** Maximum chunk size to writev at once*/
 	int max_iov;
+	/** Channel measurements for the automatic compression level */
+	struct level_control level_ctrl;
 
 	/** Transfers to send after the compute queue is empty */
 	int ntrailing;
@@ -207,7 +244,12 @@ struct way_msg_state {
 	struct wmsg_ack ack_msgs[2];
 };
 
-enum cm_state { CM_WAITING_FOR_PROGRAM, CM_WAITING_FOR_CHANNEL, CM_TERMINAL };
+enum cm_state {
+	CM_WAITING_FOR_PROGRAM,
+	CM_WAITING_FOR_CHANNEL,
+	CM_WAITING_FOR_WORKERS,
+	CM_TERMINAL
+};
 /** This state corresponds to the in-progress transfer from the channel
  * to the program and the buffers/pipes on which will be written. */
 struct chan_msg_state {
@@ -221,11 +263,14 @@ struct chan_msg_state {
 	/**< FD queue for the protocol parser */
 	struct int_window proto_fds;
 
-#define RECV_GOAL_READ_SIZE 131072
-	char *recv_buffer; // ring-like buffer for message data
+#define RECV_INITIAL_SIZE (1u << 20)
+	/** Ring buffer for message data, from create_mirrored_buffer, so that
+	 * every message in it is contiguous */
+	char *recv_buffer;
 	size_t recv_size;
 	size_t recv_start; // (recv_buffer+rev_start) should be a message header
 	size_t recv_end;   // last byte read from channel, always >=recv_start
+	size_t recv_scan;  // end of the last complete message that was counted
 	int recv_unhandled_messages; // number of messages to parse
 };
 
@@ -243,8 +288,259 @@ struct cross_state {
 	/* Which was the last message number sent to the other application which
 	 * was acknowledged by that side? */
 	uint32_t last_confirmed_msgno;
+	/* If not null, the ring through which all reads from and writes to the
+	 * channel are made */
+	struct chan_ring *ring;
 };
 
+#ifdef HAS_IO_URING
+/* Enough submission queue entries for a receive, all linked sends, and a
+ * cancellation request for each */
+#define CHAN_RING_ENTRIES 32
+#define CHAN_RING_MAX_SENDS 8
+/* user_data values used to identify completions; send `i` uses
+ * CHAN_OP_SEND + i */
+#define CHAN_OP_CANCEL 0
+#define CHAN_OP_RECV 1
+#define CHAN_OP_SEND 2
+
+/** An io_uring instance which keeps a receive, and a chain of sends, in
+ * flight on the channel. Unlike readv/writev after poll, the operations
+ * wait for the socket themselves, and each iteration of the main loop needs
+ * only one system call to submit all new operations. */
+struct chan_ring {
+	int fd;
+	void *map;
+	size_t map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int sq_entries;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/** Local submission queue tail, and number of entries not yet
+	 * submitted */
+	unsigned int sqe_tail, nqueued;
+	/** Number of queued or submitted operations without a completion */
+	int ninflight;
+
+	/** A receive is in flight, or has completed with result `recv_res` */
+	bool recv_pending, recv_done;
+	int recv_res;
+
+	/** Number of linked sends in flight, and how many have completed */
+	int nsends, nsends_done;
+	/** Number of transfer queue entries, from the start, being sent */
+	int send_ntransfers;
+	size_t send_len[CHAN_RING_MAX_SENDS];
+	int send_res[CHAN_RING_MAX_SENDS];
+	struct msghdr send_msgs[CHAN_RING_MAX_SENDS];
+	struct iovec *send_vecs;
+	int send_vecs_size;
+};
+
+static int chan_ring_init(struct chan_ring *ring)
+{
+	memset(ring, 0, sizeof(*ring));
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+#ifdef IORING_SETUP_COOP_TASKRUN
+	/* Avoid interrupting the main thread when operations complete */
+	params.flags = IORING_SETUP_COOP_TASKRUN;
+	ring->fd = (int)syscall(
+			__NR_io_uring_setup, CHAN_RING_ENTRIES, &params);
+	if (ring->fd == -1 && errno == EINVAL) {
+		/* Linux < 5.19 */
+		memset(&params, 0, sizeof(params));
+		ring->fd = (int)syscall(__NR_io_uring_setup, CHAN_RING_ENTRIES,
+				&params);
+	}
+#else
+	ring->fd = (int)syscall(
+			__NR_io_uring_setup, CHAN_RING_ENTRIES, &params);
+#endif
+	if (ring->fd == -1) {
+		wp_debug("Failed to create io_uring instance, will poll the channel instead: %s",
+				strerror(errno));
+		return -1;
+	}
+	/* Sends and receives must wait for the socket by themselves, and
+	 * must not need their message headers after submission */
+	uint32_t needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+			  IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_FAST_POLL;
+	if ((params.features & needed) != needed) {
+		wp_debug("io_uring lacks required features (%x), will poll the channel instead",
+				params.features);
+		checked_close(ring->fd);
+		return -1;
+	}
+	ring->map_size = maxu(params.sq_off.array + params.sq_entries *
+							    sizeof(uint32_t),
+			params.cq_off.cqes + params.cq_entries * sizeof(
+							struct io_uring_cqe));
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING);
+	if (ring->map == MAP_FAILED) {
+		wp_error("Failed to map io_uring queues: %s", strerror(errno));
+		checked_close(ring->fd);
+		return -1;
+	}
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		wp_error("Failed to map io_uring submission entries: %s",
+				strerror(errno));
+		munmap(ring->map, ring->map_size);
+		checked_close(ring->fd);
+		return -1;
+	}
+	char *base = ring->map;
+	ring->sq_entries = params.sq_entries;
+	ring->sq_head = (unsigned int *)(base + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(base + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(base + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(base + params.sq_off.array);
+	ring->cq_head = (unsigned int *)(base + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(base + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(base + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+	ring->sqe_tail = *ring->sq_tail;
+	return 0;
+}
+static void chan_ring_cleanup(struct chan_ring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->map, ring->map_size);
+	checked_close(ring->fd);
+	free(ring->send_vecs);
+}
+/* Returns a zeroed submission queue entry, to be submitted by the next
+ * call to chan_ring_enter */
+static struct io_uring_sqe *chan_ring_queue(
+		struct chan_ring *ring, uint64_t user_data)
+{
+	unsigned int head = atomic_load_explicit(
+			(_Atomic unsigned int *)ring->sq_head,
+			memory_order_acquire);
+	if (ring->sqe_tail - head >= ring->sq_entries) {
+		wp_error("io_uring submission queue is full");
+		return NULL;
+	}
+	unsigned int idx = ring->sqe_tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = user_data;
+	ring->sq_array[idx] = idx;
+	ring->sqe_tail++;
+	ring->nqueued++;
+	ring->ninflight++;
+	return sqe;
+}
+/* Submit all queued entries; if `wait` is set, block until at least one
+ * operation has completed. Returns -1 on failure. */
+static int chan_ring_enter(struct chan_ring *ring, bool wait)
+{
+	if (ring->nqueued == 0 && !wait) {
+		return 0;
+	}
+	atomic_store_explicit((_Atomic unsigned int *)ring->sq_tail,
+			ring->sqe_tail, memory_order_release);
+	while (true) {
+		long r = syscall(__NR_io_uring_enter, ring->fd, ring->nqueued,
+				wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+				NULL, 0);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		} else if (r == -1) {
+			wp_error("Failed to submit to io_uring: %s",
+					strerror(errno));
+			return -1;
+		}
+		ring->nqueued -= (unsigned int)r;
+		return 0;
+	}
+}
+/* Record the results of all completed operations */
+static void chan_ring_reap(struct chan_ring *ring)
+{
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = atomic_load_explicit(
+			(_Atomic unsigned int *)ring->cq_tail,
+			memory_order_acquire);
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe =
+				&ring->cqes[head & *ring->cq_mask];
+		uint64_t op = cqe->user_data;
+		if (op == CHAN_OP_RECV) {
+			ring->recv_pending = false;
+			ring->recv_done = true;
+			ring->recv_res = cqe->res;
+		} else if (op >= CHAN_OP_SEND &&
+				op < CHAN_OP_SEND + CHAN_RING_MAX_SENDS) {
+			ring->send_res[op - CHAN_OP_SEND] = cqe->res;
+			ring->nsends_done++;
+		}
+		/* The results of cancellation requests are not needed */
+		ring->ninflight--;
+	}
+	atomic_store_explicit((_Atomic unsigned int *)ring->cq_head, head,
+			memory_order_release);
+}
+/* Cancel all operations and wait for them to finish. This must be done
+ * before the channel fd is closed. The results of a receive are discarded,
+ * while those of sends are kept for ring_finish_sends. */
+static int chan_ring_drain(struct chan_ring *ring)
+{
+	if (ring->recv_pending) {
+		struct io_uring_sqe *sqe =
+				chan_ring_queue(ring, CHAN_OP_CANCEL);
+		if (sqe) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = CHAN_OP_RECV;
+		}
+	}
+	for (int i = 0; i < ring->nsends; i++) {
+		struct io_uring_sqe *sqe =
+				chan_ring_queue(ring, CHAN_OP_CANCEL);
+		if (sqe) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = CHAN_OP_SEND + (uint64_t)i;
+		}
+	}
+	while (ring->ninflight > 0) {
+		if (chan_ring_enter(ring, true) == -1) {
+			return -1;
+		}
+		chan_ring_reap(ring);
+	}
+	ring->recv_done = false;
+	return 0;
+}
+static int chan_ring_recv(
+		struct chan_ring *ring, int chanfd, char *dest, size_t len)
+{
+	struct io_uring_sqe *sqe = chan_ring_queue(ring, CHAN_OP_RECV);
+	if (!sqe) {
+		return ERR_FATAL;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = chanfd;
+	sqe->addr = (uint64_t)(uintptr_t)dest;
+	sqe->len = (uint32_t)minu(len, UINT32_MAX);
+	ring->recv_pending = true;
+	return 0;
+}
+static bool fd_is_socket(int fd)
+{
+	struct stat fsdata;
+	return fstat(fd, &fsdata) == 0 && S_ISSOCK(fsdata.st_mode);
+}
+#endif
+
 static int interpret_chanmsg(struct chan_msg_state *cmsg,
 		struct cross_state *cxs, struct globals *g, bool display_side,
 		char *packet)
@@ -280,7 +576,7 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 	} else if (type == WMSG_ACK_NBLOCKS) {
 		struct wmsg_ack *ackm = (struct wmsg_ack *)packet;
 		if (msgno_gt(ackm->messages_received,
-				    cxs->last_received_msgno)) {
+				    cxs->last_confirmed_msgno)) {
 			cxs->last_confirmed_msgno = ackm->messages_received;
 		}
 		return 0;
@@ -366,6 +662,12 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 			cmsg->proto_fds.zone_end -= cmsg->proto_fds.zone_start;
 		}
 		return 0;
+	} else if (type == WMSG_ZSTD_DICTIONARY) {
+		struct bytebuf msg = {
+				.data = packet,
+				.size = unpadded_size,
+		};
+		return apply_zstd_dictionary(&g->threads, &msg);
 	} else {
 		if (unpadded_size < sizeof(struct wmsg_basic)) {
 			wp_error("Message is too small to contain header+RID, %d bytes",
@@ -381,80 +683,156 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 		wp_debug("Received %s for RID=%d (len %d)",
 				wmsg_type_to_str(type), op_header->remote_id,
 				unpadded_size);
+		if (update_is_async(&g->map, type, op_header->remote_id)) {
+			return apply_update_async(&g->map, &g->threads, type,
+					op_header->remote_id, &msg);
+		}
 		return apply_update(&g->map, &g->threads, &g->render, type,
 				op_header->remote_id, &msg);
 	}
 }
 
+/** Must all updates being applied by worker threads complete before this
+ * message is interpreted? Buffer updates sent in one batch affect disjoint
+ * regions of their buffers, and every batch is followed by the protocol
+ * message that caused it, so only updates that are themselves applied
+ * asynchronously, and acknowledgements, can skip the barrier. */
+static bool needs_incoming_barrier(struct globals *g, const char *packet)
+{
+	uint32_t size_and_type = *(const uint32_t *)packet;
+	enum wmsg_type type = transfer_type(size_and_type);
+	if (type == WMSG_ACK_NBLOCKS) {
+		return false;
+	}
+	if (transfer_size(size_and_type) < sizeof(struct wmsg_basic)) {
+		return true;
+	}
+	const struct wmsg_basic *op_header = (const struct wmsg_basic *)packet;
+	return !update_is_async(&g->map, type, op_header->remote_id);
+}
+
+/* Move the receive buffer contents into a new buffer of at least
+ * `min_size` bytes */
+static int grow_recv_buffer(struct chan_msg_state *cmsg, size_t min_size)
+{
+	size_t new_size = cmsg->recv_size;
+	while (new_size < min_size) {
+		new_size *= 2;
+	}
+	char *new_buffer = create_mirrored_buffer(new_size);
+	if (!new_buffer) {
+		wp_error("Allocation failure, resizing receive buffer to %zu bytes failed",
+				new_size);
+		return ERR_NOMEM;
+	}
+	size_t used = cmsg->recv_end - cmsg->recv_start;
+	memcpy(new_buffer, cmsg->recv_buffer + cmsg->recv_start, used);
+	free_mirrored_buffer(cmsg->recv_buffer, cmsg->recv_size);
+	cmsg->recv_buffer = new_buffer;
+	cmsg->recv_size = new_size;
+	cmsg->recv_scan -= cmsg->recv_start;
+	cmsg->recv_end = used;
+	cmsg->recv_start = 0;
+	return 0;
+}
+/* Find the free part of the receive buffer, which immediately follows the
+ * data already read. The buffer is only enlarged if the message being read
+ * does not fit in it. */
+static int setup_chanmsg_chanread(
+		struct chan_msg_state *cmsg, char **dest, size_t *len)
+{
+	if (cmsg->recv_start == cmsg->recv_end) {
+		/* A fresh packet */
+		cmsg->recv_start = 0;
+		cmsg->recv_end = 0;
+		cmsg->recv_scan = 0;
+	} else if (cmsg->recv_end >= cmsg->recv_start + sizeof(uint32_t)) {
+		uint32_t *header = (uint32_t *)&cmsg->recv_buffer
+						   [cmsg->recv_start];
+		size_t sz = alignz(transfer_size(*header), 4);
+		if (sz > cmsg->recv_size) {
+			int ret = grow_recv_buffer(cmsg, sz);
+			if (ret < 0) {
+				return ret;
+			}
+		}
+	}
+	*dest = cmsg->recv_buffer + cmsg->recv_end;
+	*len = cmsg->recv_size - (cmsg->recv_end - cmsg->recv_start);
+	return 0;
+}
+#ifdef HAS_IO_URING
+/* Start a channel read on the ring, if none is in flight */
+static int submit_chanmsg_chanread(
+		struct chan_msg_state *cmsg, struct chan_ring *ring, int chanfd)
+{
+	if (ring->recv_pending || ring->recv_done) {
+		return 0;
+	}
+	char *dest;
+	size_t len;
+	int ret = setup_chanmsg_chanread(cmsg, &dest, &len);
+	if (ret < 0) {
+		return ret;
+	}
+	return chan_ring_recv(ring, chanfd, dest, len);
+}
+#endif
+
+/* Frame callback events held back from the application can be written to it
+ * once its data in flight is within the budget again */
+static bool held_frames_ready(
+		const struct globals *g, const struct chan_msg_state *cmsg)
+{
+	return !g->inflight_throttle && g->held_frame_events.zone_end > 0 &&
+	       cmsg->state == CM_WAITING_FOR_CHANNEL;
+}
 static int advance_chanmsg_chanread(struct chan_msg_state *cmsg,
 		struct cross_state *cxs, int chanfd, bool display_side,
 		struct globals *g)
 {
-	/* Setup read operation to be able to read a minimum number of bytes,
-	 * wrapping around as early as overlap conditions permit */
+	if (held_frames_ready(g, cmsg)) {
+		struct char_window *held = &g->held_frame_events;
+		if (buf_ensure_size(held->zone_end, 1, &cmsg->proto_write.size,
+				    (void **)&cmsg->proto_write.data) == -1) {
+			wp_error("Allocation failure for message workspace");
+			return ERR_NOMEM;
+		}
+		wp_debug("Releasing %d bytes of held frame callback events",
+				held->zone_end);
+		memcpy(cmsg->proto_write.data, held->data,
+				(size_t)held->zone_end);
+		cmsg->proto_write.zone_start = 0;
+		cmsg->proto_write.zone_end = held->zone_end;
+		held->zone_end = 0;
+		goto next_stage;
+	}
 	if (cmsg->recv_unhandled_messages == 0) {
-		struct iovec vec[2];
-		memset(vec, 0, sizeof(vec));
-		int nvec;
-		if (cmsg->recv_start == cmsg->recv_end) {
-			/* A fresh packet */
-			cmsg->recv_start = 0;
-			cmsg->recv_end = 0;
-			nvec = 1;
-			vec[0].iov_base = cmsg->recv_buffer;
-			vec[0].iov_len = (size_t)(cmsg->recv_size / 2);
-		} else if (cmsg->recv_end <
-				cmsg->recv_start + sizeof(uint32_t)) {
-			/* Didn't quite finish reading the header */
-			int recvsz = (int)cmsg->recv_size;
-			if (buf_ensure_size((int)cmsg->recv_end +
-							    RECV_GOAL_READ_SIZE,
-					    1, &recvsz,
-					    (void **)&cmsg->recv_buffer) ==
-					-1) {
-				wp_error("Allocation failure, resizing receive buffer failed");
-				return ERR_NOMEM;
+		ssize_t r;
+#ifdef HAS_IO_URING
+		if (cxs->ring) {
+			struct chan_ring *ring = cxs->ring;
+			if (!ring->recv_done) {
+				return submit_chanmsg_chanread(
+						cmsg, ring, chanfd);
 			}
-			cmsg->recv_size = (size_t)recvsz;
-
-			nvec = 1;
-			vec[0].iov_base = cmsg->recv_buffer + cmsg->recv_end;
-			vec[0].iov_len = RECV_GOAL_READ_SIZE;
-		} else {
-			/* Continuing an old packet; space made available last
-			 * time */
-			uint32_t *header = (uint32_t *)&cmsg->recv_buffer
-							   [cmsg->recv_start];
-			size_t sz = alignz(transfer_size(*header), 4);
-
-			size_t read_end = cmsg->recv_start + sz;
-			bool wraparound =
-					cmsg->recv_start >= RECV_GOAL_READ_SIZE;
-			if (!wraparound) {
-				read_end = maxu(read_end,
-						cmsg->recv_end +
-								RECV_GOAL_READ_SIZE);
+			ring->recv_done = false;
+			r = ring->recv_res;
+			if (r < 0) {
+				errno = (int)-r;
+				r = -1;
 			}
-			int recvsz = (int)cmsg->recv_size;
-			if (buf_ensure_size((int)read_end, 1, &recvsz,
-					    (void **)&cmsg->recv_buffer) ==
-					-1) {
-				wp_error("Allocation failure, resizing receive buffer failed");
-				return ERR_NOMEM;
-			}
-			cmsg->recv_size = (size_t)recvsz;
-
-			nvec = 1;
-			vec[0].iov_base = cmsg->recv_buffer + cmsg->recv_end;
-			vec[0].iov_len = read_end - cmsg->recv_end;
-			if (wraparound) {
-				nvec = 2;
-				vec[1].iov_base = cmsg->recv_buffer;
-				vec[1].iov_len = cmsg->recv_start;
+		} else
+#endif
+		{
+			char *dest;
+			size_t len;
+			int ret = setup_chanmsg_chanread(cmsg, &dest, &len);
+			if (ret < 0) {
+				return ret;
 			}
+			r = read(chanfd, dest, len);
 		}
-
-		ssize_t r = readv(chanfd, vec, nvec);
 		if (r == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
 			wp_debug("Read would block");
 			return 0;
@@ -464,49 +842,32 @@ static int advance_chanmsg_chanread(struct chan_msg_state *cmsg,
 		} else if (r == -1) {
 			wp_error("chanfd read failure: %s", strerror(errno));
 			return ERR_FATAL;
-		} else {
-			if (nvec == 2 && (size_t)r >= vec[0].iov_len) {
-				/* Complete parsing this message */
-				int cm_ret = interpret_chanmsg(cmsg, cxs, g,
-						display_side,
-						cmsg->recv_buffer +
-								cmsg->recv_start);
-				if (cm_ret < 0) {
-					return cm_ret;
-				}
-
-				cmsg->recv_start = 0;
-				cmsg->recv_end = (size_t)r - vec[0].iov_len;
-
-				if (cmsg->proto_write.zone_start <
-						cmsg->proto_write.zone_end) {
-					goto next_stage;
-				}
-			} else {
-				cmsg->recv_end += (size_t)r;
-			}
 		}
+		cmsg->recv_end += (size_t)r;
 	}
 
-	/* Recount unhandled messages */
-	cmsg->recv_unhandled_messages = 0;
-	size_t i = cmsg->recv_start;
-	while (i + sizeof(uint32_t) <= cmsg->recv_end) {
-		uint32_t *header = (uint32_t *)&cmsg->recv_buffer[i];
+	/* Count newly completed messages */
+	while (cmsg->recv_scan + sizeof(uint32_t) <= cmsg->recv_end) {
+		uint32_t *header = (uint32_t *)&cmsg->recv_buffer
+						   [cmsg->recv_scan];
 		size_t sz = alignz(transfer_size(*header), 4);
 		if (sz == 0) {
 			wp_error("Encountered malformed zero size packet");
 			return ERR_FATAL;
 		}
-		i += sz;
-		if (i > cmsg->recv_end) {
+		if (cmsg->recv_scan + sz > cmsg->recv_end) {
 			break;
 		}
+		cmsg->recv_scan += sz;
 		cmsg->recv_unhandled_messages++;
 	}
 
 	while (cmsg->recv_unhandled_messages > 0) {
 		char *packet_start = &cmsg->recv_buffer[cmsg->recv_start];
+		if (!incoming_work_done(&g->threads) &&
+				needs_incoming_barrier(g, packet_start)) {
+			goto wait_for_workers;
+		}
 		uint32_t *header = (uint32_t *)packet_start;
 		size_t sz = transfer_size(*header);
 		int cm_ret = interpret_chanmsg(
@@ -516,11 +877,28 @@ static int advance_chanmsg_chanread(struct chan_msg_state *cmsg,
 		}
 		cmsg->recv_start += alignz(sz, 4);
 		cmsg->recv_unhandled_messages--;
+		if (cmsg->recv_start >= cmsg->recv_size) {
+			/* Continue from the first copy of the buffer */
+			cmsg->recv_start -= cmsg->recv_size;
+			cmsg->recv_scan -= cmsg->recv_size;
+			cmsg->recv_end -= cmsg->recv_size;
+		}
 
 		if (cmsg->proto_write.zone_start < cmsg->proto_write.zone_end) {
 			goto next_stage;
 		}
 	}
+	if (!incoming_work_done(&g->threads)) {
+		/* The receive buffer may not be modified while worker threads
+		 * are still reading messages from it */
+		goto wait_for_workers;
+	}
+#ifdef HAS_IO_URING
+	if (cxs->ring) {
+		/* Keep a read in flight while waiting for the channel */
+		return submit_chanmsg_chanread(cmsg, cxs->ring, chanfd);
+	}
+#endif
 	return 0;
 next_stage:
 	/* When protocol data was sent, switch to trying to write the protocol
@@ -528,6 +906,62 @@ next_stage:
 	cmsg->state = CM_WAITING_FOR_PROGRAM;
 	DTRACE_PROBE(waypipe, chanmsg_program_wait);
 	return 0;
+wait_for_workers:
+	cmsg->state = CM_WAITING_FOR_WORKERS;
+	return 0;
+}
+/* Run a task on the thread handling transfers in one direction, without
+ * holding the state lock. */
+static void run_local_task(
+		struct globals *g, struct task_data *task, bool incoming_side)
+{
+	struct thread_pool *pool = &g->threads;
+	struct thread_data *local = &pool->threads[0];
+	int own_pipe_w = pool->selfpipe_w;
+	if (incoming_side && pool->incoming_local) {
+		local = pool->incoming_local;
+		own_pipe_w = pool->incoming_selfpipe_w;
+	}
+	if (g->state_lock) {
+		pthread_mutex_unlock(g->state_lock);
+	}
+	run_task(task, local);
+	finish_work_task(pool, task);
+	notify_task_done(pool, task->type);
+	if (pool->incoming_local &&
+			(task->type == TASK_APPLY_UPDATE) != incoming_side) {
+		/* To skip the next poll */
+		uint8_t triv = 0;
+		if (write(own_pipe_w, &triv, 1) == -1) {
+			wp_error("Failed to write to self-pipe");
+		}
+	}
+	if (g->state_lock) {
+		pthread_mutex_lock(g->state_lock);
+	}
+}
+static int advance_chanmsg_workers(struct chan_msg_state *cmsg,
+		struct cross_state *cxs, int chanfd, bool display_side,
+		struct globals *g)
+{
+	bool is_done = false;
+	struct task_data task;
+	bool has_task = request_work_task(&g->threads, &task, &is_done);
+
+	/* Run a task ourselves, making use of the main thread */
+	if (has_task) {
+		run_local_task(g, &task, true);
+	}
+
+	if (!incoming_work_done(&g->threads)) {
+		return 0;
+	}
+	int error = atomic_exchange(&g->threads.incoming_error, 0);
+	if (error < 0) {
+		return error;
+	}
+	cmsg->state = CM_WAITING_FOR_CHANNEL;
+	return advance_chanmsg_chanread(cmsg, cxs, chanfd, display_side, g);
 }
 static int advance_chanmsg_progwrite(struct chan_msg_state *cmsg, int progfd,
 		bool display_side, struct globals *g)
@@ -600,13 +1034,32 @@ static int advance_chanmsg_transfer(struct globals *g,
 				cmsg, cxs, chanfd, display_side, g);
 	} else if (cmsg->state == CM_WAITING_FOR_PROGRAM) {
 		return advance_chanmsg_progwrite(cmsg, progfd, display_side, g);
+	} else if (cmsg->state == CM_WAITING_FOR_WORKERS) {
+		return advance_chanmsg_workers(
+				cmsg, cxs, chanfd, display_side, g);
 	}
 	return 0;
 }
 
+/* Move `confirm_end` past the blocks which the other side has acknowledged
+ * since the last call, and stop counting their bytes as unconfirmed. Only
+ * the blocks after `confirm_end` are checked, so this does not scan the
+ * queue. */
+static void confirm_transfers(
+		struct transfer_queue *td, uint32_t inclusive_cutoff)
+{
+	while (td->confirm_end < td->end &&
+			msgno_gt(inclusive_cutoff,
+					td->meta[td->confirm_end].msgno)) {
+		td->unconfirmed_bytes -= td->vecs[td->confirm_end].iov_len;
+		td->confirm_end++;
+	}
+}
+
 static void clear_old_transfers(
 		struct transfer_queue *td, uint32_t inclusive_cutoff)
 {
+	confirm_transfers(td, inclusive_cutoff);
 	for (int i = 0; i < td->end; i++) {
 		if (td->vecs[i].iov_len == 0) {
 			wp_error("Unexpected zero sized item %d [%d,%d)", i,
@@ -621,6 +1074,10 @@ static void clear_old_transfers(
 		if (!td->meta[i].static_alloc) {
 			free(td->vecs[i].iov_base);
 		}
+		if (td->meta[i].borrowed) {
+			shared_buffer_unref(td->meta[i].borrowed);
+			td->meta[i].borrowed = NULL;
+		}
 		td->vecs[i].iov_base = NULL;
 		td->vecs[i].iov_len = 0;
 		k = i + 1;
@@ -631,6 +1088,31 @@ static void clear_old_transfers(
 		memmove(td->vecs, td->vecs + k, nshift * sizeof(td->vecs[0]));
 		td->start -= k;
 		td->end -= k;
+		td->confirm_end -= k;
+	}
+}
+
+/* Mark the next `nbytes` of the transfer queue as written */
+static void transfer_queue_advance(struct transfer_queue *td, size_t nbytes)
+{
+	while (nbytes > 0 && td->start < td->end) {
+		/* Skip past zero-length blocks */
+		if (td->vecs[td->start].iov_len == 0) {
+			td->start++;
+			continue;
+		}
+		size_t left = td->vecs[td->start].iov_len -
+			      td->partial_write_amt;
+		if (left > nbytes) {
+			/* Block partially completed */
+			td->partial_write_amt += nbytes;
+			nbytes = 0;
+		} else {
+			/* Block completed */
+			td->partial_write_amt = 0;
+			nbytes -= left;
+			td->start++;
+		}
 	}
 }
 
@@ -662,31 +1144,304 @@ static int partial_write_transfer(int chanfd, struct transfer_queue *td,
 			return ERR_FATAL;
 		}
 
-		size_t uwr = (size_t)wr;
 		*total_written += (int)wr;
-		while (uwr > 0 && td->start < td->end) {
-			/* Skip past zero-length blocks */
-			if (td->vecs[td->start].iov_len == 0) {
-				td->start++;
-				continue;
-			}
-			size_t left = td->vecs[td->start].iov_len -
-				      td->partial_write_amt;
-			if (left > uwr) {
-				/* Block partially completed */
-				td->partial_write_amt += uwr;
-				uwr = 0;
-			} else {
-				/* Block completed */
-				td->partial_write_amt = 0;
-				uwr -= left;
-				td->start++;
-			}
+		transfer_queue_advance(td, (size_t)wr);
+	}
+	return 0;
+}
+
+#ifdef HAS_IO_URING
+/* Advance the transfer queue past the data written by the completed sends,
+ * returning the errno value with which a send failed, if any */
+static int ring_finish_sends(struct chan_ring *ring, struct transfer_queue *td,
+		int *total_written)
+{
+	/* Each send runs only after the previous one was complete */
+	size_t uwr = 0;
+	int err = 0;
+	for (int i = 0; i < ring->nsends; i++) {
+		if (ring->send_res[i] < 0) {
+			err = -ring->send_res[i];
+			break;
+		}
+		uwr += (size_t)ring->send_res[i];
+		if ((size_t)ring->send_res[i] < ring->send_len[i]) {
+			break;
+		}
+	}
+	ring->nsends = 0;
+	ring->nsends_done = 0;
+	ring->send_ntransfers = 0;
+
+	*total_written += (int)uwr;
+	transfer_queue_advance(td, uwr);
+	return err;
+}
+/* Stop using the ring for the channel, so that the channel fd can be
+ * closed or replaced; data that was sent is removed from the queue */
+static void detach_chan_ring(
+		struct cross_state *cxs, struct way_msg_state *wmsg)
+{
+	if (!cxs->ring) {
+		return;
+	}
+	if (chan_ring_drain(cxs->ring) == -1) {
+		wp_error("Failed to stop channel operations on io_uring");
+	}
+	(void)ring_finish_sends(cxs->ring, &wmsg->transfers,
+			&wmsg->total_written);
+	cxs->ring = NULL;
+}
+/* Like partial_write_transfer, but sending the queue contents with a chain of
+ * linked sendmsg operations on the ring, which complete asynchronously. The
+ * entries being sent may not be modified until the next call after the
+ * sends have completed. */
+static int ring_write_transfer(struct chan_ring *ring, int chanfd,
+		struct transfer_queue *td, int *total_written, int max_iov)
+{
+	if (ring->nsends > 0) {
+		if (ring->nsends_done < ring->nsends) {
+			return 0;
+		}
+		int err = ring_finish_sends(ring, td, total_written);
+		if (err == ECONNRESET || err == EPIPE) {
+			wp_debug("Channel connection closed");
+			return ERR_DISCONN;
+		} else if (err != 0 && err != EAGAIN && err != EINTR) {
+			wp_error("chanfd write failure: %s", strerror(err));
+			return ERR_FATAL;
+		}
+	}
+	if (td->start == td->end) {
+		return 0;
+	}
+
+	int count = min(td->end - td->start, CHAN_RING_MAX_SENDS * max_iov);
+	if (buf_ensure_size(count, sizeof(struct iovec), &ring->send_vecs_size,
+			    (void **)&ring->send_vecs) == -1) {
+		wp_error("Failed to allocate space for send vectors");
+		return ERR_NOMEM;
+	}
+	memcpy(ring->send_vecs, &td->vecs[td->start],
+			(size_t)count * sizeof(struct iovec));
+	ring->send_vecs[0].iov_base =
+			(char *)ring->send_vecs[0].iov_base +
+			td->partial_write_amt;
+	ring->send_vecs[0].iov_len -= td->partial_write_amt;
+
+	int nsends = ceildiv(count, max_iov);
+	for (int i = 0; i < nsends; i++) {
+		struct io_uring_sqe *sqe = chan_ring_queue(
+				ring, CHAN_OP_SEND + (uint64_t)i);
+		if (!sqe) {
+			return ERR_FATAL;
+		}
+		int first = i * max_iov;
+		int n = min(count - first, max_iov);
+		struct msghdr *msg = &ring->send_msgs[i];
+		memset(msg, 0, sizeof(*msg));
+		msg->msg_iov = &ring->send_vecs[first];
+		msg->msg_iovlen = (size_t)n;
+		ring->send_len[i] = 0;
+		for (int k = 0; k < n; k++) {
+			ring->send_len[i] += ring->send_vecs[first + k].iov_len;
+		}
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = chanfd;
+		sqe->addr = (uint64_t)(uintptr_t)msg;
+		sqe->len = 1;
+		/* With MSG_WAITALL, a short send breaks the chain, so that
+		 * later sends can not skip over unsent data */
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		if (i < nsends - 1) {
+			sqe->flags = IOSQE_IO_LINK;
+		}
+	}
+	ring->nsends = nsends;
+	ring->send_ntransfers = count;
+	return 0;
+}
+#endif
+
+/* Only cycles sending at least this many bytes are used to adjust the
+ * compression level */
+#define LEVEL_MIN_CYCLE_BYTES 16384
+
+static void init_level_control(
+		struct level_control *ctrl, const struct main_config *config)
+{
+	memset(ctrl, 0, sizeof(*ctrl));
+	ctrl->enabled = config->adaptive_level &&
+			config->compression != COMP_NONE;
+	/* Levels past these are much slower, for little gain */
+	if (config->compression == COMP_LZ4) {
+		ctrl->min_level = -10;
+		ctrl->max_level = 12;
+	} else {
+		ctrl->min_level = -10;
+		ctrl->max_level = 19;
+	}
+}
+
+static int64_t level_control_elapsed(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)(now.tv_sec - since->tv_sec) * 1000000000LL +
+	       (int64_t)(now.tv_nsec - since->tv_nsec);
+}
+
+/* Record that `nbytes` were just written to the channel */
+static void level_control_note_write(struct level_control *ctrl, int nbytes)
+{
+	if (!ctrl->enabled || !ctrl->blocked) {
+		return;
+	}
+	int64_t elapsed = level_control_elapsed(&ctrl->blocked_since);
+	if (elapsed > 0) {
+		ctrl->blocked_ns += elapsed;
+		ctrl->blocked_bytes += nbytes;
+	}
+	ctrl->blocked = false;
+}
+
+/* Record that the last write left data queued. This is called after the
+ * main thread is done with its other work, so that the time spent on it is
+ * not mistaken for time waiting for the channel. */
+static void level_control_note_blocked(struct level_control *ctrl)
+{
+	if (!ctrl->enabled) {
+		return;
+	}
+	ctrl->blocked = true;
+	clock_gettime(CLOCK_MONOTONIC, &ctrl->blocked_since);
+}
+
+/* At the end of a cycle, when no compression tasks are running, update the
+ * estimated channel speed, and move the compression level one step toward
+ * the point where compressing the cycle's data takes as long as sending it;
+ * past that point, the time until the data reaches the other side is
+ * limited by compression, and before it, by the channel. */
+static void level_control_end_cycle(struct level_control *ctrl,
+		struct thread_pool *pool, int cycle_bytes)
+{
+	unsigned long long comp_ns =
+			atomic_exchange(&pool->compression_time, 0);
+	if (!ctrl->enabled) {
+		return;
+	}
+	if (ctrl->blocked_ns > 0) {
+		double rate = (double)ctrl->blocked_bytes * 1e9 /
+			      (double)ctrl->blocked_ns;
+		if (ctrl->drain_rate > 0) {
+			rate = 0.7 * ctrl->drain_rate + 0.3 * rate;
+		}
+		ctrl->drain_rate = rate;
+	} else if (ctrl->drain_rate > 0 && cycle_bytes > 0) {
+		/* The channel took everything without blocking, so it is
+		 * faster than estimated */
+		ctrl->drain_rate *= 1.25;
+		if (ctrl->drain_rate > 1e11) {
+			ctrl->drain_rate = 1e11;
+		}
+	}
+	ctrl->blocked_ns = 0;
+	ctrl->blocked_bytes = 0;
+
+	if (comp_ns == 0 || cycle_bytes < LEVEL_MIN_CYCLE_BYTES) {
+		return;
+	}
+	double comp_time = (double)comp_ns / pool->nthreads;
+	double send_time = 0.;
+	if (ctrl->drain_rate > 0) {
+		send_time = (double)cycle_bytes * 1e9 / ctrl->drain_rate;
+	}
+	int level = pool->compression_level;
+	if (send_time > 1.5 * comp_time) {
+		level++;
+	} else if (comp_time > 1.5 * send_time) {
+		level--;
+	}
+	level = clamp(level, ctrl->min_level, ctrl->max_level);
+	if (level != pool->compression_level) {
+		wp_debug("Compression level %d -> %d: compression %.3f ms, sending %.3f ms at %.3f MB/s",
+				pool->compression_level, level,
+				comp_time * 1e-6, send_time * 1e-6,
+				ctrl->drain_rate * 1e-6);
+		pool->compression_level = level;
+	}
+}
+
+/* Number of bytes in the transfer queue which are not yet written */
+static size_t queued_transfer_bytes(const struct transfer_queue *td)
+{
+	size_t nbytes = 0;
+	for (int i = td->start; i < td->end; i++) {
+		nbytes += td->vecs[i].iov_len;
+	}
+	return nbytes - td->partial_write_amt;
+}
+/* Do any of the queued transfers send data straight out of a buffer mirror,
+ * which updates computed for the next cycle could change? */
+static bool transfers_borrow_pending(const struct transfer_queue *td)
+{
+	for (int i = td->start; i < td->end; i++) {
+		if (td->meta[i].borrowed) {
+			return true;
 		}
 	}
+	return false;
+}
+
+/* Write what the channel accepts from the transfer queue, adding the amount
+ * to `total_written`; sets `chan_blocked` if data is left queued */
+static int write_queued_transfers(struct way_msg_state *wmsg,
+		struct cross_state *cxs, int chanfd, int *total_written,
+		bool *chan_blocked)
+{
+	int written_before = *total_written;
+	/* Sends on the ring may still be in flight from the last call */
+	bool sending = false;
+	int ret;
+#ifdef HAS_IO_URING
+	if (cxs->ring) {
+		sending = cxs->ring->nsends_done < cxs->ring->nsends;
+		ret = ring_write_transfer(cxs->ring, chanfd, &wmsg->transfers,
+				total_written, wmsg->max_iov);
+	} else
+#endif
+	{
+		ret = partial_write_transfer(chanfd, &wmsg->transfers,
+				total_written, wmsg->max_iov);
+	}
+	(void)cxs;
+	if (ret < 0) {
+		return ret;
+	}
+	size_t nwritten = (size_t)(*total_written - written_before);
+	wmsg->drain_left -= (size_t)minu(wmsg->drain_left, nwritten);
+	if (!sending) {
+		level_control_note_write(&wmsg->level_ctrl, (int)nwritten);
+	}
+	*chan_blocked = !sending && wmsg->transfers.start < wmsg->transfers.end;
 	return 0;
 }
 
+/* Add the messages which follow the computed updates to the transfer queue */
+static void queue_trailing_transfers(struct way_msg_state *wmsg)
+{
+	if (wmsg->ntrailing == 0) {
+		return;
+	}
+	for (int i = 0; i < wmsg->ntrailing; i++) {
+		transfer_add(&wmsg->transfers, wmsg->trailing[i].iov_len,
+				wmsg->trailing[i].iov_base);
+	}
+
+	wmsg->ntrailing = 0;
+	memset(wmsg->trailing, 0, sizeof(wmsg->trailing));
+}
+
 static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 		struct cross_state *cxs, struct globals *g, int chanfd,
 		bool display_side)
@@ -716,18 +1471,32 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 						    .msgno;
 		}
 
+		/* Entries before this point are being written */
+		int busy_end = (wmsg->transfers.partial_write_amt > 0)
+					       ? wmsg->transfers.start + 1
+					       : wmsg->transfers.start;
+#ifdef HAS_IO_URING
+		if (cxs->ring) {
+			int nsending = cxs->ring->send_ntransfers;
+			busy_end = max(busy_end,
+					wmsg->transfers.start + nsending);
+		}
+#endif
 		/* This is the next point where messages can be changed */
-		int next_slot = (wmsg->transfers.partial_write_amt > 0)
-						? wmsg->transfers.start + 1
-						: wmsg->transfers.start;
-		struct wmsg_ack *not_in_prog_msg = NULL;
+		int next_slot = busy_end;
+		/* Do not split a message from its borrowed data */
+		while (next_slot < wmsg->transfers.end &&
+				wmsg->transfers.meta[next_slot].borrowed) {
+			next_slot++;
+		}
+		bool in_progress[2] = {false, false};
 		struct wmsg_ack *queued_msg = NULL;
 		for (size_t i = 0; i < 2; i++) {
-			if (wmsg->transfers.partial_write_amt > 0 &&
-					wmsg->transfers.vecs[wmsg->transfers.start]
-									.iov_base ==
-							&wmsg->ack_msgs[i]) {
-				not_in_prog_msg = &wmsg->ack_msgs[1 - i];
+			for (int k = wmsg->transfers.start; k < busy_end; k++) {
+				if (wmsg->transfers.vecs[k].iov_base ==
+						&wmsg->ack_msgs[i]) {
+					in_progress[i] = true;
+				}
 			}
 			if (next_slot < wmsg->transfers.end &&
 					wmsg->transfers.vecs[next_slot].iov_base ==
@@ -737,14 +1506,15 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 		}
 
 		if (!queued_msg) {
-			/* Insert a message--which is not partially written--
+			/* Insert a message--which is not being written--
 			 * in the next available slot, pushing forward other
 			 * messages */
-			if (!not_in_prog_msg) {
-				queued_msg = &wmsg->ack_msgs[0];
-			} else {
-				queued_msg = not_in_prog_msg;
+			if (in_progress[0] && in_progress[1]) {
+				/* Try again after the sends complete */
+				goto ackmsg_fail;
 			}
+			queued_msg = in_progress[0] ? &wmsg->ack_msgs[1]
+						    : &wmsg->ack_msgs[0];
 
 			if (next_slot < wmsg->transfers.end) {
 				size_t nmoved = (size_t)(wmsg->transfers.end -
@@ -765,7 +1535,14 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 			wmsg->transfers.vecs[next_slot].iov_base = queued_msg;
 			wmsg->transfers.meta[next_slot].msgno = ack_msgno;
 			wmsg->transfers.meta[next_slot].static_alloc = true;
+			wmsg->transfers.meta[next_slot].borrowed = NULL;
 			wmsg->transfers.end++;
+			if (next_slot < wmsg->transfers.confirm_end) {
+				wmsg->transfers.confirm_end++;
+			} else {
+				wmsg->transfers.unconfirmed_bytes +=
+						sizeof(struct wmsg_ack);
+			}
 		}
 
 		/* Modify the message which is now next up in the transfer
@@ -777,8 +1554,9 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 	ackmsg_fail:;
 	}
 
-	int ret = partial_write_transfer(chanfd, &wmsg->transfers,
-			&wmsg->total_written, wmsg->max_iov);
+	bool chan_blocked = false;
+	int ret = write_queued_transfers(wmsg, cxs, chanfd,
+			&wmsg->total_written, &chan_blocked);
 	if (ret < 0) {
 		return ret;
 	}
@@ -789,16 +1567,7 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 
 	/* Run a task ourselves, making use of the main thread */
 	if (has_task) {
-		run_task(&task, &g->threads.threads[0]);
-
-		pthread_mutex_lock(&g->threads.work_mutex);
-		g->threads.tasks_in_progress--;
-		pthread_mutex_unlock(&g->threads.work_mutex);
-		/* To skip the next poll */
-		uint8_t triv = 0;
-		if (write(g->threads.selfpipe_w, &triv, 1) == -1) {
-			wp_error("Failed to write to self-pipe");
-		}
+		run_local_task(g, &task, false);
 	}
 
 	if (is_done) {
@@ -808,63 +1577,96 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 		(void)transfer_load_async(&wmsg->transfers);
 	}
 
-	if (is_done && wmsg->ntrailing > 0) {
-		for (int i = 0; i < wmsg->ntrailing; i++) {
-			transfer_add(&wmsg->transfers,
-					wmsg->trailing[i].iov_len,
-					wmsg->trailing[i].iov_base);
-		}
-
-		wmsg->ntrailing = 0;
-		memset(wmsg->trailing, 0, sizeof(wmsg->trailing));
+	if (is_done) {
+		queue_trailing_transfers(wmsg);
 	}
 
-	if (wmsg->transfers.start == wmsg->transfers.end && is_done) {
-		for (struct shadow_fd_link *lcur = g->map.link.l_next,
+	/* Once all messages of this cycle are queued, the next cycle can
+	 * start reading from the program while they are written */
+	bool written = wmsg->transfers.start == wmsg->transfers.end;
+	bool may_overlap = wmsg->drain_left == 0 &&
+			   !transfers_borrow_pending(&wmsg->transfers);
+	if (is_done && wmsg->ntrailing == 0 && (written || may_overlap)) {
+		for (struct shadow_fd_link *lcur = g->map.work.l_next,
 					   *lnxt = lcur->l_next;
-				lcur != &g->map.link;
+				lcur != &g->map.work;
 				lcur = lnxt, lnxt = lcur->l_next) {
 			/* Note: finish_update() may delete `cur` */
-			struct shadow_fd *cur = (struct shadow_fd *)lcur;
+			struct shadow_fd *cur = shadow_from_work_link(lcur);
 			finish_update(cur);
 			destroy_shadow_if_unreferenced(cur);
 		}
 
-		/* Reset work queue */
-		pthread_mutex_lock(&g->threads.work_mutex);
-		if (g->threads.stack_count > 0 ||
-				g->threads.tasks_in_progress > 0) {
+		/* Check work queue */
+		if (atomic_load(&g->threads.tasks_in_progress) > 0) {
 			wp_error("Multithreading state failure");
 		}
-		g->threads.do_work = false;
-		g->threads.stack_count = 0;
-		g->threads.tasks_in_progress = 0;
-		pthread_mutex_unlock(&g->threads.work_mutex);
 
 		DTRACE_PROBE(waypipe, channel_write_end);
-		size_t unacked_bytes = 0;
-		for (int i = 0; i < wmsg->transfers.end; i++) {
-			unacked_bytes += wmsg->transfers.vecs[i].iov_len;
-		}
+		size_t queued_bytes = queued_transfer_bytes(&wmsg->transfers);
+		size_t budget = display_side ? 0 : g->config->max_inflight;
+
+		wp_debug("Sent %d-byte message from %s to channel; %zu-bytes in flight (budget %zu, 0=none), %zu still queued",
+				wmsg->total_written, progdesc,
+				wmsg->transfers.unconfirmed_bytes, budget,
+				queued_bytes);
 
-		wp_debug("Sent %d-byte message from %s to channel; %zu-bytes in flight",
-				wmsg->total_written, progdesc, unacked_bytes);
+		/* The bytes written in this cycle include the end of the last
+		 * cycle's messages, but not the end of this one's */
+		int cycle_bytes = wmsg->total_written -
+				  (int)wmsg->cycle_drain + (int)queued_bytes;
+		level_control_end_cycle(
+				&wmsg->level_ctrl, &g->threads, cycle_bytes);
 
 		/* do not delete the used transfers yet; we need a remote
 		 * acknowledgement */
 		wmsg->total_written = 0;
+		wmsg->drain_left = queued_bytes;
 		wmsg->state = WM_WAITING_FOR_PROGRAM;
+	} else if (chan_blocked) {
+		level_control_note_blocked(&wmsg->level_ctrl);
 	}
 	return 0;
 }
-static int advance_waymsg_progread(struct way_msg_state *wmsg,
+/* Protocol messages read before the cycle which sends them starts, or held
+ * back while the channel is congested, are limited to this many bytes */
+#define HELD_MESSAGE_MAX_BYTES (1 << 16)
+
+/* With --coalesce, while the last cycle's messages are still being written,
+ * the application's messages from its first buffer commit on are held back,
+ * so that the damage of successive commits merges, and buffer updates are
+ * computed once, for the newest contents. Messages before that commit, pipe
+ * data, and new buffers are still sent. */
+static bool waymsg_coalescing(const struct way_msg_state *wmsg,
+		const struct globals *g, bool display_side)
+{
+	return g->config->coalesce && !display_side && wmsg->drain_left > 0 &&
+	       wmsg->proto_write.zone_end < HELD_MESSAGE_MAX_BYTES;
+}
+/* Is the shadow a buffer whose update waits for the commits using it? */
+static bool shadow_update_held(const struct shadow_fd *sfd)
+{
+	return !sfd->only_here &&
+	       (sfd->type == FDC_FILE || sfd->type == FDC_DMABUF ||
+			       sfd->type == FDC_DMAVID_IR);
+}
+/* While the last cycle's updates are computed and written, the program's
+ * next messages are read and parsed, so that the next cycle can collect the
+ * updates they make as soon as it starts */
+static bool waymsg_reading_ahead(const struct way_msg_state *wmsg)
+{
+	return wmsg->state == WM_WAITING_FOR_CHANNEL &&
+	       wmsg->proto_write.zone_end < HELD_MESSAGE_MAX_BYTES;
+}
+/* Read from the program, and parse the messages, appending them to those in
+ * `proto_write`. Sets `new_proto_data` if anything was read. */
+static int read_program_messages(struct way_msg_state *wmsg,
 		struct globals *g, int progfd, bool display_side,
-		bool progsock_readable)
+		bool progsock_readable, bool *new_proto_data)
 {
 	const char *progdesc = display_side ? "compositor" : "application";
-	// We have data to read from programs/pipes
-	bool new_proto_data = false;
 	int old_fbuffer_end = wmsg->fds.zone_end;
+	*new_proto_data = false;
 	if (progsock_readable) {
 		// Read /once/
 		ssize_t rc = iovec_read(progfd,
@@ -886,27 +1688,29 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 		} else {
 			// We have successfully read some data.
 			wmsg->proto_read.zone_end += (int)rc;
-			new_proto_data = true;
+			*new_proto_data = true;
 		}
 	}
 
-	if (new_proto_data) {
+	if (*new_proto_data) {
 		wp_debug("Read %d new file descriptors, have %d total now",
 				wmsg->fds.zone_end - old_fbuffer_end,
 				wmsg->fds.zone_end);
 
-		if (buf_ensure_size(wmsg->proto_read.size + 1024, 1,
-				    &wmsg->proto_write.size,
+		int write_space = wmsg->proto_write.zone_end +
+				  wmsg->proto_read.size + 1024;
+		if (buf_ensure_size(write_space, 1, &wmsg->proto_write.size,
 				    (void **)&wmsg->proto_write.data) == -1) {
 			wp_error("Allocation failure for message workspace");
 			return ERR_NOMEM;
 		}
 
-		wmsg->proto_write.zone_start = 0;
-		wmsg->proto_write.zone_end = 0;
+		/* Append to any messages being held back */
+		wmsg->proto_write.zone_start = wmsg->proto_write.zone_end;
 		parse_and_prune_messages(g, display_side, !display_side,
 				&wmsg->proto_read, &wmsg->proto_write,
 				&wmsg->fds);
+		wmsg->proto_write.zone_start = 0;
 
 		/* Recycle partial message bytes */
 		if (wmsg->proto_read.zone_start > 0) {
@@ -923,15 +1727,40 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 			wmsg->proto_read.zone_start = 0;
 		}
 	}
+	return 0;
+}
+static int advance_waymsg_progread(struct way_msg_state *wmsg,
+		struct globals *g, int progfd, bool display_side,
+		bool progsock_readable)
+{
+	const char *progdesc = display_side ? "compositor" : "application";
+	// We have data to read from programs/pipes
+	bool new_proto_data = false;
+	/* Transfers before this may be left from the last cycle */
+	int old_transfers_end = wmsg->transfers.end;
+	int ret = read_program_messages(wmsg, g, progfd, display_side,
+			progsock_readable, &new_proto_data);
+	if (ret < 0) {
+		return ret;
+	}
+
+	bool coalescing = waymsg_coalescing(wmsg, g, display_side);
 
 	read_readable_pipes(&g->map);
 
-	for (struct shadow_fd_link *lcur = g->map.link.l_next,
+	/* Any new dictionary must be sent before the data compressed with it */
+	update_zstd_dictionary(&g->threads, &wmsg->transfers);
+
+	for (struct shadow_fd_link *lcur = g->map.work.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &g->map.link;
+			lcur != &g->map.work;
 			lcur = lnxt, lnxt = lcur->l_next) {
 		/* Note: finish_update() may delete `cur` */
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+		struct shadow_fd *cur = shadow_from_work_link(lcur);
+		if (coalescing && shadow_update_held(cur)) {
+			/* Merge the damage of further commits first */
+			continue;
+		}
 		collect_update(&g->threads, cur, &wmsg->transfers,
 				g->config->old_video_mode);
 		/* collecting updates can reset `pipe.remote_can_X` state, so
@@ -941,14 +1770,21 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 
 	int num_mt_tasks = start_parallel_work(
 			&g->threads, &wmsg->transfers.async_recv_queue);
+	if (num_mt_tasks == -1) {
+		return ERR_NOMEM;
+	}
 
-	if (new_proto_data) {
+	/* The buffer updates for a commit must arrive before it does */
+	bool holding = coalescing && g->buffer_committed;
+	int nsend_fds = holding ? g->commit_nfds : wmsg->fds.zone_start;
+	int nsend_bytes = holding ? g->commit_offset
+				  : wmsg->proto_write.zone_end;
+	if (nsend_fds > 0 || nsend_bytes > 0) {
 		/* Send all file descriptors which have been used by the
 		 * protocol parser, translating them if this has not already
 		 * been done */
-		if (wmsg->fds.zone_start > 0) {
-			size_t act_size = (size_t)wmsg->fds.zone_start *
-							  sizeof(int32_t) +
+		if (nsend_fds > 0) {
+			size_t act_size = (size_t)nsend_fds * sizeof(int32_t) +
 					  sizeof(uint32_t);
 			uint32_t *msg = malloc(act_size);
 			if (!msg) {
@@ -961,30 +1797,28 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 			int32_t *rbuffer = (int32_t *)(msg + 1);
 
 			/* Translate and adjust refcounts */
-			if (translate_fds(&g->map, &g->render,
-					    wmsg->fds.zone_start,
+			if (translate_fds(&g->map, &g->render, nsend_fds,
 					    wmsg->fds.data, rbuffer) == -1) {
 				free(msg);
 				return ERR_FATAL;
 			}
-			decref_transferred_rids(
-					&g->map, wmsg->fds.zone_start, rbuffer);
-			memmove(wmsg->fds.data,
-					wmsg->fds.data + wmsg->fds.zone_start,
+			close_fd_aliases(&g->map);
+			decref_transferred_rids(&g->map, nsend_fds, rbuffer);
+			memmove(wmsg->fds.data, wmsg->fds.data + nsend_fds,
 					sizeof(int) * (size_t)(wmsg->fds.zone_end -
-								      wmsg->fds.zone_start));
-			wmsg->fds.zone_end -= wmsg->fds.zone_start;
-			wmsg->fds.zone_start = 0;
+								      nsend_fds));
+			wmsg->fds.zone_end -= nsend_fds;
+			wmsg->fds.zone_start -= nsend_fds;
 
 			/* Add message to trailing queue */
 			wmsg->trailing[wmsg->ntrailing].iov_len = act_size;
 			wmsg->trailing[wmsg->ntrailing].iov_base = msg;
 			wmsg->ntrailing++;
 		}
-		if (wmsg->proto_write.zone_end > 0) {
+		if (nsend_bytes > 0) {
 			wp_debug("We are transferring a data buffer with %d bytes",
-					wmsg->proto_write.zone_end);
-			size_t act_size = (size_t)wmsg->proto_write.zone_end +
+					nsend_bytes);
+			size_t act_size = (size_t)nsend_bytes +
 					  sizeof(uint32_t);
 			uint32_t protoh = transfer_header(
 					act_size, WMSG_PROTOCOL);
@@ -997,47 +1831,156 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 			memcpy(copy_proto, &protoh, sizeof(uint32_t));
 			memcpy(copy_proto + sizeof(uint32_t),
 					wmsg->proto_write.data,
-					(size_t)wmsg->proto_write.zone_end);
-			memset(copy_proto + sizeof(uint32_t) +
-							wmsg->proto_write
-									.zone_end,
-					0, alignz(act_size, 4) - act_size);
+					(size_t)nsend_bytes);
+			memset(copy_proto + sizeof(uint32_t) + nsend_bytes, 0,
+					alignz(act_size, 4) - act_size);
 
 			wmsg->trailing[wmsg->ntrailing].iov_len =
 					alignz(act_size, 4);
 			wmsg->trailing[wmsg->ntrailing].iov_base = copy_proto;
 			wmsg->ntrailing++;
+			memmove(wmsg->proto_write.data,
+					wmsg->proto_write.data + nsend_bytes,
+					(size_t)(wmsg->proto_write.zone_end -
+							nsend_bytes));
+			wmsg->proto_write.zone_end -= nsend_bytes;
+		}
+	}
+	if (holding) {
+		/* The held messages now start the write buffer */
+		g->commit_offset = 0;
+		g->commit_nfds = 0;
+		if (new_proto_data) {
+			wp_debug("Channel congested, holding %d bytes of messages from %s",
+					wmsg->proto_write.zone_end, progdesc);
 		}
+	} else {
+		g->buffer_committed = false;
 	}
 
-	int n_transfers = wmsg->transfers.end - wmsg->transfers.start;
+	int n_transfers = wmsg->transfers.end - old_transfers_end;
 	size_t net_bytes = 0;
-	for (int i = wmsg->transfers.start; i < wmsg->transfers.end; i++) {
+	for (int i = old_transfers_end; i < wmsg->transfers.end; i++) {
 		net_bytes += wmsg->transfers.vecs[i].iov_len;
 	}
 
-	if (n_transfers > 0 || num_mt_tasks > 0 || wmsg->ntrailing > 0) {
-		wp_debug("Channel message start (%d blobs, %d bytes, %d trailing, %d tasks)",
+	if (coalescing && num_mt_tasks == 0) {
+		/* Nothing is being computed, so queue the messages after the
+		 * last cycle's and keep reading */
+		queue_trailing_transfers(wmsg);
+	} else if (n_transfers > 0 || num_mt_tasks > 0 ||
+			wmsg->ntrailing > 0) {
+		wp_debug("Channel message start (%d blobs, %d bytes, %d trailing, %d tasks, %zu bytes of last message queued)",
 				n_transfers, net_bytes, wmsg->ntrailing,
-				num_mt_tasks);
+				num_mt_tasks, wmsg->drain_left);
+		wmsg->cycle_drain = wmsg->drain_left;
 		wmsg->state = WM_WAITING_FOR_CHANNEL;
 		DTRACE_PROBE(waypipe, channel_write_start);
 	}
 	return 0;
 }
+/* While waiting for the program, keep writing the last cycle's messages */
+static int advance_waymsg_drain(
+		struct way_msg_state *wmsg, struct cross_state *cxs, int chanfd)
+{
+	if (chanfd == -1 || wmsg->transfers.start == wmsg->transfers.end) {
+		return 0;
+	}
+	int nwritten = 0;
+	bool chan_blocked = false;
+	int ret = write_queued_transfers(
+			wmsg, cxs, chanfd, &nwritten, &chan_blocked);
+	if (ret < 0) {
+		return ret;
+	}
+	if (chan_blocked) {
+		level_control_note_blocked(&wmsg->level_ctrl);
+	}
+	return 0;
+}
 static int advance_waymsg_transfer(struct globals *g,
 		struct way_msg_state *wmsg, struct cross_state *cxs,
 		bool display_side, int chanfd, int progfd,
 		bool progsock_readable)
 {
+	int ret;
 	if (wmsg->state == WM_WAITING_FOR_CHANNEL) {
-		return advance_waymsg_chanwrite(
+		ret = advance_waymsg_chanwrite(
 				wmsg, cxs, g, chanfd, display_side);
+		if (ret < 0) {
+			return ret;
+		}
+		if (wmsg->state == WM_WAITING_FOR_CHANNEL) {
+			if (!waymsg_reading_ahead(wmsg)) {
+				return 0;
+			}
+			bool new_proto_data;
+			return read_program_messages(wmsg, g, progfd,
+					display_side, progsock_readable,
+					&new_proto_data);
+		}
+		/* The cycle ended once its messages were queued; start the
+		 * next, with what was read meanwhile */
 	} else if (wmsg->state == WM_WAITING_FOR_PROGRAM) {
-		return advance_waymsg_progread(wmsg, g, progfd, display_side,
-				progsock_readable);
+		/* Finishing the drain first lets held messages be sent now */
+		ret = advance_waymsg_drain(wmsg, cxs, chanfd);
+		if (ret < 0) {
+			return ret;
+		}
+	} else {
+		return 0;
+	}
+	ret = advance_waymsg_progread(
+			wmsg, g, progfd, display_side, progsock_readable);
+	if (ret < 0 || wmsg->state != WM_WAITING_FOR_CHANNEL) {
+		return ret;
+	}
+	/* Start on the new cycle's tasks now; the channel may not become
+	 * writable for a while */
+	return advance_waymsg_chanwrite(wmsg, cxs, g, chanfd, display_side);
+}
+
+/* Compare the application's data in flight to the budget. While it is over,
+ * the application is slowed down: it is not read from, and its frame
+ * callbacks are held back. */
+static void update_inflight_throttle(struct globals *g,
+		struct way_msg_state *wmsg, const struct cross_state *cxs,
+		bool display_side)
+{
+	size_t budget = g->config->max_inflight;
+	if (display_side || budget == 0) {
+		return;
+	}
+	/* Acknowledgements may be read by the channel thread, so they are
+	 * only counted here, on the thread which owns the transfer queue */
+	confirm_transfers(&wmsg->transfers, cxs->last_confirmed_msgno);
+	size_t inflight = wmsg->transfers.unconfirmed_bytes;
+	bool over = inflight > budget;
+	if (over == g->inflight_throttle) {
+		return;
+	}
+	wp_debug("%zu bytes in flight, budget %zu bytes: %s application",
+			inflight, budget, over ? "throttling" : "resuming");
+	g->inflight_throttle = over;
+	if (!over && g->state_lock && g->held_frame_events.zone_end > 0) {
+		/* The channel thread releases the held events */
+		uint8_t triv = 0;
+		if (write(g->threads.incoming_selfpipe_w, &triv, 1) == -1) {
+			wp_error("Failed to write to self-pipe");
+		}
+	}
+}
+
+/* After the program connection has closed, stop program->channel transfers,
+ * once the messages already read have been written */
+static void stop_waymsg_if_written(struct way_msg_state *wmsg)
+{
+	if (wmsg->state == WM_WAITING_FOR_PROGRAM &&
+			wmsg->transfers.start == wmsg->transfers.end &&
+			wmsg->proto_write.zone_end == 0 &&
+			wmsg->fds.zone_start == 0) {
+		wmsg->state = WM_TERMINAL;
 	}
-	return 0;
 }
 
 static int read_new_chanfd(int linkfd, struct int_window *recon_fds)
@@ -1105,6 +2048,7 @@ static void reset_connection(struct cross_state *cxs,
 	 * messages, and trailing remnants */
 	cmsg->recv_end = 0;
 	cmsg->recv_start = 0;
+	cmsg->recv_scan = 0;
 	cmsg->recv_unhandled_messages = 0;
 
 	clear_old_transfers(&wmsg->transfers, cxs->last_confirmed_msgno);
@@ -1120,6 +2064,7 @@ static void reset_connection(struct cross_state *cxs,
 		restart.last_ack_received = cxs->last_confirmed_msgno;
 		wmsg->transfers.start = 0;
 		wmsg->transfers.partial_write_amt = 0;
+		wmsg->drain_left = 0;
 		wp_debug("Sending restart message: last ack=%d",
 				restart.last_ack_received);
 		if (write(chanfd, &restart, sizeof(restart)) !=
@@ -1158,6 +2103,239 @@ static int set_connections_nonblocking(
 	return 0;
 }
 
+/** A thread which runs the channel->program transfers, so that they do not
+ * wait for program->channel transfers, which the main thread does. Except
+ * while waiting or running tasks, each thread holds `globals::state_lock` */
+struct chan_thread {
+	pthread_t thread;
+	bool running;
+	/* Set by the main thread to request an exit */
+	atomic_bool stop;
+	/* Set by this thread when it is about to exit, with `exit_code` */
+	atomic_bool done;
+	int exit_code;
+
+	struct globals *g;
+	struct chan_msg_state *cmsg;
+	struct cross_state *cxs;
+	bool display_side;
+	int chanfd, progfd;
+};
+
+static void *chan_thread_main(void *arg)
+{
+	struct chan_thread *ct = arg;
+	struct globals *g = ct->g;
+	struct chan_msg_state *cmsg = ct->cmsg;
+	int wake_r = g->threads.incoming_selfpipe_r;
+	bool wake_main = false;
+	int ret = 0;
+
+	pthread_mutex_lock(g->state_lock);
+	while (!shutdown_flag && !atomic_load(&ct->stop) && ret == 0 &&
+			cmsg->state != CM_TERMINAL) {
+		if (ct->progfd == -1 && cmsg->state == CM_WAITING_FOR_PROGRAM) {
+			/* With the program connection closed, the main
+			 * thread decides what to do with this message */
+			break;
+		}
+		struct pollfd pfds[3];
+		pfds[0].fd = ct->chanfd;
+		pfds[0].events = cmsg->state == CM_WAITING_FOR_CHANNEL ? POLLIN
+								       : 0;
+		pfds[1].fd = ct->progfd;
+		pfds[1].events = cmsg->state == CM_WAITING_FOR_PROGRAM ? POLLOUT
+								       : 0;
+		pfds[2].fd = wake_r;
+		pfds[2].events = POLLIN;
+		bool unread_chan_msgs =
+				cmsg->state == CM_WAITING_FOR_CHANNEL &&
+				cmsg->recv_unhandled_messages > 0;
+		if (held_frames_ready(g, cmsg)) {
+			unread_chan_msgs = true;
+		}
+
+		pthread_mutex_unlock(g->state_lock);
+		if (wake_main) {
+			/* So that the main thread acknowledges the new
+			 * messages, writes to any pipes they affected, and
+			 * sees acknowledgements of its own messages */
+			uint8_t triv = 0;
+			if (write(g->threads.selfpipe_w, &triv, 1) == -1) {
+				wp_error("Failed to write to self-pipe");
+			}
+			wake_main = false;
+		}
+		int r = poll(pfds, 3, unread_chan_msgs ? 0 : -1);
+		pthread_mutex_lock(g->state_lock);
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			wp_error("poll failed due to, stopping: %s",
+					strerror(errno));
+			ret = ERR_FATAL;
+			break;
+		}
+		if (pfds[2].revents & POLLIN) {
+			char tmp[64];
+			(void)read(wake_r, tmp, sizeof(tmp));
+		}
+
+		bool chanmsg_active = (pfds[0].revents & (POLLIN | POLLHUP)) ||
+				      (pfds[1].revents & POLLOUT) ||
+				      unread_chan_msgs ||
+				      cmsg->state == CM_WAITING_FOR_WORKERS;
+		uint32_t last_received = ct->cxs->last_received_msgno;
+		uint32_t last_confirmed = ct->cxs->last_confirmed_msgno;
+		ret = advance_chanmsg_transfer(g, cmsg, ct->cxs,
+				ct->display_side, ct->chanfd, ct->progfd,
+				chanmsg_active);
+		if (ct->cxs->last_received_msgno != last_received ||
+				ct->cxs->last_confirmed_msgno !=
+						last_confirmed) {
+			wake_main = true;
+		}
+	}
+	ct->exit_code = ret;
+	atomic_store(&ct->done, true);
+	pthread_mutex_unlock(g->state_lock);
+
+	uint8_t triv = 0;
+	if (write(g->threads.selfpipe_w, &triv, 1) == -1) {
+		wp_error("Failed to write to self-pipe");
+	}
+	return NULL;
+}
+static int start_chan_thread(struct chan_thread *ct, int chanfd, int progfd)
+{
+	ct->chanfd = chanfd;
+	ct->progfd = progfd;
+	ct->exit_code = 0;
+	atomic_store(&ct->stop, false);
+	atomic_store(&ct->done, false);
+	int ret = pthread_create(&ct->thread, NULL, chan_thread_main, ct);
+	if (ret) {
+		wp_error("Thread creation failed: %s", strerror(ret));
+		return -1;
+	}
+	ct->running = true;
+	return 0;
+}
+/* Stop the channel thread, if it is running, and return its exit code. The
+ * calling thread must hold the state lock, which this temporarily releases. */
+static int stop_chan_thread(struct chan_thread *ct)
+{
+	if (!ct->running) {
+		return 0;
+	}
+	struct globals *g = ct->g;
+	atomic_store(&ct->stop, true);
+	pthread_mutex_unlock(g->state_lock);
+	uint8_t triv = 0;
+	if (write(g->threads.incoming_selfpipe_w, &triv, 1) == -1) {
+		wp_error("Failed to write to self-pipe");
+	}
+	pthread_join(ct->thread, NULL);
+	pthread_mutex_lock(g->state_lock);
+	ct->running = false;
+	return ct->exit_code;
+}
+
+#ifdef HAS_EPOLL
+/** Registrations of the channel, program, link and self-pipe fds with the
+ * epoll instance that also watches all pipes */
+struct epoll_loop {
+	int epfd;
+	int watched_fd[4];
+	uint32_t watched_events[4];
+};
+static uint32_t poll_to_epoll_events(short events)
+{
+	return ((events & POLLIN) ? EPOLLIN : 0) |
+	       ((events & POLLOUT) ? EPOLLOUT : 0);
+}
+static short epoll_to_poll_events(uint32_t events)
+{
+	return (short)(((events & EPOLLIN) ? POLLIN : 0) |
+		       ((events & EPOLLOUT) ? POLLOUT : 0) |
+		       ((events & EPOLLHUP) ? POLLHUP : 0) |
+		       ((events & EPOLLERR) ? POLLERR : 0));
+}
+/* Update the registration of the fixed fd with index i to match pfd */
+static void epoll_loop_watch(
+		struct epoll_loop *loop, int i, const struct pollfd *pfd)
+{
+	uint32_t events = poll_to_epoll_events(pfd->events);
+	if (loop->watched_fd[i] == pfd->fd &&
+			loop->watched_events[i] == events) {
+		return;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = &loop->watched_fd[i];
+	if (loop->watched_fd[i] != -1 && loop->watched_fd[i] != pfd->fd) {
+		/* This fails if the old fd was already closed */
+		(void)epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->watched_fd[i],
+				NULL);
+		loop->watched_fd[i] = -1;
+	}
+	if (pfd->fd == -1) {
+		return;
+	}
+	int ret;
+	if (loop->watched_fd[i] == pfd->fd) {
+		ret = epoll_ctl(loop->epfd, EPOLL_CTL_MOD, pfd->fd, &ev);
+	} else {
+		ret = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, pfd->fd, &ev);
+		if (ret == -1 && errno == EEXIST) {
+			/* A new fd can reuse the number of a closed one */
+			ret = epoll_ctl(loop->epfd, EPOLL_CTL_MOD, pfd->fd,
+					&ev);
+		}
+	}
+	if (ret == -1) {
+		wp_error("Failed to update epoll registration of fd %d: %s",
+				pfd->fd, strerror(errno));
+		return;
+	}
+	loop->watched_fd[i] = pfd->fd;
+	loop->watched_events[i] = events;
+}
+/** Like poll(2) on the four fixed fds in `pfds` and on all pipes, except that
+ * ready pipes are directly marked as such. */
+static int epoll_loop_wait(struct epoll_loop *loop,
+		struct fd_translation_map *map, struct pollfd pfds[4],
+		bool check_read, int timeout)
+{
+	for (int i = 0; i < 4; i++) {
+		epoll_loop_watch(loop, i, &pfds[i]);
+		pfds[i].revents = 0;
+	}
+	watch_active_pipes(map, check_read);
+
+	struct epoll_event events[64];
+	int n = epoll_wait(loop->epfd, events, 64, timeout);
+	for (int k = 0; k < n; k++) {
+		short revents = epoll_to_poll_events(events[k].events);
+		void *ptr = events[k].data.ptr;
+		if (ptr == loop) {
+			/* The io_uring instance has completions, which are
+			 * collected after waiting */
+			continue;
+		} else if (ptr >= (void *)&loop->watched_fd[0] &&
+				ptr <= (void *)&loop->watched_fd[3]) {
+			int i = (int)((int *)ptr - loop->watched_fd);
+			pfds[i].revents = revents;
+		} else {
+			mark_pipe_object_status(ptr, revents);
+		}
+	}
+	return n;
+}
+#endif
+
 int main_interface_loop(int chanfd, int progfd, int linkfd,
 		const struct main_config *config, bool display_side)
 {
@@ -1195,16 +2373,11 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	way_msg.proto_write.size = 2 * max_read_size;
 	way_msg.proto_write.data = malloc((size_t)way_msg.proto_write.size);
 	way_msg.max_iov = get_iov_max();
-	int mut_ret = pthread_mutex_init(
-			&way_msg.transfers.async_recv_queue.lock, NULL);
-	if (mut_ret) {
-		wp_error("Mutex creation failed: %s", strerror(mut_ret));
-		goto init_failure_cleanup;
-	}
+	init_level_control(&way_msg.level_ctrl, config);
 
 	chan_msg.state = CM_WAITING_FOR_CHANNEL;
-	chan_msg.recv_size = 2 * RECV_GOAL_READ_SIZE;
-	chan_msg.recv_buffer = malloc((size_t)chan_msg.recv_size);
+	chan_msg.recv_size = RECV_INITIAL_SIZE;
+	chan_msg.recv_buffer = create_mirrored_buffer(chan_msg.recv_size);
 	chan_msg.proto_write.size = max_read_size * 2;
 	chan_msg.proto_write.data = malloc((size_t)chan_msg.proto_write.size);
 	if (!chan_msg.proto_write.data || !chan_msg.recv_buffer ||
@@ -1237,11 +2410,34 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			    config->n_worker_threads) == -1) {
 		goto init_failure_cleanup;
 	}
+	g.threads.zstd_prefix = config->zstd_prefix;
+	g.threads.zstd_dict = config->zstd_dict;
+	g.threads.raw_blocks = config->raw_blocks;
 	setup_translation_map(&g.map, display_side);
 	if (init_message_tracker(&g.tracker) == -1) {
 		goto init_failure_cleanup;
 	}
 
+	pthread_mutex_t state_lock;
+	struct chan_thread chan_thread;
+	memset(&chan_thread, 0, sizeof(chan_thread));
+	chan_thread.g = &g;
+	chan_thread.cmsg = &chan_msg;
+	chan_thread.cxs = &cross_data;
+	chan_thread.display_side = display_side;
+	if (config->thread_per_direction) {
+		if (setup_incoming_thread(&g.threads) == -1) {
+			goto init_failure_cleanup;
+		}
+		int ret = pthread_mutex_init(&state_lock, NULL);
+		if (ret) {
+			wp_error("Mutex creation failed: %s", strerror(ret));
+			goto init_failure_cleanup;
+		}
+		g.state_lock = &state_lock;
+		pthread_mutex_lock(&state_lock);
+	}
+
 	struct int_window recon_fds = {
 			.data = NULL,
 			.size = 0,
@@ -1249,6 +2445,48 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			.zone_end = 0,
 	};
 
+#ifdef HAS_EPOLL
+	struct epoll_loop eloop;
+	eloop.epfd = -1;
+	/* The channel thread may destroy pipes while the main thread waits,
+	 * so that pipes reported by epoll could be stale; poll() results are
+	 * instead matched to pipes by fd afterwards */
+	if (!g.state_lock) {
+		eloop.epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (eloop.epfd == -1) {
+			wp_error("Failed to create epoll instance, falling back to poll: %s",
+					strerror(errno));
+		}
+	}
+	for (int i = 0; i < 4; i++) {
+		eloop.watched_fd[i] = -1;
+		eloop.watched_events[i] = 0;
+	}
+	/* Pipes are registered as they are created */
+	g.map.epoll_fd = eloop.epfd;
+#endif
+#ifdef HAS_IO_URING
+	/* The ring is only used when there is an epoll instance to notify
+	 * the main loop of its completions */
+	struct chan_ring ring;
+	bool has_ring = eloop.epfd != -1 && chan_ring_init(&ring) == 0;
+	if (has_ring) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = &eloop;
+		if (epoll_ctl(eloop.epfd, EPOLL_CTL_ADD, ring.fd, &ev) == -1) {
+			wp_error("Failed to watch io_uring instance: %s",
+					strerror(errno));
+			chan_ring_cleanup(&ring);
+			has_ring = false;
+		}
+	}
+	if (has_ring && fd_is_socket(chanfd)) {
+		cross_data.ring = &ring;
+	}
+#endif
+
 	bool needs_new_channel = false;
 	struct pollfd *pfds = NULL;
 	int pfds_size = 0;
@@ -1256,7 +2494,19 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	while (!shutdown_flag && exit_code == 0 &&
 			!(way_msg.state == WM_TERMINAL &&
 					chan_msg.state == CM_TERMINAL)) {
-		int psize = 4 + count_npipes(&g.map);
+		if (g.state_lock && !chan_thread.running && chanfd != -1 &&
+				!needs_new_channel &&
+				chan_msg.state != CM_TERMINAL) {
+			if (start_chan_thread(&chan_thread, chanfd, progfd) ==
+					-1) {
+				exit_code = ERR_FATAL;
+				break;
+			}
+		}
+		int psize = 4;
+		if (g.map.epoll_fd == -1) {
+			psize += count_npipes(&g.map);
+		}
 		if (buf_ensure_size(psize, sizeof(struct pollfd), &pfds_size,
 				    (void **)&pfds) == -1) {
 			wp_error("Allocation failure, not enough space for pollfds");
@@ -1271,43 +2521,123 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 		pfds[1].events = 0;
 		pfds[2].events = POLLIN;
 		pfds[3].events = POLLIN;
+		update_inflight_throttle(
+				&g, &way_msg, &cross_data, display_side);
 		if (way_msg.state == WM_WAITING_FOR_CHANNEL) {
 			pfds[0].events |= POLLOUT;
+			if (!g.inflight_throttle &&
+					waymsg_reading_ahead(&way_msg)) {
+				pfds[1].events |= POLLIN;
+			}
 		} else if (way_msg.state == WM_WAITING_FOR_PROGRAM) {
-			pfds[1].events |= POLLIN;
+			if (!g.inflight_throttle) {
+				pfds[1].events |= POLLIN;
+			}
+			if (way_msg.transfers.start < way_msg.transfers.end) {
+				/* The last cycle's messages are being
+				 * written */
+				pfds[0].events |= POLLOUT;
+			}
 		}
-		if (chan_msg.state == CM_WAITING_FOR_CHANNEL) {
+		if (g.state_lock) {
+			/* The channel thread handles this direction */
+		} else if (chan_msg.state == CM_WAITING_FOR_CHANNEL) {
 			pfds[0].events |= POLLIN;
 		} else if (chan_msg.state == CM_WAITING_FOR_PROGRAM) {
 			pfds[1].events |= POLLOUT;
 		}
+#ifdef HAS_IO_URING
+		if (cross_data.ring) {
+			/* Operations in flight on the ring wake the loop when
+			 * they complete */
+			if (cross_data.ring->recv_pending) {
+				pfds[0].events &= (short)~POLLIN;
+			}
+			if (cross_data.ring->nsends > 0) {
+				pfds[0].events &= (short)~POLLOUT;
+			}
+		}
+#endif
 		bool check_read = way_msg.state == WM_WAITING_FOR_PROGRAM;
-		int npoll = 4 + fill_with_pipes(&g.map, pfds + 4, check_read);
+		int npoll = 4;
+		if (g.map.epoll_fd == -1) {
+			npoll += fill_with_pipes(&g.map, pfds + 4, check_read);
+		}
 
 		bool own_msg_pending =
 				(cross_data.last_acked_msgno !=
 						cross_data.last_received_msgno) &&
 				way_msg.state == WM_WAITING_FOR_PROGRAM;
 		bool unread_chan_msgs =
+				!g.state_lock &&
 				chan_msg.state == CM_WAITING_FOR_CHANNEL &&
 				chan_msg.recv_unhandled_messages > 0;
+		if (!g.state_lock && held_frames_ready(&g, &chan_msg)) {
+			unread_chan_msgs = true;
+		}
+		bool sends_completed = false;
+#ifdef HAS_IO_URING
+		if (cross_data.ring) {
+			/* A read should be started, or has completed */
+			if (chan_msg.state == CM_WAITING_FOR_CHANNEL &&
+					!cross_data.ring->recv_pending) {
+				unread_chan_msgs = true;
+			}
+			/* Sends may have completed after the last write
+			 * attempt; nothing else would wake the loop */
+			int nsends = cross_data.ring->nsends;
+			sends_completed = nsends > 0 &&
+					  cross_data.ring->nsends_done ==
+							  nsends;
+			if (chan_ring_enter(cross_data.ring, false) == -1) {
+				exit_code = ERR_FATAL;
+				break;
+			}
+		}
+#endif
 
 		int poll_delay;
-		if (unread_chan_msgs) {
+		bool ack_wait = false;
+		if (unread_chan_msgs || sends_completed) {
 			/* There is work to do, so continue */
 			poll_delay = 0;
 		} else if (own_msg_pending) {
 			/* To coalesce acknowledgements, we wait for a minimum
 			 * amount */
 			poll_delay = 20;
+			ack_wait = true;
 		} else {
 			poll_delay = -1;
 		}
-		int r = poll(pfds, (nfds_t)npoll, poll_delay);
+		int r;
+#ifdef HAS_EPOLL
+		if (eloop.epfd != -1) {
+			r = epoll_loop_wait(&eloop, &g.map, pfds, check_read,
+					poll_delay);
+		} else
+#endif
+		{
+			if (g.state_lock) {
+				pthread_mutex_unlock(g.state_lock);
+			}
+			r = poll(pfds, (nfds_t)npoll, poll_delay);
+			if (g.state_lock) {
+				pthread_mutex_lock(g.state_lock);
+			}
+		}
 		if (r == -1) {
 			if (errno == EINTR) {
-				wp_error("poll interrupted: shutdown=%c",
-						shutdown_flag ? 'Y' : 'n');
+				bool expected = false;
+#ifdef HAS_IO_URING
+				/* Completions on the ring can interrupt the
+				 * wait */
+				expected = cross_data.ring != NULL;
+#endif
+				if (shutdown_flag || !expected) {
+					wp_error("poll interrupted: shutdown=%c",
+							shutdown_flag ? 'Y'
+								      : 'n');
+				}
 				continue;
 			} else {
 				wp_error("poll failed due to, stopping: %s",
@@ -1322,6 +2652,11 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			char tmp[64];
 			(void)read(g.threads.selfpipe_r, tmp, sizeof(tmp));
 		}
+#ifdef HAS_IO_URING
+		if (cross_data.ring) {
+			chan_ring_reap(cross_data.ring);
+		}
+#endif
 
 		mark_pipe_object_statuses(&g.map, npoll - 4, pfds + 4);
 		/* POLLHUP sometimes implies POLLIN, but not on all systems.
@@ -1330,20 +2665,42 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 		 * there was data in the pipe just before the hang up, then we
 		 * can read and handle that data. */
 		bool progsock_readable = pfds[1].revents & (POLLIN | POLLHUP);
+		if (r == 0 && ack_wait) {
+			/* With nothing else to send, acknowledge the received
+			 * messages on their own, so the other side can free
+			 * them */
+			way_msg.cycle_drain = way_msg.drain_left;
+			way_msg.state = WM_WAITING_FOR_CHANNEL;
+		}
 		bool chanmsg_active = (pfds[0].revents & (POLLIN | POLLHUP)) ||
 				      (pfds[1].revents & POLLOUT) ||
-				      unread_chan_msgs;
+				      unread_chan_msgs ||
+				      chan_msg.state == CM_WAITING_FOR_WORKERS;
+#ifdef HAS_IO_URING
+		if (cross_data.ring && cross_data.ring->recv_done) {
+			chanmsg_active = true;
+		}
+#endif
 
 		bool maybe_new_channel = (pfds[2].revents & (POLLIN | POLLHUP));
 		if (maybe_new_channel) {
 			int new_fd = read_new_chanfd(linkfd, &recon_fds);
 			if (new_fd >= 0) {
 				if (chanfd != -1) {
+					(void)stop_chan_thread(&chan_thread);
+#ifdef HAS_IO_URING
+					detach_chan_ring(&cross_data, &way_msg);
+#endif
 					checked_close(chanfd);
 				}
 				chanfd = new_fd;
 				reset_connection(&cross_data, &chan_msg,
 						&way_msg, chanfd);
+#ifdef HAS_IO_URING
+				if (has_ring && fd_is_socket(chanfd)) {
+					cross_data.ring = &ring;
+				}
+#endif
 				needs_new_channel = false;
 			} else if (new_fd == -2) {
 				wp_error("Link to root process hang-up detected");
@@ -1362,11 +2719,20 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 				/* Actually handle the reconnection/reset state
 				 */
 				if (chanfd != -1) {
+					(void)stop_chan_thread(&chan_thread);
+#ifdef HAS_IO_URING
+					detach_chan_ring(&cross_data, &way_msg);
+#endif
 					checked_close(chanfd);
 				}
 				chanfd = new_fd;
 				reset_connection(&cross_data, &chan_msg,
 						&way_msg, chanfd);
+#ifdef HAS_IO_URING
+				if (has_ring && fd_is_socket(chanfd)) {
+					cross_data.ring = &ring;
+				}
+#endif
 				needs_new_channel = false;
 			}
 		} else if (needs_new_channel) {
@@ -1379,7 +2745,13 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 		// accidental dependencies?
 		for (int m = 0; m < 2; m++) {
 			int tr;
-			if (m == 0) {
+			if (m == 0 && g.state_lock) {
+				/* Handle the result once the thread exits */
+				bool exited = chan_thread.running &&
+					      atomic_load(&chan_thread.done);
+				tr = exited ? stop_chan_thread(&chan_thread)
+					    : 0;
+			} else if (m == 0) {
 				tr = advance_chanmsg_transfer(&g, &chan_msg,
 						&cross_data, display_side,
 						chanfd, progfd, chanmsg_active);
@@ -1396,6 +2768,10 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 				/* Channel connection has at least
 				 * partially been shut down, so close it
 				 * fully. */
+				(void)stop_chan_thread(&chan_thread);
+#ifdef HAS_IO_URING
+				detach_chan_ring(&cross_data, &way_msg);
+#endif
 				checked_close(chanfd);
 				chanfd = -1;
 				if (linkfd == -1) {
@@ -1413,12 +2789,10 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 					progfd = -1;
 				} else {
 					/* Stop returned while reading */
+					(void)stop_chan_thread(&chan_thread);
 					checked_close(progfd);
 					progfd = -1;
-					if (way_msg.state ==
-							WM_WAITING_FOR_PROGRAM) {
-						way_msg.state = WM_TERMINAL;
-					}
+					stop_waymsg_if_written(&way_msg);
 					if (chan_msg.state == CM_WAITING_FOR_PROGRAM ||
 							chan_msg.recv_start ==
 									chan_msg.recv_end) {
@@ -1439,9 +2813,7 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			 * a cause for permanent closure, thanks to
 			 * reconnection support */
 			if (progfd == -1) {
-				if (way_msg.state == WM_WAITING_FOR_PROGRAM) {
-					way_msg.state = WM_TERMINAL;
-				}
+				stop_waymsg_if_written(&way_msg);
 				if (chan_msg.state == CM_WAITING_FOR_PROGRAM ||
 						chan_msg.recv_start ==
 								chan_msg.recv_end) {
@@ -1455,6 +2827,25 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	}
 	free(pfds);
 	free(recon_fds.data);
+	if (g.state_lock) {
+		(void)stop_chan_thread(&chan_thread);
+		pthread_mutex_unlock(g.state_lock);
+		pthread_mutex_destroy(g.state_lock);
+		g.state_lock = NULL;
+	}
+#ifdef HAS_IO_URING
+	detach_chan_ring(&cross_data, &way_msg);
+	if (has_ring) {
+		chan_ring_cleanup(&ring);
+	}
+#endif
+#ifdef HAS_EPOLL
+	/* Pipes are unregistered as they are destroyed, which happens later */
+	g.map.epoll_fd = -1;
+	if (eloop.epfd != -1) {
+		checked_close(eloop.epfd);
+	}
+#endif
 	wp_debug("Exiting main loop (%d, %d, %d), attempting close message",
 			exit_code, way_msg.state, chan_msg.state);
 
@@ -1525,13 +2916,14 @@ init_failure_cleanup:
 	free(way_msg.proto_read.data);
 	free(way_msg.proto_write.data);
 	free(way_msg.fds.data);
+	free(g.held_frame_events.data);
 	cleanup_transfer_queue(&way_msg.transfers);
 	for (int i = 0; i < way_msg.ntrailing; i++) {
 		free(way_msg.trailing[i].iov_base);
 	}
 	free(chan_msg.transf_fds.data);
 	free(chan_msg.proto_fds.data);
-	free(chan_msg.recv_buffer);
+	free_mirrored_buffer(chan_msg.recv_buffer, chan_msg.recv_size);
 	free(chan_msg.proto_write.data);
 
 	if (chanfd != -1) {
@@ -556,11 +556,19 @@ void parse_and_prune_messages(struct globals *g, bool on_display_side,
 		source_bytes->zone_start += msgsz;
 		scan_bytes.zone_end = scan_bytes.zone_start + msgsz;
 
+		bool committed = g->buffer_committed;
+		int msg_nfds = fds->zone_start;
 		enum parse_state pstate = handle_message(g, on_display_side,
 				from_client, &scan_bytes, fds);
 		if (pstate == PARSE_UNKNOWN || pstate == PARSE_ERROR) {
+			/* May change buffers; see below */
 			anything_unknown = true;
 		}
+		if (!committed && (g->buffer_committed || anything_unknown)) {
+			g->buffer_committed = true;
+			g->commit_offset = scan_bytes.zone_start;
+			g->commit_nfds = msg_nfds;
+		}
 		scan_bytes.zone_start = scan_bytes.zone_end;
 	}
 	dest_bytes->zone_end = scan_bytes.zone_end;
@@ -578,6 +586,11 @@ void parse_and_prune_messages(struct globals *g, bool on_display_side,
 			struct shadow_fd *cur = (struct shadow_fd *)lcur;
 			if (!cur->has_owner) {
 				cur->is_dirty = true;
+				if (cur->type == FDC_DMABUF) {
+					/* no known protocol reports damage */
+					damage_everything(&cur->damage);
+				}
+				mark_shadow_active(cur);
 			}
 		}
 	}
@@ -123,6 +123,10 @@ enum parse_state handle_message(struct globals *g, bool on_display_side,
  * The file descriptor queue `fds` will have its start advanced, leaving only
  * file descriptors that have not yet been read. Further edits may be made
  * to inject new file descriptors.
+ *
+ * The first message after which buffer contents may have changed is recorded
+ * in `g->commit_offset` and `g->commit_nfds`, unless `g->buffer_committed`
+ * was already set.
  */
 void parse_and_prune_messages(struct globals *g, bool on_display_side,
 		bool from_client, struct char_window *source_bytes,
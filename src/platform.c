@@ -134,8 +134,8 @@ void *zeroed_aligned_realloc(size_t old_size_bytes, size_t new_size_bytes,
 				(uint8_t *)new_data - (uint8_t *)new_handle;
 		if (old_offset != new_offset) {
 			/* realloc broke alignment offset */
-			memmove((uint8_t *)new_data + new_offset,
-					(uint8_t *)new_data + old_offset,
+			memmove((uint8_t *)new_handle + new_offset,
+					(uint8_t *)new_handle + old_offset,
 					new_size_bytes > old_size_bytes
 							? old_size_bytes
 							: new_size_bytes);
@@ -168,6 +168,47 @@ void zeroed_aligned_free(void *data, void **handle)
 	*handle = NULL;
 }
 
+void *create_mirrored_buffer(size_t size)
+{
+	if (size == 0 || size % (size_t)sysconf(_SC_PAGESIZE) != 0) {
+		return NULL;
+	}
+	int fd = create_anon_file();
+	if (fd == -1) {
+		return NULL;
+	}
+	if (ftruncate(fd, (off_t)size) == -1) {
+		close(fd);
+		return NULL;
+	}
+	/* Reserve space for both copies, then replace each half with a
+	 * mapping of the file */
+	char *base = mmap(NULL, 2 * size, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	for (int i = 0; i < 2; i++) {
+		void *half = mmap(base + (size_t)i * size, size,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+				fd, 0);
+		if (half == MAP_FAILED) {
+			munmap(base, 2 * size);
+			close(fd);
+			return NULL;
+		}
+	}
+	close(fd);
+	return base;
+}
+void free_mirrored_buffer(void *data, size_t size)
+{
+	if (data) {
+		munmap(data, 2 * size);
+	}
+}
+
 int open_folder(const char *name)
 {
 	const char *path = name[0] ? name : ".";
@@ -44,6 +44,7 @@ static inline uint32_t conntoken_header(const struct main_config *config,
 		bool reconnectable, bool update)
 {
 	uint32_t header = (WAYPIPE_PROTOCOL_VERSION << 16) | CONN_FIXED_BIT;
+	header |= CONN_RAW_BLOCKS_BIT;
 	header |= (update ? CONN_UPDATE_BIT : 0);
 	header |= (reconnectable ? CONN_RECONNECTABLE_BIT : 0);
 	// TODO: stop compile gating the 'COMP' enum entries
@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <poll.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,38 +38,334 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef HAS_EPOLL
+#include <sys/epoll.h>
+#endif
 #ifdef HAS_LZ4
 #include <lz4.h>
 #include <lz4hc.h>
 #endif
 #ifdef HAS_ZSTD
 #include <zstd.h>
+#if ZSTD_VERSION_NUMBER >= 10400
+/* The advanced API, with ZSTD_compressStream2, ZSTD_CCtx_refPrefix, and
+ * related functions, is stable since 1.4.0 */
+#define HAS_ZSTD_ADVANCED 1
+#include <zdict.h>
+#endif
 #endif
 
+/* Large diffs are constructed and compressed in chunks of this size. Along
+ * with the compressor state, this should fit comfortably in L2 cache, so that
+ * the compressor reads the diff data before it is evicted */
+#define DIFF_STREAM_CHUNK_SIZE (1u << 16)
+/* Limit on the size of the mirror region used as a prefix when compressing
+ * diffs; zstd's window is not much larger than this at the default levels */
+#define DIFF_PREFIX_MAX_SIZE (1u << 21)
+/* Size limit for trained zstd dictionaries */
+#define ZSTD_DICT_CAPACITY (1u << 15)
+/* Dictionaries are trained from samples of the first bytes of diffs (or of
+ * each streamed chunk of a diff), until either limit is reached */
+#define ZSTD_DICT_SAMPLE_SIZE (1u << 13)
+#define ZSTD_DICT_SAMPLE_SPACE (1u << 20)
+#define ZSTD_DICT_MAX_SAMPLES 4096
+/* Minimum time between the end of one training and the next */
+#define ZSTD_DICT_RETRAIN_SECONDS 30
+/* Before compressing a shard of at least PROBE_MIN_SIZE bytes, a few evenly
+ * spaced samples of it are compressed; if they do not shrink by at least
+ * 1/PROBE_MIN_SAVINGS, the shard is sent uncompressed */
+#define PROBE_MIN_SIZE (1u << 16)
+#define PROBE_NSAMPLES 4
+#define PROBE_SAMPLE_SIZE 2048
+#define PROBE_MIN_SAVINGS 8
+/* Merging the damage from one commit on the main thread should take no
+ * longer than this; worse damage patterns are covered more coarsely */
+#define MERGE_TIME_LIMIT_NS 200000
+/* Bounds for the adaptive damage merge margin */
+#define MAX_MERGE_MARGIN 4096
+
+static uint32_t shadow_index_hash(int key)
+{
+	uint32_t h = (uint32_t)key * 2654435769u;
+	return h ^ (h >> 16);
+}
+static struct shadow_fd *shadow_index_find(
+		const struct shadow_index *idx, int key)
+{
+	if (idx->size == 0) {
+		return NULL;
+	}
+	uint32_t mask = (uint32_t)idx->size - 1;
+	for (uint32_t i = shadow_index_hash(key) & mask; idx->slots[i].sfd;
+			i = (i + 1) & mask) {
+		if (idx->slots[i].key == key) {
+			return idx->slots[i].sfd;
+		}
+	}
+	return NULL;
+}
+static void shadow_index_place(
+		struct shadow_index *idx, int key, struct shadow_fd *sfd)
+{
+	uint32_t mask = (uint32_t)idx->size - 1;
+	uint32_t i = shadow_index_hash(key) & mask;
+	while (idx->slots[i].sfd && idx->slots[i].key != key) {
+		i = (i + 1) & mask;
+	}
+	if (!idx->slots[i].sfd) {
+		idx->count++;
+	}
+	idx->slots[i].key = key;
+	idx->slots[i].sfd = sfd;
+}
+/** Map key to sfd, replacing any existing entry for the key */
+static int shadow_index_insert(
+		struct shadow_index *idx, int key, struct shadow_fd *sfd)
+{
+	if (2 * (idx->count + 1) > idx->size) {
+		int new_size = max(2 * idx->size, 16);
+		struct shadow_index_slot *new_slots = calloc(
+				(size_t)new_size, sizeof(*new_slots));
+		if (new_slots) {
+			struct shadow_index old = *idx;
+			idx->slots = new_slots;
+			idx->size = new_size;
+			idx->count = 0;
+			for (int i = 0; i < old.size; i++) {
+				if (old.slots[i].sfd) {
+					shadow_index_place(idx,
+							old.slots[i].key,
+							old.slots[i].sfd);
+				}
+			}
+			free(old.slots);
+		} else if (idx->count + 1 >= idx->size) {
+			wp_error("Failed to grow shadow index");
+			return -1;
+		}
+	}
+	shadow_index_place(idx, key, sfd);
+	return 0;
+}
+/** Remove the entry for key, if it maps to sfd */
+static void shadow_index_remove(
+		struct shadow_index *idx, int key, struct shadow_fd *sfd)
+{
+	if (idx->size == 0) {
+		return;
+	}
+	uint32_t mask = (uint32_t)idx->size - 1;
+	uint32_t i = shadow_index_hash(key) & mask;
+	while (idx->slots[i].sfd && idx->slots[i].key != key) {
+		i = (i + 1) & mask;
+	}
+	if (idx->slots[i].sfd != sfd) {
+		return;
+	}
+	/* Move later entries of the probe sequence back into the gap, so
+	 * that lookups never need to skip over deleted slots */
+	for (uint32_t j = (i + 1) & mask; idx->slots[j].sfd;
+			j = (j + 1) & mask) {
+		uint32_t home = shadow_index_hash(idx->slots[j].key) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			idx->slots[i] = idx->slots[j];
+			i = j;
+		}
+	}
+	idx->slots[i].sfd = NULL;
+	idx->count--;
+}
+/* Register the pipe of sfd with the map's epoll instance, if any, for the
+ * events fill_with_pipes would have chosen */
+static void watch_pipe(struct shadow_fd *sfd)
+{
+#ifdef HAS_EPOLL
+	struct fd_translation_map *map = sfd->map;
+	if (map->epoll_fd == -1 || sfd->type != FDC_PIPE ||
+			sfd->pipe.fd == -1) {
+		return;
+	}
+	uint32_t events = 0;
+	if (map->epoll_check_read && sfd->pipe.readable) {
+		events |= EPOLLIN;
+	}
+	if (sfd->pipe.send.used > 0) {
+		events |= EPOLLOUT;
+	}
+	if (sfd->pipe.watched_fd == sfd->pipe.fd &&
+			sfd->pipe.watched_events == events) {
+		return;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = sfd;
+	int op = sfd->pipe.watched_fd == sfd->pipe.fd ? EPOLL_CTL_MOD
+						      : EPOLL_CTL_ADD;
+	if (epoll_ctl(map->epoll_fd, op, sfd->pipe.fd, &ev) == -1) {
+		wp_error("Failed to watch pipe RID=%d: %s", sfd->remote_id,
+				strerror(errno));
+		return;
+	}
+	sfd->pipe.watched_fd = sfd->pipe.fd;
+	sfd->pipe.watched_events = events;
+#else
+	(void)sfd;
+#endif
+}
+/* Remove the pipe of sfd from the epoll instance; this must be done before
+ * the pipe fd is closed */
+static void unwatch_pipe(struct shadow_fd *sfd)
+{
+#ifdef HAS_EPOLL
+	if (sfd->pipe.watched_fd != -1 && sfd->map->epoll_fd != -1) {
+		(void)epoll_ctl(sfd->map->epoll_fd, EPOLL_CTL_DEL,
+				sfd->pipe.watched_fd, NULL);
+	}
+	sfd->pipe.watched_fd = -1;
+#else
+	(void)sfd;
+#endif
+}
+/* Bring the fd_index entries for sfd up to date with its file descriptors.
+ * This must be called after fd_local or pipe.fd change. */
+static void reindex_shadow_fds(struct shadow_fd *sfd)
+{
+	int fds[2] = {sfd->fd_local, -1};
+	if (sfd->type == FDC_PIPE && sfd->pipe.fd != sfd->fd_local) {
+		fds[1] = sfd->pipe.fd;
+	}
+	struct shadow_index *idx = &sfd->map->fd_index;
+	for (int i = 0; i < 2; i++) {
+		int old = sfd->indexed_fds[i];
+		if (old != -1 && old != fds[0] && old != fds[1]) {
+			shadow_index_remove(idx, old, sfd);
+		}
+	}
+	for (int i = 0; i < 2; i++) {
+		sfd->indexed_fds[i] = -1;
+		if (fds[i] == -1) {
+			continue;
+		}
+		if (shadow_index_insert(idx, fds[i], sfd) != -1) {
+			sfd->indexed_fds[i] = fds[i];
+		}
+	}
+	watch_pipe(sfd);
+}
+static int file_index_key(dev_t dev, ino_t ino)
+{
+	uint64_t h = (uint64_t)ino * 0x9e3779b97f4a7c15u ^ (uint64_t)dev;
+	return (int)(uint32_t)(h ^ (h >> 32));
+}
+/* Add a new shadow structure to the map's list and indices */
+static void link_shadow(struct fd_translation_map *map, struct shadow_fd *sfd)
+{
+	sfd->link.l_prev = &map->link;
+	sfd->link.l_next = map->link.l_next;
+	sfd->link.l_prev->l_next = &sfd->link;
+	sfd->link.l_next->l_prev = &sfd->link;
+
+	sfd->map = map;
+	sfd->indexed_fds[0] = -1;
+	sfd->indexed_fds[1] = -1;
+	if (shadow_index_insert(&map->rid_index, sfd->remote_id, sfd) == -1) {
+		wp_error("Failed to index RID=%d", sfd->remote_id);
+	}
+	reindex_shadow_fds(sfd);
+	mark_shadow_active(sfd);
+}
+void mark_shadow_active(struct shadow_fd *sfd)
+{
+	if (sfd->work_link.l_next) {
+		return;
+	}
+	struct shadow_fd_link *head = &sfd->map->work;
+	sfd->work_link.l_next = head;
+	sfd->work_link.l_prev = head->l_prev;
+	sfd->work_link.l_prev->l_next = &sfd->work_link;
+	head->l_prev = &sfd->work_link;
+}
+static void mark_shadow_idle(struct shadow_fd *sfd)
+{
+	if (!sfd->work_link.l_next) {
+		return;
+	}
+	sfd->work_link.l_prev->l_next = sfd->work_link.l_next;
+	sfd->work_link.l_next->l_prev = sfd->work_link.l_prev;
+	sfd->work_link.l_next = NULL;
+	sfd->work_link.l_prev = NULL;
+}
+/* Return true if the main loop may still have to do something for `sfd`,
+ * even if it is not marked dirty again */
+static bool shadow_has_work(struct shadow_fd *sfd)
+{
+	if (sfd->only_here || sfd->is_dirty || sfd->refcount.compute ||
+			atomic_load(&sfd->refcount.incoming) > 0) {
+		return true;
+	}
+	if (sfd->type == FDC_PIPE) {
+		return sfd->pipe.readable ||
+		       (sfd->pipe.writable && sfd->pipe.send.used > 0) ||
+		       sfd->pipe.recv.used > 0 ||
+		       (!sfd->pipe.can_read && sfd->pipe.remote_can_write) ||
+		       (!sfd->pipe.can_write && sfd->pipe.remote_can_read);
+	}
+	return false;
+}
+static void unlink_shadow(struct shadow_fd *sfd)
+{
+	sfd->link.l_prev->l_next = sfd->link.l_next;
+	sfd->link.l_next->l_prev = sfd->link.l_prev;
+	sfd->link.l_next = NULL;
+	sfd->link.l_prev = NULL;
+	mark_shadow_idle(sfd);
+
+	struct fd_translation_map *map = sfd->map;
+	shadow_index_remove(&map->rid_index, sfd->remote_id, sfd);
+	if (sfd->file_indexed) {
+		shadow_index_remove(&map->file_index,
+				file_index_key(sfd->file_dev, sfd->file_ino),
+				sfd);
+	}
+	for (int i = 0; i < 2; i++) {
+		if (sfd->indexed_fds[i] != -1) {
+			shadow_index_remove(&map->fd_index,
+					sfd->indexed_fds[i], sfd);
+		}
+	}
+}
+
 struct shadow_fd *get_shadow_for_local_fd(
 		struct fd_translation_map *map, int lfd)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->fd_local == lfd) {
-			return cur;
+	struct shadow_fd *sfd = shadow_index_find(&map->fd_index, lfd);
+	if (!sfd) {
+		return NULL;
+	}
+	if (sfd->fd_local == lfd) {
+		return sfd;
+	}
+	for (int i = 0; i < map->naliases; i++) {
+		if (map->aliases[i].fd == lfd && map->aliases[i].sfd == sfd) {
+			return sfd;
 		}
 	}
 	return NULL;
 }
 struct shadow_fd *get_shadow_for_rid(struct fd_translation_map *map, int rid)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->remote_id == rid) {
-			return cur;
-		}
+	return shadow_index_find(&map->rid_index, rid);
+}
+static void free_mirror(struct shadow_fd *sfd)
+{
+	if (sfd->mirror_shared) {
+		shared_buffer_unref(sfd->mirror_shared);
+		sfd->mirror_shared = NULL;
+	} else {
+		zeroed_aligned_free(sfd->mem_mirror, &sfd->mem_mirror_handle);
 	}
-	return NULL;
+	sfd->mem_mirror = NULL;
 }
 static void destroy_unlinked_sfd(struct shadow_fd *sfd)
 {
@@ -83,19 +380,20 @@ static void destroy_unlinked_sfd(struct shadow_fd *sfd)
 
 	if (sfd->type == FDC_FILE) {
 		munmap(sfd->mem_local, sfd->buffer_size);
-		zeroed_aligned_free(sfd->mem_mirror, &sfd->mem_mirror_handle);
+		free_mirror(sfd);
 	} else if (sfd->type == FDC_DMABUF || sfd->type == FDC_DMAVID_IR ||
 			sfd->type == FDC_DMAVID_IW) {
 		if (sfd->dmabuf_map_handle) {
 			unmap_dmabuf(sfd->dmabuf_bo, sfd->dmabuf_map_handle);
 		}
 		destroy_dmabuf(sfd->dmabuf_bo);
-		zeroed_aligned_free(sfd->mem_mirror, &sfd->mem_mirror_handle);
+		free_mirror(sfd);
 		if (sfd->dmabuf_warped_handle) {
 			zeroed_aligned_free(sfd->dmabuf_warped,
 					&sfd->dmabuf_warped_handle);
 		}
 	} else if (sfd->type == FDC_PIPE) {
+		unwatch_pipe(sfd);
 		if (sfd->pipe.fd != sfd->fd_local && sfd->pipe.fd != -1) {
 			checked_close(sfd->pipe.fd);
 		}
@@ -117,6 +415,7 @@ static void cleanup_thread_local(struct thread_data *data)
 	free(data->comp_ctx.lz4_extstate);
 #endif
 	free(data->tmp_buf);
+	free(data->prefix_buf);
 }
 
 static void setup_thread_local(struct thread_data *data,
@@ -126,15 +425,17 @@ static void setup_thread_local(struct thread_data *data,
 	ctx->zstd_ccontext = NULL;
 	ctx->zstd_dcontext = NULL;
 	ctx->lz4_extstate = NULL;
+	ctx->lz4_extstate_hc = false;
 #ifdef HAS_LZ4
 	if (mode == COMP_LZ4) {
 		/* Like LZ4Frame, integer codes indicate compression level.
 		 * Negative numbers are acceleration, positive use the HC
 		 * routines */
-		if (compression_level <= 0) {
-			ctx->lz4_extstate = malloc((size_t)LZ4_sizeofState());
-		} else {
+		ctx->lz4_extstate_hc = compression_level > 0;
+		if (ctx->lz4_extstate_hc) {
 			ctx->lz4_extstate = malloc((size_t)LZ4_sizeofStateHC());
+		} else {
+			ctx->lz4_extstate = malloc((size_t)LZ4_sizeofState());
 		}
 	}
 #endif
@@ -150,8 +451,53 @@ static void setup_thread_local(struct thread_data *data,
 	data->tmp_buf = NULL;
 	data->tmp_size = 0;
 }
+struct shadow_fd *get_shadow_for_same_file(
+		struct fd_translation_map *map, int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		return NULL;
+	}
+	struct shadow_fd *sfd = shadow_index_find(&map->file_index,
+			file_index_key(st.st_dev, st.st_ino));
+	/* Only structures owned by protocol objects are shared, since the
+	 * objects keep the copy on the other side alive as well */
+	if (!sfd || sfd->file_dev != st.st_dev || sfd->file_ino != st.st_ino ||
+			sfd->refcount.protocol <= 0) {
+		return NULL;
+	}
+	if (sfd->fd_local == fd) {
+		/* The same file descriptor was sent again; it must not be
+		 * registered as an alias, since aliases are closed */
+		return sfd;
+	}
+	if (buf_ensure_size(map->naliases + 1, sizeof(struct fd_alias),
+			    &map->aliases_size,
+			    (void **)&map->aliases) == -1) {
+		return NULL;
+	}
+	if (shadow_index_insert(&map->fd_index, fd, sfd) == -1) {
+		return NULL;
+	}
+	map->aliases[map->naliases].fd = fd;
+	map->aliases[map->naliases].sfd = sfd;
+	map->naliases++;
+	wp_debug("Translating fd %d to RID=%d, with the same file as fd %d",
+			fd, sfd->remote_id, sfd->fd_local);
+	return sfd;
+}
+void close_fd_aliases(struct fd_translation_map *map)
+{
+	for (int i = 0; i < map->naliases; i++) {
+		shadow_index_remove(&map->fd_index, map->aliases[i].fd,
+				map->aliases[i].sfd);
+		checked_close(map->aliases[i].fd);
+	}
+	map->naliases = 0;
+}
 void cleanup_translation_map(struct fd_translation_map *map)
 {
+	close_fd_aliases(map);
 	for (struct shadow_fd_link *lcur = map->link.l_next,
 				   *lnxt = lcur->l_next;
 			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
@@ -160,6 +506,17 @@ void cleanup_translation_map(struct fd_translation_map *map)
 	}
 	map->link.l_next = &map->link;
 	map->link.l_prev = &map->link;
+	free(map->rid_index.slots);
+	free(map->fd_index.slots);
+	free(map->file_index.slots);
+	free(map->aliases);
+	memset(&map->rid_index, 0, sizeof(map->rid_index));
+	memset(&map->fd_index, 0, sizeof(map->fd_index));
+	memset(&map->file_index, 0, sizeof(map->file_index));
+	map->aliases = NULL;
+	map->aliases_size = 0;
+	map->work.l_next = &map->work;
+	map->work.l_prev = &map->work;
 }
 bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd)
 {
@@ -170,12 +527,11 @@ bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd)
 		autodelete = true;
 	}
 	if (sfd->refcount.protocol == 0 && sfd->refcount.transfer == 0 &&
-			sfd->refcount.compute == false && autodelete) {
+			sfd->refcount.compute == false &&
+			atomic_load(&sfd->refcount.incoming) == 0 &&
+			autodelete) {
 		/* remove shadowfd from list */
-		sfd->link.l_prev->l_next = sfd->link.l_next;
-		sfd->link.l_next->l_prev = sfd->link.l_prev;
-		sfd->link.l_next = NULL;
-		sfd->link.l_prev = NULL;
+		unlink_shadow(sfd);
 
 		destroy_unlinked_sfd(sfd);
 		return true;
@@ -184,31 +540,41 @@ bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd)
 				sfd->remote_id, sfd->refcount.protocol,
 				sfd->refcount.transfer);
 	}
+	if (!shadow_has_work(sfd)) {
+		/* Structures off the work list must already be registered for
+		 * the right events */
+		watch_pipe(sfd);
+		mark_shadow_idle(sfd);
+	}
 	return false;
 }
 
 static void *worker_thread_main(void *arg);
+static void publish_work_tasks(struct thread_pool *pool);
 void setup_translation_map(struct fd_translation_map *map, bool display_side)
 {
 	map->local_sign = display_side ? -1 : 1;
 	map->link.l_next = &map->link;
 	map->link.l_prev = &map->link;
 	map->max_local_id = 1;
+	memset(&map->rid_index, 0, sizeof(map->rid_index));
+	memset(&map->fd_index, 0, sizeof(map->fd_index));
+	memset(&map->file_index, 0, sizeof(map->file_index));
+	map->aliases = NULL;
+	map->naliases = 0;
+	map->aliases_size = 0;
+	map->epoll_fd = -1;
+	map->epoll_check_read = false;
+	map->work.l_next = &map->work;
+	map->work.l_prev = &map->work;
 }
 
 static void shutdown_threads(struct thread_pool *pool)
 {
-	pthread_mutex_lock(&pool->work_mutex);
-	free(pool->stack);
-	struct task_data task;
-	memset(&task, 0, sizeof(task));
-	task.type = TASK_STOP;
-	pool->stack = &task;
-	pool->stack_count = 1;
-	pool->stack_size = 1;
-	pool->do_work = true;
-	pthread_cond_broadcast(&pool->work_cond);
-	pthread_mutex_unlock(&pool->work_mutex);
+	atomic_store(&pool->stop_threads, true);
+	pthread_mutex_lock(&pool->sleep_mutex);
+	pthread_cond_broadcast(&pool->sleep_cond);
+	pthread_mutex_unlock(&pool->sleep_mutex);
 
 	if (pool->threads) {
 		for (int i = 1; i < pool->nthreads; i++) {
@@ -217,7 +583,162 @@ static void shutdown_threads(struct thread_pool *pool)
 			}
 		}
 	}
-	pool->stack = NULL;
+}
+
+/* Must be a power of two. Tasks beyond this limit wait on the main thread's
+ * stack until there is space. */
+#define TASK_QUEUE_SIZE 256
+
+static int setup_task_queue(struct task_queue *queue)
+{
+	queue->slots = calloc(TASK_QUEUE_SIZE, sizeof(struct task_slot));
+	if (!queue->slots) {
+		return -1;
+	}
+	queue->mask = TASK_QUEUE_SIZE - 1;
+	for (uint32_t i = 0; i < TASK_QUEUE_SIZE; i++) {
+		atomic_init(&queue->slots[i].seq, i);
+	}
+	atomic_init(&queue->head, 0);
+	queue->tail = 0;
+	return 0;
+}
+
+static int64_t ns_between(struct timespec t0, struct timespec t1)
+{
+	return (int64_t)(t1.tv_sec - t0.tv_sec) * 1000000000LL +
+	       (int64_t)(t1.tv_nsec - t0.tv_nsec);
+}
+
+static int clamp_limit(double v, int lo, int hi)
+{
+	return v < lo ? lo : v > hi ? hi : (int)v;
+}
+
+/* Time the diff kernel and damage merging, to choose the merge margin at
+ * which diffing the bytes in a gap costs about as much as keeping a separate
+ * subinterval (the per-call overhead of the diff kernel, plus merging it on
+ * the main thread), and how much damage can be sorted and merged within
+ * MERGE_TIME_LIMIT_NS. The fastest of a few runs is used. */
+static void tune_merge_policy(struct thread_pool *pool)
+{
+	const int size = 1 << 16;
+	const int nrows = 256, row_width = 64, row_stride = size / nrows;
+	const int nrects = 16, nentries = 1024;
+
+	struct merge_policy *policy = &pool->merge_policy;
+	policy->margin = MIN_MERGE_MARGIN;
+	policy->max_entries = INT32_MAX;
+	policy->max_rows = INT32_MAX;
+	policy->time_limit_ns = INT64_MAX;
+
+	void *base_handle = NULL, *changed_handle = NULL;
+	char *base = zeroed_aligned_alloc((size_t)size, 64, &base_handle);
+	char *changed = zeroed_aligned_alloc(
+			(size_t)size, 64, &changed_handle);
+	uint32_t *diff = malloc(2 * (size_t)size);
+	struct ext_interval *list = malloc(
+			sizeof(struct ext_interval) * (size_t)nentries);
+	if (!base || !changed || !diff || !list) {
+		wp_error("Failed to allocate space to time diff and merge kernels, using default merge policy");
+		policy->margin = 2 * MIN_MERGE_MARGIN;
+		policy->max_entries = 1 << 12;
+		policy->max_rows = 1 << 14;
+		policy->time_limit_ns = MERGE_TIME_LIMIT_NS;
+		goto cleanup;
+	}
+	/* A few changes per row, like a blinking cursor on a dark screen */
+	for (int i = 0; i < size; i += row_stride) {
+		changed[i + 8] = 1;
+		changed[i + 40] = 1;
+	}
+
+	const struct interval whole = {0, size};
+	const struct ext_interval rows = {.start = 0,
+			.width = row_width,
+			.rep = nrows,
+			.stride = row_stride};
+	int64_t full_ns = INT64_MAX, rows_ns = INT64_MAX,
+		sort_ns = INT64_MAX, merge_ns = INT64_MAX;
+	for (int k = 0; k < 4; k++) {
+		struct timespec t0, t1;
+		memset(base, 0, (size_t)size);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		construct_diff_core(pool->diff_func, pool->diff_alignment_bits,
+				&whole, 1, base, changed, diff);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		int64_t ns = ns_between(t0, t1);
+		full_ns = ns < full_ns ? ns : full_ns;
+
+		memset(base, 0, (size_t)size);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		construct_diff_strided(pool->diff_func,
+				pool->diff_alignment_bits, &rows, 1, base,
+				changed, diff);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ns = ns_between(t0, t1);
+		rows_ns = ns < rows_ns ? ns : rows_ns;
+
+		/* Shuffled intervals which need only be sorted */
+		for (int i = 0; i < nentries; i++) {
+			list[i] = (struct ext_interval){
+					.start = ((i * 797) % nentries) * 1024,
+					.width = row_width,
+					.rep = 1};
+		}
+		struct damage damage = {0};
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		merge_damage_records(&damage, nentries, list, policy);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		reset_damage(&damage);
+		ns = ns_between(t0, t1);
+		sort_ns = ns < sort_ns ? ns : sort_ns;
+
+		/* Interleaved rectangles, whose rows must all be merged */
+		for (int i = 0; i < nrects; i++) {
+			int offset = ((i * 7) % nrects) * row_stride;
+			list[i] = (struct ext_interval){.start = offset,
+					.width = row_width,
+					.rep = nrows,
+					.stride = nrects * row_stride};
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		merge_damage_records(&damage, nrects, list, policy);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		reset_damage(&damage);
+		ns = ns_between(t0, t1);
+		merge_ns = ns < merge_ns ? ns : merge_ns;
+	}
+
+	double byte_ns = (double)full_ns / size;
+	double row_diff_ns = ((double)rows_ns -
+					     byte_ns * (nrows * row_width)) /
+			     nrows;
+	double entry_ns = (double)sort_ns / nentries;
+	double row_merge_ns = (double)merge_ns / (nrects * nrows);
+	row_diff_ns = row_diff_ns > 0.0 ? row_diff_ns : 0.0;
+	byte_ns = byte_ns > 1e-4 ? byte_ns : 1e-4;
+
+	policy->margin = clamp_limit((row_diff_ns + row_merge_ns) / byte_ns,
+			MIN_MERGE_MARGIN, MAX_MERGE_MARGIN);
+	/* Sorting and merging take slightly more than linear time, so leave
+	 * half the time limit for that */
+	policy->max_entries = clamp_limit(
+			MERGE_TIME_LIMIT_NS / (2 * entry_ns + 1e-3), 64,
+			1 << 20);
+	policy->max_rows = clamp_limit(
+			MERGE_TIME_LIMIT_NS / (2 * row_merge_ns + 1e-3), 64,
+			1 << 20);
+	policy->time_limit_ns = MERGE_TIME_LIMIT_NS;
+	wp_debug("Diff kernel: %.3f ns/byte, %.1f ns/subinterval; damage merging: %.1f ns/interval, %.1f ns/subinterval; merge margin %d bytes, limit %d intervals or %d subintervals",
+			byte_ns, row_diff_ns, entry_ns, row_merge_ns,
+			policy->margin, policy->max_entries, policy->max_rows);
+
+cleanup:
+	zeroed_aligned_free(base, &base_handle);
+	zeroed_aligned_free(changed, &changed_handle);
+	free(diff);
+	free(list);
 }
 
 int setup_thread_pool(struct thread_pool *pool,
@@ -228,6 +749,7 @@ int setup_thread_pool(struct thread_pool *pool,
 
 	pool->diff_func = get_diff_function(
 			DIFF_FASTEST, &pool->diff_alignment_bits);
+	tune_merge_policy(pool);
 
 	pool->compression = compression;
 	pool->compression_level = comp_level;
@@ -241,8 +763,14 @@ int setup_thread_pool(struct thread_pool *pool,
 	pool->stack_size = 0;
 	pool->stack_count = 0;
 	pool->stack = NULL;
-	pool->tasks_in_progress = 0;
-	pool->do_work = true;
+	pool->next_queue = 0;
+	atomic_init(&pool->tasks_in_progress, 0);
+	atomic_init(&pool->incoming_in_progress, 0);
+	atomic_init(&pool->incoming_error, 0);
+	atomic_init(&pool->stop_threads, false);
+	atomic_init(&pool->nsleeping, 0);
+	atomic_init(&pool->compression_time, 0);
+	atomic_init(&pool->dict.stage, DICT_IDLE);
 
 	/* Thread #0 is the 'main' thread */
 	pool->threads = calloc(
@@ -253,38 +781,49 @@ int setup_thread_pool(struct thread_pool *pool,
 	}
 
 	int ret;
-	ret = pthread_mutex_init(&pool->work_mutex, NULL);
+	ret = pthread_mutex_init(&pool->sleep_mutex, NULL);
 	if (ret) {
 		wp_error("Mutex creation failed: %s", strerror(ret));
 		return -1;
 	}
-	ret = pthread_cond_init(&pool->work_cond, NULL);
+	ret = pthread_cond_init(&pool->sleep_cond, NULL);
 	if (ret) {
 		wp_error("Condition variable creation failed: %s",
 				strerror(ret));
 		return -1;
 	}
+	ret = pthread_mutex_init(&pool->dict.sample_lock, NULL);
+	if (ret) {
+		wp_error("Mutex creation failed: %s", strerror(ret));
+		return -1;
+	}
+
+	/* Setup thread local data from the main thread, to avoid requiring
+	 * the worker threads to allocate pools, for a few fixed buffers.
+	 * All queues must exist before any worker starts stealing. */
+	for (int i = 0; i < pool->nthreads; i++) {
+		pool->threads[i].pool = pool;
+		pool->threads[i].index = i;
+		setup_thread_local(&pool->threads[i], compression, comp_level);
+		if (setup_task_queue(&pool->threads[i].queue) == -1) {
+			wp_error("Failed to allocate task queue");
+			return -1;
+		}
+	}
 
-	pool->threads[0].pool = pool;
 	pool->threads[0].thread = pthread_self();
 	for (int i = 1; i < pool->nthreads; i++) {
-		pool->threads[i].pool = pool;
 		ret = pthread_create(&pool->threads[i].thread, NULL,
 				worker_thread_main, &pool->threads[i]);
 		if (ret) {
+			/* Stop making new threads, but keep what is there;
+			 * the queues of the missing threads remain in use,
+			 * since all threads steal from all queues */
 			wp_error("Thread creation failed: %s", strerror(ret));
-			// Stop making new threads, but keep what is there
-			pool->nthreads = i;
 			break;
 		}
 	}
 
-	/* Setup thread local data from the main thread, to avoid requiring
-	 * the worker threads to allocate pools, for a few fixed buffers */
-	for (int i = 0; i < pool->nthreads; i++) {
-		setup_thread_local(&pool->threads[i], compression, comp_level);
-	}
-
 	int fds[2];
 	if (pipe(fds) == -1) {
 		wp_error("Failed to create pipe: %s", strerror(errno));
@@ -295,6 +834,34 @@ int setup_thread_pool(struct thread_pool *pool,
 		wp_error("Failed to make read end of pipe nonblocking: %s",
 				strerror(errno));
 	}
+	pool->incoming_local = NULL;
+	pool->incoming_selfpipe_r = -1;
+	pool->incoming_selfpipe_w = -1;
+	return 0;
+}
+int setup_incoming_thread(struct thread_pool *pool)
+{
+	struct thread_data *local = calloc(1, sizeof(struct thread_data));
+	if (!local) {
+		wp_error("Failed to allocate thread local data");
+		return -1;
+	}
+	int fds[2];
+	if (pipe(fds) == -1) {
+		wp_error("Failed to create pipe: %s", strerror(errno));
+		free(local);
+		return -1;
+	}
+	if (set_nonblocking(fds[0]) == -1) {
+		wp_error("Failed to make read end of pipe nonblocking: %s",
+				strerror(errno));
+	}
+	local->pool = pool;
+	local->index = -1;
+	setup_thread_local(local, pool->compression, pool->compression_level);
+	pool->incoming_local = local;
+	pool->incoming_selfpipe_r = fds[0];
+	pool->incoming_selfpipe_w = fds[1];
 	return 0;
 }
 void cleanup_thread_pool(struct thread_pool *pool)
@@ -303,16 +870,33 @@ void cleanup_thread_pool(struct thread_pool *pool)
 	if (pool->threads) {
 		for (int i = 0; i < pool->nthreads; i++) {
 			cleanup_thread_local(&pool->threads[i]);
+			free(pool->threads[i].queue.slots);
 		}
 	}
 
-	pthread_mutex_destroy(&pool->work_mutex);
-	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->sleep_mutex);
+	pthread_cond_destroy(&pool->sleep_cond);
 	free(pool->threads);
 	free(pool->stack);
 
+	pthread_mutex_destroy(&pool->dict.sample_lock);
+	free(pool->dict.samples);
+	free(pool->dict.sample_sizes);
+	free(pool->dict.trained);
+	free(pool->dict.cdict_content);
+#ifdef HAS_ZSTD
+	ZSTD_freeCDict(pool->dict.cdict);
+	ZSTD_freeDDict(pool->dict.ddict);
+#endif
+
 	checked_close(pool->selfpipe_r);
 	checked_close(pool->selfpipe_w);
+	if (pool->incoming_local) {
+		cleanup_thread_local(pool->incoming_local);
+		free(pool->incoming_local);
+		checked_close(pool->incoming_selfpipe_r);
+		checked_close(pool->incoming_selfpipe_w);
+	}
 }
 
 const char *fdcat_to_str(enum fdcat cat)
@@ -441,7 +1025,18 @@ static void compress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 #ifdef HAS_LZ4
 	case COMP_LZ4: {
 		int ws;
-		if (pool->compression_level <= 0) {
+		if (pool->compression_level > 0 && !ctx->lz4_extstate_hc) {
+			/* The level was raised after the state was allocated;
+			 * the HC state is also large enough for the fast
+			 * routines, so it is never shrunk again */
+			void *hc_state = malloc((size_t)LZ4_sizeofStateHC());
+			if (hc_state) {
+				free(ctx->lz4_extstate);
+				ctx->lz4_extstate = hc_state;
+				ctx->lz4_extstate_hc = true;
+			}
+		}
+		if (pool->compression_level <= 0 || !ctx->lz4_extstate_hc) {
 			ws = LZ4_compress_fast_extState(ctx->lz4_extstate, ibuf,
 					mbuf, (int)isize, (int)msize,
 					-pool->compression_level);
@@ -461,8 +1056,14 @@ static void compress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 #endif
 #ifdef HAS_ZSTD
 	case COMP_ZSTD: {
-		size_t ws = ZSTD_compressCCtx(ctx->zstd_ccontext, mbuf, msize,
-				ibuf, isize, pool->compression_level);
+		size_t ws;
+		if (pool->dict.cdict) {
+			ws = ZSTD_compress_usingCDict(ctx->zstd_ccontext, mbuf,
+					msize, ibuf, isize, pool->dict.cdict);
+		} else {
+			ws = ZSTD_compressCCtx(ctx->zstd_ccontext, mbuf, msize,
+					ibuf, isize, pool->compression_level);
+		}
 		if (ZSTD_isError(ws)) {
 			wp_error("Zstd compression failed for %d bytes in %d of space: %s",
 					(int)isize, (int)msize,
@@ -515,8 +1116,28 @@ static void uncompress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 #endif
 #ifdef HAS_ZSTD
 	case COMP_ZSTD: {
-		size_t ws = ZSTD_decompressDCtx(
-				ctx->zstd_dcontext, mbuf, msize, ibuf, isize);
+		const ZSTD_DDict *ddict = NULL;
+#ifdef HAS_ZSTD_ADVANCED
+		unsigned dict_id = ZSTD_getDictID_fromFrame(ibuf, isize);
+		if (dict_id != 0 && dict_id != pool->dict.ddict_id) {
+			wp_error("Zstd data uses dictionary %u, but the last dictionary received was %u",
+					dict_id, pool->dict.ddict_id);
+			*wsize = 0;
+			*wbuf = mbuf;
+			break;
+		}
+		if (dict_id != 0) {
+			ddict = pool->dict.ddict;
+		}
+#endif
+		size_t ws;
+		if (ddict) {
+			ws = ZSTD_decompress_usingDDict(ctx->zstd_dcontext,
+					mbuf, msize, ibuf, isize, ddict);
+		} else {
+			ws = ZSTD_decompressDCtx(ctx->zstd_dcontext, mbuf,
+					msize, ibuf, isize);
+		}
 		if (ZSTD_isError(ws) || (size_t)ws != msize) {
 			wp_error("Zstd decompression failed for %d bytes to %d of space: %s",
 					(int)isize, (int)msize,
@@ -532,6 +1153,91 @@ static void uncompress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 	DTRACE_PROBE1(waypipe, uncompress_buffer_exit, *wsize);
 }
 
+/* Estimate whether the given intervals of `data`, with subintervals widened
+ * to multiples of 1 << bits, would barely shrink when compressed, by
+ * compressing a few samples of them at (at most) the fastest regular level.
+ * This is cheap compared to compressing the whole shard, and lets content
+ * like photos and video skip compression entirely. */
+static bool probe_incompressible(struct thread_pool *pool,
+		struct comp_ctx *ctx, const char *data,
+		const struct ext_interval *intervals, int nintervals, int bits)
+{
+	if (pool->compression == COMP_NONE) {
+		return false;
+	}
+	size_t total = 0;
+	for (int i = 0; i < nintervals; i++) {
+		total += (size_t)ext_interval_blocks(intervals[i], bits)
+			 << bits;
+	}
+	if (total < PROBE_MIN_SIZE) {
+		return false;
+	}
+
+	char sample[PROBE_NSAMPLES * PROBE_SAMPLE_SIZE];
+	char output[PROBE_NSAMPLES * PROBE_SAMPLE_SIZE];
+	size_t used = 0;
+	size_t base = 0;
+	int k = 0, r = 0;
+	for (size_t i = 0; i < PROBE_NSAMPLES; i++) {
+		/* Offset of the sample, as if the subintervals were
+		 * contiguous */
+		size_t offset = i * (total / PROBE_NSAMPLES);
+		struct interval row = {0, 0};
+		while (k < nintervals) {
+			row = ext_interval_row(intervals[k], r, bits);
+			size_t len = (size_t)(row.end - row.start);
+			if (base + len > offset) {
+				break;
+			}
+			base += len;
+			if (++r == intervals[k].rep) {
+				r = 0;
+				k++;
+			}
+		}
+		if (k == nintervals) {
+			break;
+		}
+		size_t start = (size_t)row.start + (offset - base);
+		size_t len = minu(PROBE_SAMPLE_SIZE, (size_t)row.end - start);
+		memcpy(sample + used, data + start, len);
+		used += len;
+	}
+	/* Compression fails iff the output does not fit in `limit` */
+	size_t limit = used - used / PROBE_MIN_SAVINGS;
+
+	bool incompressible = false;
+	DTRACE_PROBE1(waypipe, probe_compress_enter, used);
+	switch (pool->compression) {
+	default:
+	case COMP_NONE:
+		(void)ctx;
+		(void)output;
+		(void)limit;
+		break;
+#ifdef HAS_LZ4
+	case COMP_LZ4: {
+		int ws = LZ4_compress_fast_extState(ctx->lz4_extstate, sample,
+				output, (int)used, (int)limit,
+				max(-pool->compression_level, 1));
+		incompressible = ws == 0;
+		break;
+	}
+#endif
+#ifdef HAS_ZSTD
+	case COMP_ZSTD: {
+		size_t ws = ZSTD_compressCCtx(ctx->zstd_ccontext, output, limit,
+				sample, used, min(pool->compression_level, 1));
+		incompressible = ZSTD_isError(ws);
+		break;
+	}
+#endif
+	}
+	DTRACE_PROBE1(waypipe, probe_compress_exit, incompressible);
+	return incompressible;
+}
+
 struct shadow_fd *translate_fd(struct fd_translation_map *map,
 		struct render_data *render, int fd, enum fdcat type,
 		size_t file_sz, const struct dmabuf_slice_data *info,
@@ -554,18 +1260,16 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 		wp_error("Failed to allocate shadow_fd structure");
 		return NULL;
 	}
-	sfd->link.l_prev = &map->link;
-	sfd->link.l_next = map->link.l_next;
-	sfd->link.l_prev->l_next = &sfd->link;
-	sfd->link.l_next->l_prev = &sfd->link;
-
 	sfd->fd_local = fd;
+	sfd->pipe.fd = -1;
+	sfd->pipe.watched_fd = -1;
 	sfd->mem_local = NULL;
 	sfd->mem_mirror = NULL;
 	sfd->mem_mirror_handle = NULL;
 	sfd->buffer_size = 0;
 	sfd->remote_id = (map->max_local_id++) * map->local_sign;
 	sfd->type = type;
+	link_shadow(map, sfd);
 	// File changes must be propagated
 	sfd->is_dirty = true;
 	/* files/dmabufs are damaged by default; shm_pools are explicitly
@@ -614,6 +1318,16 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 					sfd->remote_id, strerror(errno));
 			return sfd;
 		}
+		struct stat st;
+		if (fstat(fd, &st) != -1 &&
+				shadow_index_insert(&map->file_index,
+						file_index_key(st.st_dev,
+								st.st_ino),
+						sfd) != -1) {
+			sfd->file_indexed = true;
+			sfd->file_dev = st.st_dev;
+			sfd->file_ino = st.st_ino;
+		}
 		// This will be created at the first transfer.
 		// todo: why not create it now?
 		sfd->mem_mirror = NULL;
@@ -625,6 +1339,7 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 			wp_error("Failed to make fd nonblocking");
 		}
 		sfd->pipe.fd = sfd->fd_local;
+		watch_pipe(sfd);
 
 		if (force_pipe_iw) {
 			sfd->pipe.can_write = true;
@@ -711,65 +1426,250 @@ static void *shrink_buffer(void *buf, size_t sz)
 	}
 }
 
-/* Construct and optionally compress a diff between sfd->mem_mirror and
- * the actual memmap'd data, and synchronize sfd->mem_mirror */
-static void worker_run_compress_diff(
-		struct task_data *task, struct thread_data *local)
+#ifdef HAS_ZSTD_ADVANCED
+/* If collecting samples for a zstd dictionary, copy the start of the data
+ * as a sample. Sampling is skipped instead of waiting for another thread. */
+static void add_dict_sample(
+		struct thread_pool *pool, const char *data, size_t size)
+{
+	struct zstd_dict_state *dict = &pool->dict;
+	if (!pool->zstd_dict || size == 0 ||
+			atomic_load_explicit(&dict->stage,
+					memory_order_relaxed) !=
+					DICT_COLLECTING) {
+		return;
+	}
+	if (pthread_mutex_trylock(&dict->sample_lock) != 0) {
+		return;
+	}
+	if (atomic_load(&dict->stage) == DICT_COLLECTING) {
+		size = minu(size, ZSTD_DICT_SAMPLE_SIZE);
+		size = minu(size, ZSTD_DICT_SAMPLE_SPACE - dict->samples_used);
+		memcpy(dict->samples + dict->samples_used, data, size);
+		dict->samples_used += size;
+		dict->sample_sizes[dict->nsamples++] = size;
+		if (dict->samples_used == ZSTD_DICT_SAMPLE_SPACE ||
+				dict->nsamples == ZSTD_DICT_MAX_SAMPLES) {
+			atomic_store(&dict->stage, DICT_FULL);
+		}
+	}
+	pthread_mutex_unlock(&dict->sample_lock);
+}
+
+static bool stream_compress_chunk(struct thread_pool *pool, ZSTD_CCtx *cctx,
+		ZSTD_outBuffer *out, const char *chunk, size_t size,
+		ZSTD_EndDirective mode)
+{
+	add_dict_sample(pool, chunk, size);
+	ZSTD_inBuffer in = {.src = chunk, .size = size, .pos = 0};
+	while (true) {
+		size_t ret = ZSTD_compressStream2(cctx, out, &in, mode);
+		if (ZSTD_isError(ret)) {
+			wp_error("Zstd streaming compression failed: %s",
+					ZSTD_getErrorName(ret));
+			return false;
+		}
+		bool finished = mode == ZSTD_e_end ? ret == 0
+						   : in.pos == in.size;
+		if (finished) {
+			return true;
+		}
+		if (out->pos == out->size) {
+			wp_error("Zstd streaming compression ran out of space, at %zu bytes",
+					out->size);
+			return false;
+		}
+	}
+}
+
+/* Construct the diff for the task in chunks of at most DIFF_STREAM_CHUNK_SIZE
+ * bytes, passing each chunk to the compressor as soon as it is ready, instead
+ * of making a second pass over the entire diff. The output is a single zstd
+ * frame, which decompresses to exactly what construct_diff_core() and
+ * construct_diff_trailing() would produce for the task's intervals, split at
+ * chunk boundaries. If `prefix` is not null, it is referenced by the frame,
+ * and must be provided again to decompress it; otherwise the current zstd
+ * dictionary, if there is one, is used. Returns false on failure. */
+static bool construct_diff_streaming(struct thread_pool *pool,
+		struct thread_data *local, struct task_data *task,
+		const char *source, const char *prefix, size_t prefix_size,
+		char *comp_buf, size_t comp_space, size_t *diffsize,
+		size_t *ntrailing, size_t *comp_size)
 {
 	struct shadow_fd *sfd = task->sfd;
-	struct thread_pool *pool = local->pool;
+	ZSTD_CCtx *cctx = local->comp_ctx.zstd_ccontext;
+	const size_t chunk_space = DIFF_STREAM_CHUNK_SIZE + 8;
+	if (buf_ensure_size((int)chunk_space, 1, &local->tmp_size,
+			    &local->tmp_buf) == -1) {
+		return false;
+	}
+	char *chunk = local->tmp_buf;
+	ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+			pool->compression_level);
+	if (prefix) {
+		ZSTD_CCtx_refPrefix(cctx, prefix, prefix_size);
+	} else if (pool->dict.cdict) {
+		ZSTD_CCtx_refCDict(cctx, pool->dict.cdict);
+	}
 
-	size_t damage_space = 0;
-	for (int i = 0; i < task->damage_len; i++) {
-		int range = task->damage_intervals[i].end -
-			    task->damage_intervals[i].start;
-		damage_space += (size_t)range + 8;
+	ZSTD_outBuffer out = {.dst = comp_buf, .size = comp_space, .pos = 0};
+	size_t used = 0;
+	size_t net_diff = 0;
+	for (int i = 0, k = 0; i < task->damage_len;) {
+		struct interval row = ext_interval_row(
+				task->damage_intervals[i], k,
+				pool->diff_alignment_bits);
+		if (++k == task->damage_intervals[i].rep) {
+			k = 0;
+			i++;
+		}
+		size_t start = (size_t)row.start;
+		size_t end = (size_t)row.end;
+		while (start < end) {
+			size_t piece_end = minu(
+					end, start + DIFF_STREAM_CHUNK_SIZE);
+			if (used + (piece_end - start) + 8 > chunk_space) {
+				if (!stream_compress_chunk(pool, cctx, &out,
+						    chunk, used,
+						    ZSTD_e_continue)) {
+					return false;
+				}
+				net_diff += used;
+				used = 0;
+			}
+			struct interval piece = {.start = (int32_t)start,
+					.end = (int32_t)piece_end};
+			used += construct_diff_core(pool->diff_func,
+					pool->diff_alignment_bits, &piece, 1,
+					sfd->mem_mirror, source, chunk + used);
+			start = piece_end;
+		}
 	}
+	*diffsize = net_diff + used;
+	*ntrailing = 0;
 	if (task->damaged_end) {
-		damage_space += 1u << pool->diff_alignment_bits;
+		if (used + (1u << pool->diff_alignment_bits) > chunk_space) {
+			if (!stream_compress_chunk(pool, cctx, &out, chunk,
+					    used, ZSTD_e_continue)) {
+				return false;
+			}
+			used = 0;
+		}
+		*ntrailing = construct_diff_trailing(sfd->buffer_size,
+				pool->diff_alignment_bits, sfd->mem_mirror,
+				source, chunk + used);
+		used += *ntrailing;
 	}
+	if (*diffsize == 0 && *ntrailing == 0) {
+		*comp_size = 0;
+		return true;
+	}
+	if (!stream_compress_chunk(
+			    pool, cctx, &out, chunk, used, ZSTD_e_end)) {
+		return false;
+	}
+	*comp_size = out.pos;
+	return true;
+}
+#endif
 
-	DTRACE_PROBE1(waypipe, worker_compdiff_enter, damage_space);
-
-	char *diff_buffer = NULL;
-	char *diff_target = NULL;
-	if (pool->compression == COMP_NONE) {
-		diff_buffer = malloc(
-				damage_space + sizeof(struct wmsg_buffer_diff));
-		if (!diff_buffer) {
-			wp_error("Allocation failed, dropping diff transfer block");
-			goto end;
-		}
-		diff_target = diff_buffer + sizeof(struct wmsg_buffer_diff);
-	} else {
-		if (buf_ensure_size((int)damage_space, 1, &local->tmp_size,
-				    &local->tmp_buf) == -1) {
-			wp_error("Allocation failed, dropping diff transfer block");
-			goto end;
+/* The region of sfd->mem_mirror which a diff task uses as a compression
+ * prefix: from the start of its first interval to the end of its damage */
+static void get_diff_prefix_region(struct thread_pool *pool,
+		const struct task_data *task, size_t *start, size_t *end)
+{
+	const struct shadow_fd *sfd = task->sfd;
+	size_t alignment = 1u << pool->diff_alignment_bits;
+	*start = alignment * (sfd->buffer_size / alignment);
+	*end = sfd->buffer_size;
+	if (task->damage_len > 0) {
+		int bits = pool->diff_alignment_bits;
+		const struct ext_interval *list = task->damage_intervals;
+		struct interval row = ext_interval_row(list[0], 0, bits);
+		*start = (size_t)row.start;
+		if (!task->damaged_end) {
+			struct ext_interval last = list[task->damage_len - 1];
+			row = ext_interval_row(last, last.rep - 1, bits);
+			*end = (size_t)row.end;
 		}
-		diff_target = local->tmp_buf;
+	}
+	*end = minu(*end, *start + DIFF_PREFIX_MAX_SIZE);
+}
+
+size_t dmabuf_local_offset(const struct shadow_fd *sfd, size_t pos)
+{
+	size_t tx_stride = (size_t)sfd->dmabuf_info.strides[0];
+	return (pos % tx_stride) + (pos / tx_stride - sfd->dmabuf_map_row) *
+						   sfd->dmabuf_map_stride;
+}
+
+/* Construct and optionally compress a diff between sfd->mem_mirror and
+ * the actual memmap'd data, and synchronize sfd->mem_mirror */
+static void worker_run_compress_diff(
+		struct task_data *task, struct thread_data *local)
+{
+	struct shadow_fd *sfd = task->sfd;
+	struct thread_pool *pool = local->pool;
+
+	size_t damage_space = 0;
+	for (int i = 0; i < task->damage_len; i++) {
+		const struct ext_interval e = task->damage_intervals[i];
+		size_t range = (size_t)ext_interval_blocks(
+					       e, pool->diff_alignment_bits)
+			       << pool->diff_alignment_bits;
+		/* Each subinterval has a header; streaming also splits them
+		 * into chunk-sized pieces */
+		damage_space += range + 8 * (size_t)e.rep +
+				8 * (range / DIFF_STREAM_CHUNK_SIZE);
+	}
+	if (task->damaged_end) {
+		damage_space += 1u << pool->diff_alignment_bits;
+	}
+
+	DTRACE_PROBE1(waypipe, worker_compdiff_enter, damage_space);
+
+	bool streaming = false;
+	bool with_prefix = false;
+#ifdef HAS_ZSTD_ADVANCED
+	if (pool->compression == COMP_ZSTD) {
+		with_prefix = pool->zstd_prefix;
+		streaming = with_prefix ||
+			    damage_space > DIFF_STREAM_CHUNK_SIZE;
+	}
+#endif
+	size_t header_size = sizeof(struct wmsg_buffer_diff);
+	if (with_prefix) {
+		header_size = sizeof(struct wmsg_buffer_prefix_diff);
 	}
 
 	DTRACE_PROBE1(waypipe, construct_diff_enter, task->damage_len);
 	char *source = sfd->mem_local;
-	if (sfd->type == FDC_DMABUF &&
-			sfd->dmabuf_map_stride != sfd->dmabuf_info.strides[0]) {
+	bool warp = sfd->type == FDC_DMABUF &&
+		    (sfd->dmabuf_map_stride != sfd->dmabuf_info.strides[0] ||
+				    sfd->dmabuf_map_row > 0);
+	if (warp) {
 		size_t tx_stride = (size_t)sfd->dmabuf_info.strides[0];
 		size_t common = (size_t)minu(sfd->dmabuf_map_stride, tx_stride);
 		/* copy mapped data to temporary buffer whose stride matches
-		 * what is sent over the wire */
-		for (int i = 0; i < task->damage_len; i++) {
-			size_t start = (size_t)task->damage_intervals[i].start;
-			size_t end = (size_t)task->damage_intervals[i].end;
-			size_t loc_start =
-					(start % tx_stride) +
-					(start / tx_stride) *
-							sfd->dmabuf_map_stride;
-			size_t loc_end = (end % tx_stride) +
-					 (end / tx_stride) *
-							 sfd->dmabuf_map_stride;
-
-			stride_shifted_copy(sfd->dmabuf_warped, sfd->mem_local,
+		 * what is sent over the wire; only the damaged rows may be
+		 * mapped, starting at row dmabuf_map_row */
+		char *warp_rows = sfd->dmabuf_warped +
+				  tx_stride * sfd->dmabuf_map_row;
+		for (int i = 0, k = 0; i < task->damage_len;) {
+			struct interval row = ext_interval_row(
+					task->damage_intervals[i], k,
+					pool->diff_alignment_bits);
+			if (++k == task->damage_intervals[i].rep) {
+				k = 0;
+				i++;
+			}
+			size_t start = (size_t)row.start;
+			size_t end = (size_t)row.end;
+			size_t loc_start = dmabuf_local_offset(sfd, start);
+			size_t loc_end = dmabuf_local_offset(sfd, end);
+
+			stride_shifted_copy(warp_rows, sfd->mem_local,
 					loc_start, loc_end - loc_start, common,
 					sfd->dmabuf_map_stride,
 					sfd->dmabuf_info.strides[0]);
@@ -781,15 +1681,10 @@ static void worker_run_compress_diff(
 				       (sfd->buffer_size / alignment);
 			size_t end = sfd->buffer_size;
 
-			size_t loc_start =
-					(start % tx_stride) +
-					(start / tx_stride) *
-							sfd->dmabuf_map_stride;
-			size_t loc_end = (end % tx_stride) +
-					 (end / tx_stride) *
-							 sfd->dmabuf_map_stride;
+			size_t loc_start = dmabuf_local_offset(sfd, start);
+			size_t loc_end = dmabuf_local_offset(sfd, end);
 
-			stride_shifted_copy(sfd->dmabuf_warped, sfd->mem_local,
+			stride_shifted_copy(warp_rows, sfd->mem_local,
 					loc_start, loc_end - loc_start, common,
 					sfd->dmabuf_map_stride,
 					sfd->dmabuf_info.strides[0]);
@@ -798,10 +1693,95 @@ static void worker_run_compress_diff(
 		source = sfd->dmabuf_warped;
 	}
 
-	size_t diffsize = construct_diff_core(pool->diff_func,
+	/* With a prefix, the previous contents can make otherwise
+	 * incompressible data compress well, so it is not probed */
+	bool raw = pool->compression == COMP_NONE;
+	if (!raw && !with_prefix && pool->raw_blocks) {
+		raw = probe_incompressible(pool, &local->comp_ctx, source,
+				task->damage_intervals, task->damage_len,
+				pool->diff_alignment_bits);
+		streaming = streaming && !raw;
+	}
+
+	char *diff_buffer = NULL;
+	char *diff_target = NULL;
+	if (streaming) {
+		/* diff chunks are constructed in local->tmp_buf */
+	} else if (raw) {
+		diff_buffer = malloc(
+				damage_space + sizeof(struct wmsg_buffer_diff));
+		if (!diff_buffer) {
+			wp_error("Allocation failed, dropping diff transfer block");
+			goto end;
+		}
+		diff_target = diff_buffer + sizeof(struct wmsg_buffer_diff);
+	} else {
+		if (buf_ensure_size((int)damage_space, 1, &local->tmp_size,
+				    &local->tmp_buf) == -1) {
+			wp_error("Allocation failed, dropping diff transfer block");
+			goto end;
+		}
+		diff_target = local->tmp_buf;
+	}
+
+	uint8_t *msg;
+	size_t sz;
+	size_t diffsize = 0;
+	size_t ntrailing = 0;
+	size_t prefix_start = 0, prefix_end = 0;
+	if (streaming) {
+		const char *prefix = NULL;
+		if (with_prefix) {
+			/* The diff will overwrite the region in the mirror, so
+			 * use a copy of its current contents as the prefix */
+			get_diff_prefix_region(
+					pool, task, &prefix_start, &prefix_end);
+			if (buf_ensure_size((int)(prefix_end - prefix_start), 1,
+					    &local->prefix_size,
+					    &local->prefix_buf) == -1) {
+				wp_error("Allocation failed, dropping diff transfer block");
+				goto end;
+			}
+			memcpy(local->prefix_buf,
+					sfd->mem_mirror + prefix_start,
+					prefix_end - prefix_start);
+			prefix = local->prefix_buf;
+		}
+
+		size_t comp_size = compress_bufsize(pool, damage_space);
+		char *comp_buf = malloc(alignz(comp_size, 4) + header_size);
+		if (!comp_buf) {
+			wp_error("Allocation failed, dropping diff transfer block");
+			goto end;
+		}
+		size_t act_comp_size = 0;
+		bool ok = false;
+#ifdef HAS_ZSTD_ADVANCED
+		ok = construct_diff_streaming(pool, local, task, source,
+				prefix, prefix_end - prefix_start,
+				comp_buf + header_size, comp_size, &diffsize,
+				&ntrailing, &act_comp_size);
+#else
+		(void)prefix;
+#endif
+		if (!ok) {
+			wp_error("Failed to stream diff, dropping diff transfer block");
+			free(comp_buf);
+			goto end;
+		}
+		DTRACE_PROBE1(waypipe, construct_diff_exit, diffsize);
+		if (diffsize == 0 && ntrailing == 0) {
+			free(comp_buf);
+			goto end;
+		}
+		sz = act_comp_size + header_size;
+		msg = (uint8_t *)comp_buf;
+		goto send;
+	}
+
+	diffsize = construct_diff_strided(pool->diff_func,
 			pool->diff_alignment_bits, task->damage_intervals,
 			task->damage_len, sfd->mem_mirror, source, diff_target);
-	size_t ntrailing = 0;
 	if (task->damaged_end) {
 		ntrailing = construct_diff_trailing(sfd->buffer_size,
 				pool->diff_alignment_bits, sfd->mem_mirror,
@@ -814,10 +1794,8 @@ static void worker_run_compress_diff(
 		goto end;
 	}
 
-	uint8_t *msg;
-	size_t sz;
 	size_t net_diff_sz = diffsize + ntrailing;
-	if (pool->compression == COMP_NONE) {
+	if (raw) {
 		sz = net_diff_sz + sizeof(struct wmsg_buffer_diff);
 		msg = (uint8_t *)diff_buffer;
 	} else {
@@ -829,21 +1807,48 @@ static void worker_run_compress_diff(
 			wp_error("Allocation failed, dropping diff transfer block");
 			goto end;
 		}
+#ifdef HAS_ZSTD_ADVANCED
+		add_dict_sample(pool, diff_target, net_diff_sz);
+#endif
 		compress_buffer(pool, &local->comp_ctx, net_diff_sz,
 				diff_target, comp_size,
 				comp_buf + sizeof(struct wmsg_buffer_diff),
 				&dst);
+		if (pool->raw_blocks &&
+				(dst.size == 0 || dst.size >= net_diff_sz)) {
+			/* The compression bound is at least the input size */
+			memcpy(comp_buf + sizeof(struct wmsg_buffer_diff),
+					diff_target, net_diff_sz);
+			dst.size = net_diff_sz;
+			raw = true;
+		}
 		sz = dst.size + sizeof(struct wmsg_buffer_diff);
 		msg = (uint8_t *)comp_buf;
 	}
+send:
 	msg = shrink_buffer(msg, alignz(sz, 4));
 	memset(msg + sz, 0, alignz(sz, 4) - sz);
-	struct wmsg_buffer_diff header;
-	header.size_and_type = transfer_header(sz, WMSG_BUFFER_DIFF);
-	header.remote_id = sfd->remote_id;
-	header.diff_size = (uint32_t)diffsize;
-	header.ntrailing = (uint32_t)ntrailing;
-	memcpy(msg, &header, sizeof(struct wmsg_buffer_diff));
+	if (with_prefix) {
+		struct wmsg_buffer_prefix_diff header;
+		header.size_and_type =
+				transfer_header(sz, WMSG_BUFFER_PREFIX_DIFF);
+		header.remote_id = sfd->remote_id;
+		header.diff_size = (uint32_t)diffsize;
+		header.ntrailing = (uint32_t)ntrailing;
+		header.prefix_start = (uint32_t)prefix_start;
+		header.prefix_end = (uint32_t)prefix_end;
+		memcpy(msg, &header, sizeof(struct wmsg_buffer_prefix_diff));
+	} else {
+		struct wmsg_buffer_diff header;
+		header.size_and_type = transfer_header(sz,
+				raw && pool->compression != COMP_NONE
+						? WMSG_BUFFER_DIFF_RAW
+						: WMSG_BUFFER_DIFF);
+		header.remote_id = sfd->remote_id;
+		header.diff_size = (uint32_t)diffsize;
+		header.ntrailing = (uint32_t)ntrailing;
+		memcpy(msg, &header, sizeof(struct wmsg_buffer_diff));
+	}
 
 	transfer_async_add(task->msg_queue, msg, alignz(sz, 4));
 
@@ -892,7 +1897,39 @@ static void worker_run_compress_block(
 
 	size_t sz = 0;
 	uint8_t *msg;
-	if (pool->compression == COMP_NONE) {
+	struct ext_interval zone = {.start = task->zone_start,
+			.width = task->zone_end - task->zone_start,
+			.rep = 1,
+			.stride = 0};
+	bool raw = pool->compression == COMP_NONE;
+	if (!raw && pool->raw_blocks) {
+		raw = probe_incompressible(pool, &local->comp_ctx,
+				sfd->mem_mirror, &zone, 1, 0);
+	}
+	if (raw && sfd->mirror_shared) {
+		/* Send the block straight out of the mirror, which stays
+		 * allocated until the transfer is acknowledged. The mirror
+		 * allocation is padded, so the trailing bytes are in bounds */
+		sz = sizeof(struct wmsg_buffer_fill) +
+		     (source_end - source_start);
+		struct wmsg_buffer_fill *header = malloc(sizeof(*header));
+		if (!header) {
+			wp_error("Allocation failed, dropping fill transfer block");
+			goto end;
+		}
+		header->size_and_type = transfer_header(sz,
+				pool->compression != COMP_NONE
+						? WMSG_BUFFER_FILL_RAW
+						: WMSG_BUFFER_FILL);
+		header->remote_id = sfd->remote_id;
+		header->start = (uint32_t)source_start;
+		header->end = (uint32_t)source_end;
+		transfer_async_add_borrowed(task->msg_queue, header,
+				sizeof(*header), sfd->mirror_shared,
+				sfd->mem_mirror + source_start,
+				alignz(sz, 4) - sizeof(*header));
+		goto end;
+	} else if (raw) {
 		sz = sizeof(struct wmsg_buffer_fill) +
 		     (source_end - source_start);
 
@@ -919,12 +1956,25 @@ static void worker_run_compress_block(
 				&sfd->mem_mirror[source_start], comp_size,
 				(char *)msg + sizeof(struct wmsg_buffer_fill),
 				&dst);
+		bool no_gain = dst.size == 0 ||
+			       dst.size >= source_end - source_start;
+		if (pool->raw_blocks && no_gain) {
+			/* The compression bound is at least the input size */
+			memcpy(msg + sizeof(struct wmsg_buffer_fill),
+					sfd->mem_mirror + source_start,
+					source_end - source_start);
+			dst.size = source_end - source_start;
+			raw = true;
+		}
 		sz = dst.size + sizeof(struct wmsg_buffer_fill);
 		msg = shrink_buffer(msg, alignz(sz, 4));
 	}
 	memset(msg + sz, 0, alignz(sz, 4) - sz);
 	struct wmsg_buffer_fill header;
-	header.size_and_type = transfer_header(sz, WMSG_BUFFER_FILL);
+	header.size_and_type = transfer_header(sz,
+			raw && pool->compression != COMP_NONE
+					? WMSG_BUFFER_FILL_RAW
+					: WMSG_BUFFER_FILL);
 	header.remote_id = sfd->remote_id;
 	header.start = (uint32_t)source_start;
 	header.end = (uint32_t)source_end;
@@ -959,14 +2009,26 @@ static void queue_fill_transfers(struct thread_pool *threads,
 	/* Keep sfd alive at least until write to channel is done */
 	sfd->refcount.compute = true;
 
+	/* Uncompressed fills can then be sent straight from the mirror. With
+	 * a zstd prefix, diffs must be decompressed against exactly what the
+	 * fills sent, which would not be true if they were replayed after
+	 * a reconnection, with the mirror having changed since */
+	bool with_prefix = threads->compression == COMP_ZSTD &&
+			   threads->zstd_prefix;
+	if (!sfd->mirror_shared && !with_prefix) {
+		sfd->mirror_shared = shared_buffer_create(
+				sfd->mem_mirror, sfd->mem_mirror_handle);
+		if (sfd->mirror_shared) {
+			sfd->mem_mirror_handle = NULL;
+		}
+	}
+
 	int nshards = ceildiv((region_end - region_start), chunksize);
 
-	pthread_mutex_lock(&threads->work_mutex);
 	if (buf_ensure_size(threads->stack_count + nshards,
 			    sizeof(struct task_data), &threads->stack_size,
 			    (void **)&threads->stack) == -1) {
 		wp_error("Allocation failed, dropping some fill tasks");
-		pthread_mutex_unlock(&threads->work_mutex);
 		return;
 	}
 
@@ -983,7 +2045,7 @@ static void queue_fill_transfers(struct thread_pool *threads,
 				region_start, region_end, nshards, i + 1);
 		threads->stack[threads->stack_count++] = task;
 	}
-	pthread_mutex_unlock(&threads->work_mutex);
+	atomic_fetch_add(&threads->tasks_in_progress, nshards);
 }
 
 static void queue_diff_transfers(struct thread_pool *threads,
@@ -997,11 +2059,11 @@ static void queue_diff_transfers(struct thread_pool *threads,
 	/* Keep sfd alive at least until write to channel is done */
 	sfd->refcount.compute = true;
 
-	int bs = 1 << threads->diff_alignment_bits;
+	int bits = threads->diff_alignment_bits;
+	int bs = 1 << bits;
 	int align_end = bs * ((int)sfd->buffer_size / bs);
 	bool check_tail = false;
 
-	int net_damage = 0;
 	if (sfd->damage.damage == DAMAGE_EVERYTHING) {
 		reset_damage(&sfd->damage);
 		struct ext_interval all = {.start = 0,
@@ -1009,35 +2071,49 @@ static void queue_diff_transfers(struct thread_pool *threads,
 				.rep = 1,
 				.stride = 0};
 		merge_damage_records(&sfd->damage, 1, &all,
-				threads->diff_alignment_bits);
+				&threads->merge_policy);
 		check_tail = true;
-		net_damage = align_end;
-	} else {
-		for (int ir = 0, iw = 0; ir < sfd->damage.ndamage_intvs; ir++) {
-			/* Extend all damage to the nearest alignment block */
-			struct interval e = sfd->damage.damage[ir];
-			check_tail |= e.end > align_end;
-			e.end = min(e.end, align_end);
-			if (e.start < e.end) {
-				/* End clipping may produce empty/degenerate
-				 * intervals, so filter them out now */
-				sfd->damage.damage[iw++] = e;
-				net_damage += e.end - e.start;
-			}
-			if (e.end & (bs - 1) || e.start & (bs - 1)) {
-				wp_error("Interval [%d, %d) is not aligned",
-						e.start, e.end);
-			}
+	}
+
+	/* Drop or clip the subintervals which, once extended to the nearest
+	 * alignment block, pass the last full block. Since subintervals
+	 * are sorted, these are at the end of the list */
+	struct ext_interval *damage = sfd->damage.damage;
+	int ndamage = sfd->damage.ndamage_intvs;
+	struct ext_interval clipped = {0};
+	while (ndamage > 0) {
+		struct ext_interval *e = &damage[ndamage - 1];
+		struct interval row = ext_interval_row(*e, e->rep - 1, bits);
+		if (row.end <= align_end) {
+			break;
+		}
+		check_tail = true;
+		if (--e->rep == 0) {
+			ndamage--;
+		}
+		if (row.start < align_end) {
+			clipped = (struct ext_interval){.start = row.start,
+					.width = align_end - row.start,
+					.rep = 1,
+					.stride = 0};
+			break;
 		}
 	}
-	int nshards = ceildiv(net_damage, chunksize);
+	int nsrc = ndamage + (clipped.rep > 0);
+
+	int net_blocks = 0;
+	for (int i = 0; i < ndamage; i++) {
+		net_blocks += ext_interval_blocks(damage[i], bits);
+	}
+	net_blocks += ext_interval_blocks(clipped, bits);
+	int nshards = ceildiv(net_blocks * bs, chunksize);
 
 	/* Instead of allocating individual buffers for each task, create a
 	 * global damage tracking buffer into which tasks index. It will be
-	 * deleted in `finish_update`. */
-	struct interval *intvs = malloc(
-			sizeof(struct interval) *
-			(size_t)(sfd->damage.ndamage_intvs + nshards));
+	 * deleted in `finish_update`. Splitting an extended interval
+	 * between two shards produces at most three more of them. */
+	struct ext_interval *intvs = malloc(sizeof(struct ext_interval) *
+					    (size_t)(nsrc + 3 * nshards));
 	int *offsets = calloc((size_t)nshards + 1, sizeof(int));
 	if (!offsets || !intvs) {
 		// TODO: avoid making this allocation entirely
@@ -1048,32 +2124,70 @@ static void queue_diff_transfers(struct thread_pool *threads,
 	}
 
 	sfd->damage_task_interval_store = intvs;
-	int tot_blocks = net_damage / bs;
-	int ir = 0, iw = 0, acc_prev_blocks = 0;
+	int ir = 0, iw = 0;
+	/* A stack holding the remainder of a split extended interval, to
+	 * be taken before the next entry of the damage list */
+	struct ext_interval pending[2];
+	int npending = 0;
 	for (int shard = 0; shard < nshards; shard++) {
-		int s_lower = split_interval(0, tot_blocks, nshards, shard);
-		int s_upper = split_interval(0, tot_blocks, nshards, shard + 1);
-
-		while (acc_prev_blocks < s_upper &&
-				ir < sfd->damage.ndamage_intvs) {
-			struct interval e = sfd->damage.damage[ir];
-			const int w = (e.end - e.start) / bs;
-
-			int a_low = max(0, s_lower - acc_prev_blocks);
-			int a_high = min(w, s_upper - acc_prev_blocks);
+		int budget = split_interval(0, net_blocks, nshards, shard + 1) -
+			     split_interval(0, net_blocks, nshards, shard);
+
+		while (budget > 0) {
+			struct ext_interval e;
+			if (npending > 0) {
+				e = pending[--npending];
+			} else if (ir < nsrc) {
+				e = ir < ndamage ? damage[ir] : clipped;
+				ir++;
+			} else {
+				break;
+			}
 
-			struct interval r = {
-					.start = e.start + bs * a_low,
-					.end = e.start + bs * a_high,
-			};
-			intvs[iw++] = r;
+			int w = ext_interval_blocks(e, bits);
+			if (w <= budget) {
+				intvs[iw++] = e;
+				budget -= w;
+				continue;
+			}
 
-			if (acc_prev_blocks + w > s_upper) {
-				break;
-			} else {
-				acc_prev_blocks += w;
-				ir++;
+			/* Take as many whole subintervals as fit, and then
+			 * the start of the next one */
+			int k = 0;
+			struct interval row = ext_interval_row(e, 0, bits);
+			while ((row.end - row.start) >> bits <= budget) {
+				budget -= (row.end - row.start) >> bits;
+				row = ext_interval_row(e, ++k, bits);
+			}
+			if (k > 0) {
+				intvs[iw++] = (struct ext_interval){
+						.start = e.start,
+						.width = e.width,
+						.rep = k,
+						.stride = e.stride};
+			}
+			int cut = row.start + budget * bs;
+			if (budget > 0) {
+				intvs[iw++] = (struct ext_interval){
+						.start = row.start,
+						.width = cut - row.start,
+						.rep = 1,
+						.stride = 0};
 			}
+			if (k + 1 < e.rep) {
+				pending[npending++] = (struct ext_interval){
+						.start = e.start +
+							 (k + 1) * e.stride,
+						.width = e.width,
+						.rep = e.rep - k - 1,
+						.stride = e.stride};
+			}
+			pending[npending++] = (struct ext_interval){
+					.start = cut,
+					.width = row.end - cut,
+					.rep = 1,
+					.stride = 0};
+			budget = 0;
 		}
 
 		offsets[shard + 1] = iw;
@@ -1081,12 +2195,10 @@ static void queue_diff_transfers(struct thread_pool *threads,
 	/* Reset damage, once it has been applied */
 	reset_damage(&sfd->damage);
 
-	pthread_mutex_lock(&threads->work_mutex);
 	if (buf_ensure_size(threads->stack_count + nshards,
 			    sizeof(struct task_data), &threads->stack_size,
 			    (void **)&threads->stack) == -1) {
 		wp_error("Allocation failed, dropping some diff tasks");
-		pthread_mutex_unlock(&threads->work_mutex);
 		free(offsets);
 		return;
 	}
@@ -1105,7 +2217,7 @@ static void queue_diff_transfers(struct thread_pool *threads,
 
 		threads->stack[threads->stack_count++] = task;
 	}
-	pthread_mutex_unlock(&threads->work_mutex);
+	atomic_fetch_add(&threads->tasks_in_progress, nshards);
 	free(offsets);
 }
 
@@ -1182,6 +2294,182 @@ void finish_update(struct shadow_fd *sfd)
 	sfd->refcount.compute = false;
 }
 
+#ifdef HAS_ZSTD_ADVANCED
+/* Replace the dictionary used for compression with the trained one, and
+ * queue a message to send it to the other side */
+static void adopt_trained_dictionary(
+		struct thread_pool *threads, struct transfer_queue *transfers)
+{
+	struct zstd_dict_state *dict = &threads->dict;
+	ZSTD_CDict *cdict = ZSTD_createCDict(dict->trained,
+			dict->trained_size, threads->compression_level);
+	size_t sz = sizeof(struct wmsg_zstd_dictionary) + dict->trained_size;
+	char *msg = calloc(1, alignz(sz, 4));
+	char *content = malloc(dict->trained_size);
+	if (!cdict || !msg || !content) {
+		wp_error("Failed to allocate zstd dictionary of %zu bytes",
+				dict->trained_size);
+		goto fail;
+	}
+	struct wmsg_zstd_dictionary header;
+	header.size_and_type = transfer_header(sz, WMSG_ZSTD_DICTIONARY);
+	header.dict_id = ZSTD_getDictID_fromCDict(cdict);
+	memcpy(msg, &header, sizeof(struct wmsg_zstd_dictionary));
+	memcpy(msg + sizeof(struct wmsg_zstd_dictionary), dict->trained,
+			dict->trained_size);
+	if (transfer_add(transfers, alignz(sz, 4), msg) == -1) {
+		wp_error("Failed to queue zstd dictionary message");
+		goto fail;
+	}
+	wp_debug("Sending zstd dictionary %u, trained from %u samples, of %zu bytes",
+			header.dict_id, dict->nsamples, dict->trained_size);
+	ZSTD_freeCDict(dict->cdict);
+	free(dict->cdict_content);
+	memcpy(content, dict->trained, dict->trained_size);
+	dict->cdict = cdict;
+	dict->cdict_content = content;
+	dict->cdict_size = dict->trained_size;
+	dict->cdict_level = threads->compression_level;
+	return;
+fail:
+	ZSTD_freeCDict(cdict);
+	free(msg);
+	free(content);
+}
+
+/* A CDict fixes the compression level used with it, so remake the current
+ * dictionary's CDict after the level was changed */
+static void refresh_dictionary_level(struct thread_pool *threads)
+{
+	struct zstd_dict_state *dict = &threads->dict;
+	if (!dict->cdict || dict->cdict_level == threads->compression_level ||
+			atomic_load(&threads->tasks_in_progress) > 0) {
+		return;
+	}
+	ZSTD_CDict *cdict = ZSTD_createCDict(dict->cdict_content,
+			dict->cdict_size, threads->compression_level);
+	if (!cdict) {
+		wp_error("Failed to allocate zstd dictionary of %zu bytes",
+				dict->cdict_size);
+		return;
+	}
+	ZSTD_freeCDict(dict->cdict);
+	dict->cdict = cdict;
+	dict->cdict_level = threads->compression_level;
+}
+#endif
+
+void update_zstd_dictionary(
+		struct thread_pool *threads, struct transfer_queue *transfers)
+{
+#ifdef HAS_ZSTD_ADVANCED
+	struct zstd_dict_state *dict = &threads->dict;
+	/* Training takes tens of milliseconds, so it is only done by worker
+	 * threads, and never on the main thread */
+	if (!threads->zstd_dict || threads->compression != COMP_ZSTD ||
+			threads->nthreads <= 1) {
+		return;
+	}
+	refresh_dictionary_level(threads);
+
+	int stage = atomic_load(&dict->stage);
+	if (stage == DICT_IDLE) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		time_t elapsed = now.tv_sec - dict->last_trained.tv_sec;
+		if (dict->has_trained && elapsed < ZSTD_DICT_RETRAIN_SECONDS) {
+			return;
+		}
+		if (!dict->samples) {
+			dict->samples = malloc(ZSTD_DICT_SAMPLE_SPACE);
+			dict->sample_sizes = calloc(
+					ZSTD_DICT_MAX_SAMPLES, sizeof(size_t));
+			dict->trained = malloc(ZSTD_DICT_CAPACITY);
+			if (!dict->samples || !dict->sample_sizes ||
+					!dict->trained) {
+				wp_error("Failed to allocate space to train zstd dictionaries, disabling them");
+				threads->zstd_dict = false;
+				return;
+			}
+		}
+		dict->samples_used = 0;
+		dict->nsamples = 0;
+		atomic_store(&dict->stage, DICT_COLLECTING);
+	} else if (stage == DICT_FULL) {
+		/* Wake a worker thread to train the dictionary */
+		if (atomic_load(&threads->nsleeping) > 0) {
+			pthread_mutex_lock(&threads->sleep_mutex);
+			pthread_cond_broadcast(&threads->sleep_cond);
+			pthread_mutex_unlock(&threads->sleep_mutex);
+		}
+	} else if (stage == DICT_TRAINED) {
+		if (atomic_load(&threads->tasks_in_progress) > 0) {
+			/* The current dictionary may still be in use */
+			return;
+		}
+		if (dict->trained_size > 0) {
+			adopt_trained_dictionary(threads, transfers);
+		}
+		dict->has_trained = true;
+		clock_gettime(CLOCK_MONOTONIC, &dict->last_trained);
+		atomic_store(&dict->stage, DICT_IDLE);
+	}
+#else
+	(void)threads;
+	(void)transfers;
+#endif
+}
+
+void get_damaged_rows(const struct thread_pool *threads,
+		const struct shadow_fd *sfd, uint32_t *row_start,
+		uint32_t *row_end)
+{
+	size_t tx_stride = (size_t)sfd->dmabuf_info.strides[0];
+	if (sfd->damage.damage == DAMAGE_EVERYTHING || tx_stride == 0) {
+		return;
+	}
+	if (!sfd->damage.damage) {
+		*row_end = *row_start;
+		return;
+	}
+	/* Damage is diffed in whole alignment blocks, which may reach into
+	 * the next row */
+	int bits = threads->diff_alignment_bits;
+	size_t low = SIZE_MAX, high = 0;
+	for (int i = 0; i < sfd->damage.ndamage_intvs; i++) {
+		struct ext_interval e = sfd->damage.damage[i];
+		struct interval first = ext_interval_row(e, 0, bits);
+		struct interval last = ext_interval_row(e, e.rep - 1, bits);
+		low = minu(low, (size_t)first.start);
+		high = maxu(high, (size_t)last.end);
+	}
+	*row_start = (uint32_t)minu(low / tx_stride, *row_end);
+	*row_end = (uint32_t)minu(
+			(high + tx_stride - 1) / tx_stride, *row_end);
+}
+
+/* Run queued tasks on the main thread until no worker thread is applying
+ * an update to `sfd`, or computing a diff of it */
+static void wait_for_shadow_tasks(
+		struct thread_pool *threads, struct shadow_fd *sfd)
+{
+	while (atomic_load_explicit(&sfd->refcount.incoming,
+				memory_order_acquire) > 0 ||
+			(sfd->refcount.compute &&
+					atomic_load(&threads->tasks_in_progress) >
+							0)) {
+		bool is_done;
+		struct task_data task;
+		if (request_work_task(threads, &task, &is_done)) {
+			run_task(&task, &threads->threads[0]);
+			finish_work_task(threads, &task);
+			notify_task_done(threads, task.type);
+		} else {
+			sched_yield();
+		}
+	}
+}
+
 void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 		struct transfer_queue *transfers, bool use_old_dmavid_req)
 {
@@ -1194,6 +2482,9 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 		}
 		// Clear dirty state
 		sfd->is_dirty = false;
+		/* Updates applied asynchronously write into the mirror and
+		 * mapping which are about to be diffed */
+		wait_for_shadow_tasks(threads, sfd);
 		if (sfd->only_here) {
 			// increase space, to avoid overflow when
 			// writing this buffer along with padding
@@ -1253,12 +2544,25 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 			return;
 		}
 		if (!sfd->mem_local) {
-			sfd->mem_local = map_dmabuf(sfd->dmabuf_bo, false,
+			uint32_t row_start = 0;
+			uint32_t row_end = sfd->dmabuf_info.height;
+			if (!first) {
+				get_damaged_rows(threads, sfd, &row_start,
+						&row_end);
+			}
+			if (row_start >= row_end) {
+				/* Nothing was damaged */
+				reset_damage(&sfd->damage);
+				return;
+			}
+			sfd->mem_local = map_dmabuf_rows(sfd->dmabuf_bo,
+					row_start, row_end, false,
 					&sfd->dmabuf_map_handle,
 					&sfd->dmabuf_map_stride);
 			if (!sfd->mem_local) {
 				return;
 			}
+			sfd->dmabuf_map_row = row_start;
 		}
 		if (first) {
 			size_t alignment = 1u << threads->diff_alignment_bits;
@@ -1276,9 +2580,9 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 			sfd->remote_bufsize = 0;
 			queue_fill_transfers(threads, sfd, transfers);
 			sfd->remote_bufsize = sfd->buffer_size;
+			/* The fill covers any damage made so far */
+			reset_damage(&sfd->damage);
 		} else {
-			// TODO: detailed damage tracking
-			damage_everything(&sfd->damage);
 			queue_diff_transfers(threads, sfd, transfers);
 		}
 		/* Unmapping will be handled by finish_update() */
@@ -1407,7 +2711,22 @@ static void increase_buffer_sizes(struct shadow_fd *sfd,
 		return;
 	}
 	/* if resize happens before any transfers, mirror may still be zero */
-	if (sfd->mem_mirror) {
+	if (sfd->mem_mirror && sfd->mirror_shared) {
+		/* Transfers may still point into the old mirror */
+		size_t alignment = 1u << threads->diff_alignment_bits;
+		void *handle = NULL;
+		char *new_mirror = zeroed_aligned_alloc(
+				alignz(sfd->buffer_size, alignment), alignment,
+				&handle);
+		if (!new_mirror) {
+			wp_error("Failed to reallocate mirror");
+			return;
+		}
+		memcpy(new_mirror, sfd->mem_mirror, old_size);
+		free_mirror(sfd);
+		sfd->mem_mirror = new_mirror;
+		sfd->mem_mirror_handle = handle;
+	} else if (sfd->mem_mirror) {
 		// todo: handle allocation failures
 		size_t alignment = 1u << threads->diff_alignment_bits;
 		void *new_mirror = zeroed_aligned_realloc(
@@ -1430,11 +2749,13 @@ static void pipe_close_write(struct shadow_fd *sfd)
 		 */
 		shutdown(sfd->pipe.fd, SHUT_WR);
 	} else {
+		unwatch_pipe(sfd);
 		checked_close(sfd->pipe.fd);
 		if (sfd->fd_local == sfd->pipe.fd) {
 			sfd->fd_local = -1;
 		}
 		sfd->pipe.fd = -1;
+		reindex_shadow_fds(sfd);
 	}
 	sfd->pipe.can_write = false;
 
@@ -1450,11 +2771,13 @@ static void pipe_close_read(struct shadow_fd *sfd)
 		// TODO: check return value, can legitimately fail with ENOBUFS
 		shutdown(sfd->pipe.fd, SHUT_RD);
 	} else {
+		unwatch_pipe(sfd);
 		checked_close(sfd->pipe.fd);
 		if (sfd->fd_local == sfd->pipe.fd) {
 			sfd->fd_local = -1;
 		}
 		sfd->pipe.fd = -1;
+		reindex_shadow_fds(sfd);
 	}
 	sfd->pipe.can_read = false;
 }
@@ -1475,13 +2798,11 @@ static int open_sfd(struct fd_translation_map *map, struct shadow_fd **sfd_ptr,
 				remote_id);
 		return ERR_FATAL;
 	}
-	sfd->link.l_prev = &map->link;
-	sfd->link.l_next = map->link.l_next;
-	sfd->link.l_prev->l_next = &sfd->link;
-	sfd->link.l_next->l_prev = &sfd->link;
-
 	sfd->remote_id = remote_id;
 	sfd->fd_local = -1;
+	sfd->pipe.fd = -1;
+	sfd->pipe.watched_fd = -1;
+	link_shadow(map, sfd);
 	sfd->is_dirty = false;
 	/* a received file descriptor is up to date by default */
 	reset_damage(&sfd->damage);
@@ -1507,31 +2828,267 @@ static int check_message_min_size(
 	return 0;
 }
 
-static int check_sfd_type_2(struct shadow_fd *sfd, int remote_id,
-		enum wmsg_type mtype, enum fdcat ftype1, enum fdcat ftype2)
-{
-	if (!sfd) {
-		wp_error("shadow structure for RID=%d was not available",
-				remote_id);
-		return ERR_FATAL;
-	}
-	if (sfd->type != ftype1 && sfd->type != ftype2) {
-		wp_error("Trying to apply %s to RID=%d which has incompatible type=%s",
-				wmsg_type_to_str(mtype), remote_id,
-				fdcat_to_str(sfd->type));
-		return ERR_FATAL;
-	}
-	return 0;
-}
-static int check_sfd_type(struct shadow_fd *sfd, int remote_id,
-		enum wmsg_type mtype, enum fdcat ftype)
+static int check_sfd_type_2(struct shadow_fd *sfd, int remote_id,
+		enum wmsg_type mtype, enum fdcat ftype1, enum fdcat ftype2)
+{
+	if (!sfd) {
+		wp_error("shadow structure for RID=%d was not available",
+				remote_id);
+		return ERR_FATAL;
+	}
+	if (sfd->type != ftype1 && sfd->type != ftype2) {
+		wp_error("Trying to apply %s to RID=%d which has incompatible type=%s",
+				wmsg_type_to_str(mtype), remote_id,
+				fdcat_to_str(sfd->type));
+		return ERR_FATAL;
+	}
+	return 0;
+}
+static int check_sfd_type(struct shadow_fd *sfd, int remote_id,
+		enum wmsg_type mtype, enum fdcat ftype)
+{
+	return check_sfd_type_2(sfd, remote_id, mtype, ftype, ftype);
+}
+
+/* Decompress (unless it is raw) and apply a fill message. Compressed data is
+ * decompressed directly into the mirror, using the compression context of the
+ * given thread, and then copied to the buffer. The range is checked first, but
+ * if decompression fails partway, the mirror has already been changed and no
+ * longer matches the other side, so the failure is fatal. */
+static int apply_buffer_fill(struct thread_pool *threads,
+		struct thread_data *local, struct shadow_fd *sfd,
+		enum wmsg_type type, const struct bytebuf *msg)
+{
+	const struct wmsg_buffer_fill *header =
+			(const struct wmsg_buffer_fill *)msg->data;
+
+	if (header->start > header->end || header->end > sfd->buffer_size) {
+		wp_error("Transfer range [%" PRIu32 ", %" PRIu32
+			 ") overflows buffer of size %zu",
+				header->start, header->end, sfd->buffer_size);
+		return ERR_FATAL;
+	}
+	int bpp = 0;
+	if (sfd->type == FDC_DMABUF) {
+		bpp = get_shm_bytes_per_pixel(sfd->dmabuf_info.format);
+		if (bpp == -1) {
+			wp_error("Skipping update of RID=%d, non-RGBA/monoplane fmt %x",
+					sfd->remote_id,
+					sfd->dmabuf_info.format);
+			return 0;
+		}
+	}
+
+	size_t fill_size = header->end - header->start;
+	char *mirror_dst = sfd->mem_mirror + header->start;
+	const char *act_buffer = NULL;
+	size_t act_size = 0;
+	if (type == WMSG_BUFFER_FILL_RAW) {
+		act_buffer = msg->data + sizeof(struct wmsg_buffer_fill);
+		act_size = msg->size - sizeof(struct wmsg_buffer_fill);
+	} else {
+		uncompress_buffer(threads, &local->comp_ctx,
+				msg->size - sizeof(struct wmsg_buffer_fill),
+				msg->data + sizeof(struct wmsg_buffer_fill),
+				fill_size, mirror_dst, &act_size, &act_buffer);
+	}
+	if (act_size != fill_size) {
+		/* The mirror may already be partly overwritten */
+		wp_error("Transfer size mismatch %zu %zu", act_size, fill_size);
+		return ERR_FATAL;
+	}
+	/* Without compression, the data is still in the message */
+	if (act_buffer != mirror_dst) {
+		memcpy(mirror_dst, act_buffer, fill_size);
+	}
+
+	if (sfd->type == FDC_DMABUF) {
+		void *handle = NULL;
+		uint32_t map_stride = 0;
+		char *mem_local = map_dmabuf(
+				sfd->dmabuf_bo, true, &handle, &map_stride);
+		if (!mem_local) {
+			wp_error("Failed to apply fill to RID=%d, fd not mapped",
+					sfd->remote_id);
+			return 0;
+		}
+		uint32_t in_stride = sfd->dmabuf_info.strides[0];
+		if (map_stride == in_stride) {
+			memcpy(mem_local + header->start, mirror_dst,
+					fill_size);
+		} else {
+			/* stride changing transfer */
+			uint32_t row_length =
+					(uint32_t)bpp * sfd->dmabuf_info.width;
+
+			uint32_t copy_size = (uint32_t)minu(row_length,
+					minu(map_stride, in_stride));
+
+			stride_shifted_copy(mem_local, sfd->mem_mirror,
+					header->start, fill_size, copy_size,
+					in_stride, map_stride);
+		}
+
+		if (unmap_dmabuf(sfd->dmabuf_bo, handle) == -1) {
+			return 0;
+		}
+	} else {
+		memcpy(sfd->mem_local + header->start, mirror_dst, fill_size);
+	}
+	return 0;
+}
+
+/* Decompress (unless it is raw) and apply a diff message (with or without a
+ * prefix), using the temporary buffer and compression context of the given
+ * thread. */
+static int apply_buffer_diff(struct thread_pool *threads,
+		struct thread_data *local, struct shadow_fd *sfd,
+		enum wmsg_type type, const struct bytebuf *msg)
+{
+	const struct wmsg_buffer_diff *header =
+			(const struct wmsg_buffer_diff *)msg->data;
+	size_t header_size = sizeof(struct wmsg_buffer_diff);
+	if (type == WMSG_BUFFER_PREFIX_DIFF) {
+		const struct wmsg_buffer_prefix_diff *pheader =
+				(const struct wmsg_buffer_prefix_diff *)
+						msg->data;
+		header_size = sizeof(struct wmsg_buffer_prefix_diff);
+		if (pheader->prefix_start > pheader->prefix_end ||
+				pheader->prefix_end > sfd->buffer_size) {
+			wp_error("Invalid prefix range [%" PRIu32 ",%" PRIu32
+				 ") for buffer of size %zu",
+					pheader->prefix_start,
+					pheader->prefix_end, sfd->buffer_size);
+			return ERR_FATAL;
+		}
+#ifdef HAS_ZSTD_ADVANCED
+		if (threads->compression != COMP_ZSTD) {
+			wp_error("Received diff with prefix, but compression is not zstd");
+			return ERR_FATAL;
+		}
+		/* The mirror still holds the contents that the sender used
+		 * as the prefix; it is used only for the next frame */
+		ZSTD_DCtx_refPrefix(local->comp_ctx.zstd_dcontext,
+				sfd->mem_mirror + pheader->prefix_start,
+				pheader->prefix_end - pheader->prefix_start);
+#else
+		wp_error("Received diff with prefix, which this copy of Waypipe cannot decompress");
+		return ERR_FATAL;
+#endif
+	}
+
+	const char *act_buffer = NULL;
+	size_t act_size = 0;
+	if (type == WMSG_BUFFER_DIFF_RAW) {
+		act_buffer = msg->data + header_size;
+		act_size = msg->size - header_size;
+	} else {
+		if (buf_ensure_size((int)(header->diff_size +
+						    header->ntrailing),
+				    1, &local->tmp_size,
+				    &local->tmp_buf) == -1) {
+			wp_error("Failed to expand temporary decompression buffer, dropping update");
+			return 0;
+		}
+		uncompress_buffer(threads, &local->comp_ctx,
+				msg->size - header_size,
+				msg->data + header_size,
+				header->diff_size + header->ntrailing,
+				local->tmp_buf, &act_size, &act_buffer);
+	}
+
+	// `memsize+8*remote_nthreads` is the worst-case diff
+	// expansion
+	if (act_size != header->diff_size + header->ntrailing) {
+		wp_error("Transfer size mismatch %zu %u", act_size,
+				header->diff_size + header->ntrailing);
+		return ERR_FATAL;
+	}
+
+	if (sfd->type == FDC_DMABUF) {
+		int bpp = get_shm_bytes_per_pixel(sfd->dmabuf_info.format);
+		if (bpp == -1) {
+			wp_error("Skipping update of RID=%d, non-RGBA/monoplane fmt %x",
+					sfd->remote_id,
+					sfd->dmabuf_info.format);
+			return 0;
+		}
+
+		void *handle = NULL;
+		uint32_t map_stride = 0;
+		char *mem_local = map_dmabuf(
+				sfd->dmabuf_bo, true, &handle, &map_stride);
+		if (!mem_local) {
+			wp_error("Failed to apply diff to RID=%d, fd not mapped",
+					sfd->remote_id);
+			return 0;
+		}
+		uint32_t in_stride = sfd->dmabuf_info.strides[0];
+		uint32_t row_length = (uint32_t)bpp * sfd->dmabuf_info.width;
+		uint32_t copy_size = (uint32_t)minu(
+				row_length, minu(map_stride, in_stride));
+
+		(void)in_stride;
+		size_t nblocks = sfd->buffer_size / sizeof(uint32_t);
+		size_t ndiffblocks = header->diff_size / sizeof(uint32_t);
+		uint32_t *diff_blocks = (uint32_t *)act_buffer;
+		for (size_t i = 0; i < ndiffblocks;) {
+			size_t nfrom = (size_t)diff_blocks[i];
+			size_t nto = (size_t)diff_blocks[i + 1];
+			size_t span = nto - nfrom;
+			if (nto > nblocks || nfrom >= nto ||
+					i + (nto - nfrom) >= ndiffblocks) {
+				wp_error("Invalid copy range [%zu,%zu) > %zu=nblocks or [%zu,%zu) > %zu=ndiffblocks",
+						nfrom, nto, nblocks, i + 1,
+						i + 1 + span, ndiffblocks);
+				break;
+			}
+			memcpy(sfd->mem_mirror + sizeof(uint32_t) * nfrom,
+					diff_blocks + i + 2,
+					sizeof(uint32_t) * span);
+			stride_shifted_copy(mem_local,
+					(char *)((diff_blocks + i + 2) - nfrom),
+					sizeof(uint32_t) * nfrom,
+					sizeof(uint32_t) * span, copy_size,
+					in_stride, map_stride);
+			i += span + 2;
+		}
+		if (header->ntrailing > 0) {
+			size_t offset = sfd->buffer_size - header->ntrailing;
+			memcpy(sfd->mem_mirror + offset,
+					act_buffer + header->diff_size,
+					header->ntrailing);
+			stride_shifted_copy(mem_local,
+					(act_buffer + header->diff_size) -
+							offset,
+					offset, header->ntrailing, copy_size,
+					in_stride, map_stride);
+		}
+
+		if (unmap_dmabuf(sfd->dmabuf_bo, handle) == -1) {
+			return 0;
+		}
+	} else {
+		DTRACE_PROBE2(waypipe, apply_diff_enter, sfd->buffer_size,
+				header->diff_size);
+		apply_diff(sfd->buffer_size, sfd->mem_mirror, sfd->mem_local,
+				header->diff_size, header->ntrailing,
+				act_buffer);
+		DTRACE_PROBE(waypipe, apply_diff_exit);
+	}
+
+	return 0;
+}
+
+/* Thread local data for the thread that applies updates synchronously */
+static struct thread_data *incoming_thread_local(struct thread_pool *pool)
 {
-	return check_sfd_type_2(sfd, remote_id, mtype, ftype, ftype);
+	return pool->incoming_local ? pool->incoming_local : &pool->threads[0];
 }
 
-int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
-		struct render_data *render, enum wmsg_type type, int remote_id,
-		const struct bytebuf *msg)
+static int apply_update_to_sfd(struct fd_translation_map *map,
+		struct thread_pool *threads, struct render_data *render,
+		enum wmsg_type type, int remote_id, const struct bytebuf *msg)
 {
 	struct shadow_fd *sfd = get_shadow_for_rid(map, remote_id);
 	int ret = 0;
@@ -1881,7 +3438,8 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		sfd->remote_bufsize = sfd->buffer_size;
 		return 0;
 	}
-	case WMSG_BUFFER_FILL: {
+	case WMSG_BUFFER_FILL:
+	case WMSG_BUFFER_FILL_RAW: {
 		if ((ret = check_message_min_size(type, msg,
 				     sizeof(struct wmsg_buffer_fill))) < 0) {
 			return ret;
@@ -1896,95 +3454,18 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 			return 0;
 		}
 
-		const struct wmsg_buffer_fill *header =
-				(const struct wmsg_buffer_fill *)msg->data;
-
-		size_t uncomp_size = header->end - header->start;
-		struct thread_data *local = &threads->threads[0];
-		if (buf_ensure_size((int)uncomp_size, 1, &local->tmp_size,
-				    &local->tmp_buf) == -1) {
-			wp_error("Failed to expand temporary decompression buffer, dropping update");
-			return 0;
-		}
-
-		const char *act_buffer = NULL;
-		size_t act_size = 0;
-		uncompress_buffer(threads, &threads->threads[0].comp_ctx,
-				msg->size - sizeof(struct wmsg_buffer_fill),
-				msg->data + sizeof(struct wmsg_buffer_fill),
-				uncomp_size, local->tmp_buf, &act_size,
-				&act_buffer);
-
-		// `memsize+8*remote_nthreads` is the worst-case diff
-		// expansion
-		if (header->end > sfd->buffer_size) {
-			wp_error("Transfer end overflow %" PRIu32 " > %zu",
-					header->end, sfd->buffer_size);
-			return ERR_FATAL;
-		}
-		if (act_size != header->end - header->start) {
-			wp_error("Transfer size mismatch %zu %" PRIu32,
-					act_size, header->end - header->start);
-			return ERR_FATAL;
-		}
-
-		if (sfd->type == FDC_DMABUF) {
-			int bpp = get_shm_bytes_per_pixel(
-					sfd->dmabuf_info.format);
-			if (bpp == -1) {
-				wp_error("Skipping update of RID=%d, non-RGBA/monoplane fmt %x",
-						sfd->remote_id,
-						sfd->dmabuf_info.format);
-				return 0;
-			}
-
-			memcpy(sfd->mem_mirror + header->start, act_buffer,
-					header->end - header->start);
-
-			void *handle = NULL;
-			uint32_t map_stride = 0;
-			char *mem_local = map_dmabuf(sfd->dmabuf_bo, true,
-					&handle, &map_stride);
-			if (!mem_local) {
-				wp_error("Failed to apply fill to RID=%d, fd not mapped",
-						sfd->remote_id);
-				return 0;
-			}
-			uint32_t in_stride = sfd->dmabuf_info.strides[0];
-			if (map_stride == in_stride) {
-				memcpy(mem_local + header->start,
-						sfd->mem_mirror + header->start,
-						header->end - header->start);
-			} else {
-				/* stride changing transfer */
-				uint32_t row_length = (uint32_t)bpp *
-						      sfd->dmabuf_info.width;
-
-				uint32_t copy_size = (uint32_t)minu(row_length,
-						minu(map_stride, in_stride));
-
-				stride_shifted_copy(mem_local,
-						act_buffer - header->start,
-						header->start,
-						header->end - header->start,
-						copy_size, in_stride,
-						map_stride);
-			}
-
-			if (unmap_dmabuf(sfd->dmabuf_bo, handle) == -1) {
-				return 0;
-			}
-		} else {
-			memcpy(sfd->mem_mirror + header->start, act_buffer,
-					header->end - header->start);
-			memcpy(sfd->mem_local + header->start, act_buffer,
-					header->end - header->start);
-		}
-		return 0;
+		return apply_buffer_fill(threads,
+				incoming_thread_local(threads), sfd, type,
+				msg);
 	}
-	case WMSG_BUFFER_DIFF: {
-		if ((ret = check_message_min_size(type, msg,
-				     sizeof(struct wmsg_buffer_diff))) < 0) {
+	case WMSG_BUFFER_DIFF:
+	case WMSG_BUFFER_DIFF_RAW:
+	case WMSG_BUFFER_PREFIX_DIFF: {
+		size_t min_size = sizeof(struct wmsg_buffer_diff);
+		if (type == WMSG_BUFFER_PREFIX_DIFF) {
+			min_size = sizeof(struct wmsg_buffer_prefix_diff);
+		}
+		if ((ret = check_message_min_size(type, msg, min_size)) < 0) {
 			return ret;
 		}
 		if ((ret = check_sfd_type_2(sfd, remote_id, type, FDC_FILE,
@@ -1996,116 +3477,9 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 					remote_id);
 			return 0;
 		}
-		const struct wmsg_buffer_diff *header =
-				(const struct wmsg_buffer_diff *)msg->data;
-
-		struct thread_data *local = &threads->threads[0];
-		if (buf_ensure_size((int)(header->diff_size +
-						    header->ntrailing),
-				    1, &local->tmp_size,
-				    &local->tmp_buf) == -1) {
-			wp_error("Failed to expand temporary decompression buffer, dropping update");
-			return 0;
-		}
-
-		const char *act_buffer = NULL;
-		size_t act_size = 0;
-		uncompress_buffer(threads, &threads->threads[0].comp_ctx,
-				msg->size - sizeof(struct wmsg_buffer_diff),
-				msg->data + sizeof(struct wmsg_buffer_diff),
-				header->diff_size + header->ntrailing,
-				local->tmp_buf, &act_size, &act_buffer);
-
-		// `memsize+8*remote_nthreads` is the worst-case diff
-		// expansion
-		if (act_size != header->diff_size + header->ntrailing) {
-			wp_error("Transfer size mismatch %zu %u", act_size,
-					header->diff_size + header->ntrailing);
-			return ERR_FATAL;
-		}
-
-		if (sfd->type == FDC_DMABUF) {
-			int bpp = get_shm_bytes_per_pixel(
-					sfd->dmabuf_info.format);
-			if (bpp == -1) {
-				wp_error("Skipping update of RID=%d, non-RGBA/monoplane fmt %x",
-						sfd->remote_id,
-						sfd->dmabuf_info.format);
-				return 0;
-			}
-
-			void *handle = NULL;
-			uint32_t map_stride = 0;
-			char *mem_local = map_dmabuf(sfd->dmabuf_bo, true,
-					&handle, &map_stride);
-			if (!mem_local) {
-				wp_error("Failed to apply diff to RID=%d, fd not mapped",
-						sfd->remote_id);
-				return 0;
-			}
-			uint32_t in_stride = sfd->dmabuf_info.strides[0];
-			uint32_t row_length =
-					(uint32_t)bpp * sfd->dmabuf_info.width;
-			uint32_t copy_size = (uint32_t)minu(row_length,
-					minu(map_stride, in_stride));
-
-			(void)in_stride;
-			size_t nblocks = sfd->buffer_size / sizeof(uint32_t);
-			size_t ndiffblocks =
-					header->diff_size / sizeof(uint32_t);
-			uint32_t *diff_blocks = (uint32_t *)act_buffer;
-			for (size_t i = 0; i < ndiffblocks;) {
-				size_t nfrom = (size_t)diff_blocks[i];
-				size_t nto = (size_t)diff_blocks[i + 1];
-				size_t span = nto - nfrom;
-				if (nto > nblocks || nfrom >= nto ||
-						i + (nto - nfrom) >=
-								ndiffblocks) {
-					wp_error("Invalid copy range [%zu,%zu) > %zu=nblocks or [%zu,%zu) > %zu=ndiffblocks",
-							nfrom, nto, nblocks,
-							i + 1, i + 1 + span,
-							ndiffblocks);
-					break;
-				}
-				memcpy(sfd->mem_mirror + sizeof(uint32_t) * nfrom,
-						diff_blocks + i + 2,
-						sizeof(uint32_t) * span);
-				stride_shifted_copy(mem_local,
-						(char *)((diff_blocks + i + 2) -
-								nfrom),
-						sizeof(uint32_t) * nfrom,
-						sizeof(uint32_t) * span,
-						copy_size, in_stride,
-						map_stride);
-				i += span + 2;
-			}
-			if (header->ntrailing > 0) {
-				size_t offset = sfd->buffer_size -
-						header->ntrailing;
-				memcpy(sfd->mem_mirror + offset,
-						act_buffer + header->diff_size,
-						header->ntrailing);
-				stride_shifted_copy(mem_local,
-						(act_buffer + header->diff_size) -
-								offset,
-						offset, header->ntrailing,
-						copy_size, in_stride,
-						map_stride);
-			}
-
-			if (unmap_dmabuf(sfd->dmabuf_bo, handle) == -1) {
-				return 0;
-			}
-		} else {
-			DTRACE_PROBE2(waypipe, apply_diff_enter,
-					sfd->buffer_size, header->diff_size);
-			apply_diff(sfd->buffer_size, sfd->mem_mirror,
-					sfd->mem_local, header->diff_size,
-					header->ntrailing, act_buffer);
-			DTRACE_PROBE(waypipe, apply_diff_exit);
-		}
-
-		return 0;
+		return apply_buffer_diff(threads,
+				incoming_thread_local(threads), sfd, type,
+				msg);
 	}
 	case WMSG_PIPE_TRANSFER: {
 		if ((ret = check_sfd_type(sfd, remote_id, type, FDC_PIPE)) <
@@ -2191,6 +3565,117 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 	};
 	/* all returns should happen inside switch, so none here */
 }
+int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
+		struct render_data *render, enum wmsg_type type, int remote_id,
+		const struct bytebuf *msg)
+{
+	int ret = apply_update_to_sfd(
+			map, threads, render, type, remote_id, msg);
+	/* Creating a shadow structure, or closing a pipe, changes the local
+	 * file descriptors it should be found by */
+	struct shadow_fd *sfd = get_shadow_for_rid(map, remote_id);
+	if (sfd) {
+		reindex_shadow_fds(sfd);
+		mark_shadow_active(sfd);
+	}
+	return ret;
+}
+
+bool update_is_async(struct fd_translation_map *map, enum wmsg_type type,
+		int remote_id)
+{
+	if (type != WMSG_BUFFER_FILL && type != WMSG_BUFFER_DIFF &&
+			type != WMSG_BUFFER_PREFIX_DIFF &&
+			type != WMSG_BUFFER_FILL_RAW &&
+			type != WMSG_BUFFER_DIFF_RAW) {
+		return false;
+	}
+	struct shadow_fd *sfd = get_shadow_for_rid(map, remote_id);
+	return sfd && sfd->type == FDC_FILE && !sfd->file_readonly &&
+	       sfd->mem_local && sfd->mem_mirror;
+}
+
+int apply_update_async(struct fd_translation_map *map,
+		struct thread_pool *threads, enum wmsg_type type, int remote_id,
+		const struct bytebuf *msg)
+{
+	struct shadow_fd *sfd = get_shadow_for_rid(map, remote_id);
+	int ret = 0;
+	size_t min_size = sizeof(struct wmsg_buffer_diff);
+	if (type == WMSG_BUFFER_FILL || type == WMSG_BUFFER_FILL_RAW) {
+		min_size = sizeof(struct wmsg_buffer_fill);
+	} else if (type == WMSG_BUFFER_PREFIX_DIFF) {
+		min_size = sizeof(struct wmsg_buffer_prefix_diff);
+	}
+	if ((ret = check_message_min_size(type, msg, min_size)) < 0) {
+		return ret;
+	}
+	if ((ret = check_sfd_type(sfd, remote_id, type, FDC_FILE)) < 0) {
+		return ret;
+	}
+	if (buf_ensure_size(threads->stack_count + 1, sizeof(struct task_data),
+			    &threads->stack_size,
+			    (void **)&threads->stack) == -1) {
+		wp_error("Allocation failed, applying update on main thread");
+		return apply_update(map, threads, NULL, type, remote_id, msg);
+	}
+
+	struct task_data task;
+	memset(&task, 0, sizeof(task));
+	task.type = TASK_APPLY_UPDATE;
+	task.sfd = sfd;
+	task.update_type = type;
+	task.update = *msg;
+	threads->stack[threads->stack_count++] = task;
+	atomic_fetch_add(&sfd->refcount.incoming, 1);
+	atomic_fetch_add(&threads->incoming_in_progress, 1);
+	mark_shadow_active(sfd);
+
+	publish_work_tasks(threads);
+	return 0;
+}
+
+int apply_zstd_dictionary(
+		struct thread_pool *threads, const struct bytebuf *msg)
+{
+	int ret;
+	if ((ret = check_message_min_size(WMSG_ZSTD_DICTIONARY, msg,
+			     sizeof(struct wmsg_zstd_dictionary))) < 0) {
+		return ret;
+	}
+#ifdef HAS_ZSTD_ADVANCED
+	if (threads->compression != COMP_ZSTD) {
+		wp_error("Received zstd dictionary, but compression is not zstd");
+		return ERR_FATAL;
+	}
+	const struct wmsg_zstd_dictionary *header =
+			(const struct wmsg_zstd_dictionary *)msg->data;
+	const char *data = msg->data + sizeof(struct wmsg_zstd_dictionary);
+	size_t size = msg->size - sizeof(struct wmsg_zstd_dictionary);
+	ZSTD_DDict *ddict = ZSTD_createDDict(data, size);
+	if (!ddict) {
+		wp_error("Failed to create zstd dictionary of %zu bytes", size);
+		return ERR_NOMEM;
+	}
+	if (ZSTD_getDictID_fromDDict(ddict) != header->dict_id) {
+		wp_error("Received zstd dictionary has ID %u, not %u",
+				ZSTD_getDictID_fromDDict(ddict),
+				header->dict_id);
+		ZSTD_freeDDict(ddict);
+		return ERR_FATAL;
+	}
+	wp_debug("Received zstd dictionary %u, of %zu bytes", header->dict_id,
+			size);
+	ZSTD_freeDDict(threads->dict.ddict);
+	threads->dict.ddict = ddict;
+	threads->dict.ddict_id = header->dict_id;
+	return 0;
+#else
+	(void)threads;
+	wp_error("Received zstd dictionary, which this copy of Waypipe cannot use");
+	return ERR_FATAL;
+#endif
+}
 
 bool shadow_decref_protocol(struct shadow_fd *sfd)
 {
@@ -2208,6 +3693,7 @@ bool shadow_decref_transfer(struct shadow_fd *sfd)
 		if (sfd->pipe.fd != sfd->fd_local) {
 			checked_close(sfd->fd_local);
 			sfd->fd_local = sfd->pipe.fd;
+			reindex_shadow_fds(sfd);
 		}
 	}
 	return destroy_shadow_if_unreferenced(sfd);
@@ -2282,13 +3768,9 @@ int fill_with_pipes(const struct fd_translation_map *map, struct pollfd *pfds,
 static struct shadow_fd *get_shadow_for_pipe_fd(
 		struct fd_translation_map *map, int pipefd)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->type == FDC_PIPE && cur->pipe.fd == pipefd) {
-			return cur;
-		}
+	struct shadow_fd *sfd = shadow_index_find(&map->fd_index, pipefd);
+	if (sfd && sfd->type == FDC_PIPE && sfd->pipe.fd == pipefd) {
+		return sfd;
 	}
 	return NULL;
 }
@@ -2304,22 +3786,41 @@ void mark_pipe_object_statuses(
 					lfd);
 			continue;
 		}
-		if (pfds[i].revents & POLLIN || pfds[i].revents & POLLHUP) {
-			/* In */
-			sfd->pipe.readable = true;
-		}
-		if (pfds[i].revents & POLLOUT) {
-			sfd->pipe.writable = true;
-		}
+		mark_pipe_object_status(sfd, pfds[i].revents);
+	}
+}
+void mark_pipe_object_status(struct shadow_fd *sfd, int revents)
+{
+	if (revents & POLLIN || revents & POLLHUP) {
+		/* In */
+		sfd->pipe.readable = true;
+	}
+	if (revents & POLLOUT) {
+		sfd->pipe.writable = true;
+	}
+	mark_shadow_active(sfd);
+}
+void watch_active_pipes(struct fd_translation_map *map, bool check_read)
+{
+	if (map->epoll_fd == -1) {
+		return;
+	}
+	/* Pipes which are not on the work list are not readable, and so
+	 * do not depend on check_read */
+	map->epoll_check_read = check_read;
+	for (struct shadow_fd_link *lcur = map->work.l_next,
+				   *lnxt = lcur->l_next;
+			lcur != &map->work; lcur = lnxt, lnxt = lcur->l_next) {
+		watch_pipe(shadow_from_work_link(lcur));
 	}
 }
 
 void flush_writable_pipes(struct fd_translation_map *map)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
+	for (struct shadow_fd_link *lcur = map->work.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *sfd = (struct shadow_fd *)lcur;
+			lcur != &map->work; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *sfd = shadow_from_work_link(lcur);
 		if (sfd->type != FDC_PIPE || !sfd->pipe.writable ||
 				sfd->pipe.send.used <= 0) {
 			continue;
@@ -2365,19 +3866,19 @@ void flush_writable_pipes(struct fd_translation_map *map)
 		}
 	}
 	/* Destroy any new unreferenced objects */
-	for (struct shadow_fd_link *lcur = map->link.l_next,
+	for (struct shadow_fd_link *lcur = map->work.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+			lcur != &map->work; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = shadow_from_work_link(lcur);
 		destroy_shadow_if_unreferenced(cur);
 	}
 }
 void read_readable_pipes(struct fd_translation_map *map)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
+	for (struct shadow_fd_link *lcur = map->work.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *sfd = (struct shadow_fd *)lcur;
+			lcur != &map->work; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *sfd = shadow_from_work_link(lcur);
 		if (sfd->type != FDC_PIPE || !sfd->pipe.readable) {
 			continue;
 		}
@@ -2417,10 +3918,10 @@ void read_readable_pipes(struct fd_translation_map *map)
 	}
 
 	/* Destroy any new unreferenced objects */
-	for (struct shadow_fd_link *lcur = map->link.l_next,
+	for (struct shadow_fd_link *lcur = map->work.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+			lcur != &map->work; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = shadow_from_work_link(lcur);
 		destroy_shadow_if_unreferenced(cur);
 	}
 }
@@ -2445,46 +3946,238 @@ void extend_shm_shadow(struct thread_pool *threads, struct shadow_fd *sfd,
 		return;
 	}
 
+	/* Updates applied asynchronously write into the mapping and mirror
+	 * which are about to be replaced; as the program is read while the
+	 * last cycle's diffs are computed, those may still read them */
+	wait_for_shadow_tasks(threads, sfd);
 	increase_buffer_sizes(sfd, threads, new_size);
 
 	// leave `sfd->remote_bufsize` unchanged, and mark dirty
 	sfd->is_dirty = true;
+	mark_shadow_active(sfd);
+}
+
+static void worker_run_apply_update(
+		struct task_data *task, struct thread_data *local)
+{
+	struct shadow_fd *sfd = task->sfd;
+	int ret;
+	if (task->update_type == WMSG_BUFFER_FILL ||
+			task->update_type == WMSG_BUFFER_FILL_RAW) {
+		ret = apply_buffer_fill(local->pool, local, sfd,
+				task->update_type, &task->update);
+	} else {
+		ret = apply_buffer_diff(local->pool, local, sfd,
+				task->update_type, &task->update);
+	}
+	if (ret < 0) {
+		atomic_store(&local->pool->incoming_error, ret);
+	}
+	/* After this point, the main thread may destroy `sfd` */
+	atomic_fetch_sub_explicit(
+			&sfd->refcount.incoming, 1, memory_order_release);
+}
+
+#ifdef HAS_ZSTD_ADVANCED
+/* Train a dictionary, if enough samples were collected and no other worker
+ * thread has started to. Returns true if a dictionary was trained. */
+static bool worker_run_train_dict(struct thread_data *local)
+{
+	struct zstd_dict_state *dict = &local->pool->dict;
+	int expected = DICT_FULL;
+	if (!atomic_compare_exchange_strong(
+			    &dict->stage, &expected, DICT_TRAINING)) {
+		return false;
+	}
+	size_t ret = ZDICT_trainFromBuffer(dict->trained, ZSTD_DICT_CAPACITY,
+			dict->samples, dict->sample_sizes, dict->nsamples);
+	if (ZDICT_isError(ret)) {
+		wp_debug("Failed to train zstd dictionary from %u samples: %s",
+				dict->nsamples, ZDICT_getErrorName(ret));
+		dict->trained_size = 0;
+	} else {
+		dict->trained_size = ret;
+	}
+	atomic_store(&dict->stage, DICT_TRAINED);
+	return true;
+}
+#endif
+
+static bool is_compression_task(enum task_type type)
+{
+	return type == TASK_COMPRESS_BLOCK || type == TASK_COMPRESS_DIFF;
 }
 
 void run_task(struct task_data *task, struct thread_data *local)
 {
+	struct timespec t0, t1;
+	bool timed = is_compression_task(task->type);
+	if (timed) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+	}
+
 	if (task->type == TASK_COMPRESS_BLOCK) {
 		worker_run_compress_block(task, local);
 	} else if (task->type == TASK_COMPRESS_DIFF) {
 		worker_run_compress_diff(task, local);
+	} else if (task->type == TASK_APPLY_UPDATE) {
+		worker_run_apply_update(task, local);
 	} else {
 		wp_error("Unidentified task type");
 	}
+
+	if (timed) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		int64_t ns = (int64_t)(t1.tv_sec - t0.tv_sec) * 1000000000LL +
+			     (int64_t)(t1.tv_nsec - t0.tv_nsec);
+		if (ns > 0) {
+			atomic_fetch_add(&local->pool->compression_time,
+					(unsigned long long)ns);
+		}
+	}
+}
+
+/* Add a task to the queue; only the main thread may call this. Returns false
+ * if the queue is full. */
+static bool task_queue_push(
+		struct task_queue *queue, const struct task_data *task)
+{
+	uint32_t pos = queue->tail;
+	struct task_slot *slot = &queue->slots[pos & queue->mask];
+	if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos) {
+		return false;
+	}
+	slot->task = *task;
+	/* seq_cst, so that sleeping threads either see the new task, or
+	 * are seen by the main thread in `nsleeping` */
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_seq_cst);
+	queue->tail = pos + 1;
+	return true;
+}
+
+/* Take the oldest task from the queue; any thread may call this. */
+static bool task_queue_take(struct task_queue *queue, struct task_data *task)
+{
+	uint32_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	while (1) {
+		struct task_slot *slot = &queue->slots[pos & queue->mask];
+		uint32_t seq = atomic_load_explicit(
+				&slot->seq, memory_order_acquire);
+		int32_t delta = (int32_t)(seq - (pos + 1));
+		if (delta < 0) {
+			/* slot has not yet been filled */
+			return false;
+		} else if (delta > 0) {
+			/* another thread took the task at `pos` */
+			pos = atomic_load_explicit(
+					&queue->head, memory_order_relaxed);
+		} else if (atomic_compare_exchange_weak_explicit(&queue->head,
+					   &pos, pos + 1, memory_order_relaxed,
+					   memory_order_relaxed)) {
+			*task = slot->task;
+			atomic_store_explicit(&slot->seq, pos + queue->mask + 1,
+					memory_order_release);
+			return true;
+		}
+	}
+}
+
+static bool task_queue_empty(struct task_queue *queue)
+{
+	uint32_t pos = atomic_load(&queue->head);
+	uint32_t seq = atomic_load(&queue->slots[pos & queue->mask].seq);
+	return (int32_t)(seq - (pos + 1)) < 0;
+}
+
+/* Take a task from the thread's own queue, or else steal one from the
+ * queues of the other threads */
+static bool find_work_task(struct thread_pool *pool, int self,
+		struct task_data *task)
+{
+	for (int k = 0; k < pool->nthreads; k++) {
+		int i = (self + k) % pool->nthreads;
+		if (task_queue_take(&pool->threads[i].queue, task)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool any_work_task(struct thread_pool *pool)
+{
+	for (int i = 0; i < pool->nthreads; i++) {
+		if (!task_queue_empty(&pool->threads[i].queue)) {
+			return true;
+		}
+	}
+	/* Dictionary training is not a task, so that the main thread never
+	 * picks it up and that it does not delay sending data */
+	return atomic_load(&pool->dict.stage) == DICT_FULL;
+}
+
+/* Move as many tasks as possible from the main thread's stack onto the thread
+ * queues, distributing them round-robin, and wake any sleeping threads. Tasks
+ * are counted as in progress from when they are first queued on the stack. */
+static void publish_work_tasks(struct thread_pool *pool)
+{
+	int nstaged = pool->stack_count;
+	int nfull = 0;
+	while (pool->stack_count > 0 && nfull < pool->nthreads) {
+		struct task_queue *queue =
+				&pool->threads[pool->next_queue].queue;
+		pool->next_queue = (pool->next_queue + 1) % pool->nthreads;
+		if (task_queue_push(queue,
+				    &pool->stack[pool->stack_count - 1])) {
+			pool->stack_count--;
+			nfull = 0;
+		} else {
+			nfull++;
+		}
+	}
+
+	if (pool->stack_count < nstaged &&
+			atomic_load(&pool->nsleeping) > 0) {
+		pthread_mutex_lock(&pool->sleep_mutex);
+		pthread_cond_broadcast(&pool->sleep_cond);
+		pthread_mutex_unlock(&pool->sleep_mutex);
+	}
 }
 
 int start_parallel_work(struct thread_pool *pool,
 		struct thread_msg_recv_buf *recv_queue)
 {
-	pthread_mutex_lock(&pool->work_mutex);
-	if (recv_queue->zone_start != recv_queue->zone_end) {
-		wp_error("Some async messages not yet sent");
+	/* Each compression task produces at most one message, which may take
+	 * two slots when it borrows its data. The receive queue can only be
+	 * resized while no compression tasks are running */
+	int num_mt_tasks = 0;
+	for (int i = 0; i < pool->stack_count; i++) {
+		num_mt_tasks += is_compression_task(pool->stack[i].type);
 	}
-	recv_queue->zone_start = 0;
-	recv_queue->zone_end = 0;
-	int num_mt_tasks = pool->stack_count;
-	if (buf_ensure_size(num_mt_tasks, sizeof(struct iovec),
-			    &recv_queue->size,
-			    (void **)&recv_queue->data) == -1) {
-		wp_error("Failed to provide enough space for receive queue, skipping all work tasks");
-		num_mt_tasks = 0;
+	int in_progress = atomic_load(&pool->tasks_in_progress) - num_mt_tasks;
+	if (num_mt_tasks > 0 &&
+			(in_progress > 0 ||
+					transfer_async_ensure_size(recv_queue,
+							2 * num_mt_tasks) ==
+							-1)) {
+		/* The damage for these tasks has already been cleared, so
+		 * the remote buffers can no longer be kept up to date. The
+		 * tasks are removed so that no thread can publish them and
+		 * overflow the queue before the connection is closed. */
+		wp_error("Failed to provide enough space for receive queue");
+		int k = 0;
+		for (int i = 0; i < pool->stack_count; i++) {
+			if (!is_compression_task(pool->stack[i].type)) {
+				pool->stack[k++] = pool->stack[i];
+			}
+		}
+		pool->stack_count = k;
+		atomic_fetch_sub(&pool->tasks_in_progress, num_mt_tasks);
+		publish_work_tasks(pool);
+		return -1;
 	}
-	pool->do_work = num_mt_tasks > 0;
 
 	/* Start the work tasks here */
-	if (num_mt_tasks > 0) {
-		pthread_cond_broadcast(&pool->work_cond);
-	}
-	pthread_mutex_unlock(&pool->work_mutex);
+	publish_work_tasks(pool);
 
 	return num_mt_tasks;
 }
@@ -2492,23 +4185,48 @@ int start_parallel_work(struct thread_pool *pool,
 bool request_work_task(
 		struct thread_pool *pool, struct task_data *task, bool *is_done)
 {
-	pthread_mutex_lock(&pool->work_mutex);
-	*is_done = pool->stack_count == 0 && pool->tasks_in_progress == 0;
-	bool has_task = false;
-	if (pool->stack_count > 0 && pool->do_work) {
-		int i = pool->stack_count - 1;
-		if (pool->stack[i].type != TASK_STOP) {
-			*task = pool->stack[i];
-			has_task = true;
-			pool->stack_count--;
-			pool->tasks_in_progress++;
-			if (pool->stack_count <= 0) {
-				pool->do_work = false;
-			}
-		}
+	publish_work_tasks(pool);
+
+	*is_done = atomic_load_explicit(&pool->tasks_in_progress,
+				   memory_order_acquire) == 0;
+	if (find_work_task(pool, 0, task)) {
+		return true;
+	}
+	if (pool->stack_count > 0) {
+		/* All queues are full, so run a task directly */
+		*task = pool->stack[--pool->stack_count];
+		return true;
+	}
+	return false;
+}
+
+void finish_work_task(struct thread_pool *pool, const struct task_data *task)
+{
+	if (task->type == TASK_APPLY_UPDATE) {
+		atomic_fetch_sub_explicit(&pool->incoming_in_progress, 1,
+				memory_order_release);
+	} else {
+		atomic_fetch_sub_explicit(&pool->tasks_in_progress, 1,
+				memory_order_release);
+	}
+}
+
+void notify_task_done(struct thread_pool *pool, enum task_type type)
+{
+	int pipe_w = pool->selfpipe_w;
+	if (type == TASK_APPLY_UPDATE && pool->incoming_selfpipe_w != -1) {
+		pipe_w = pool->incoming_selfpipe_w;
+	}
+	uint8_t triv = 0;
+	if (write(pipe_w, &triv, 1) == -1) {
+		wp_error("Failed to write to self-pipe");
 	}
-	pthread_mutex_unlock(&pool->work_mutex);
-	return has_task;
+}
+
+bool incoming_work_done(struct thread_pool *pool)
+{
+	return atomic_load_explicit(&pool->incoming_in_progress,
+			       memory_order_acquire) == 0;
 }
 
 static void *worker_thread_main(void *arg)
@@ -2516,40 +4234,38 @@ static void *worker_thread_main(void *arg)
 	struct thread_data *data = arg;
 	struct thread_pool *pool = data->pool;
 
-	/* The loop is globally locked by default, and only unlocked in
-	 * pthread_cond_wait. Yes, there are fancier and faster schemes.
-	 */
-	pthread_mutex_lock(&pool->work_mutex);
-	while (1) {
-		while (!pool->do_work) {
-			pthread_cond_wait(&pool->work_cond, &pool->work_mutex);
-		}
-		if (pool->stack_count <= 0) {
-			pool->do_work = false;
+	while (!atomic_load(&pool->stop_threads)) {
+		struct task_data task;
+		if (find_work_task(pool, data->index, &task)) {
+			run_task(&task, data);
+			finish_work_task(pool, &task);
+			notify_task_done(pool, task.type);
 			continue;
 		}
-		/* Copy task, since the queue may be resized */
-		int i = pool->stack_count - 1;
-		struct task_data task = pool->stack[i];
-		if (task.type == TASK_STOP) {
-			break;
-		}
-		pool->tasks_in_progress++;
-		pool->stack_count--;
-		if (pool->stack_count <= 0) {
-			pool->do_work = false;
+#ifdef HAS_ZSTD_ADVANCED
+		if (worker_run_train_dict(data)) {
+			/* So the main thread adopts the dictionary */
+			uint8_t triv = 0;
+			if (write(pool->selfpipe_w, &triv, 1) == -1) {
+				wp_error("Failed to write to self-pipe");
+			}
+			continue;
 		}
-		pthread_mutex_unlock(&pool->work_mutex);
-		run_task(&task, data);
-		pthread_mutex_lock(&pool->work_mutex);
+#endif
 
-		uint8_t triv = 0;
-		pool->tasks_in_progress--;
-		if (write(pool->selfpipe_w, &triv, 1) == -1) {
-			wp_error("Failed to write to self-pipe");
-		}
+		/* Sleep until new tasks are published. Registering in
+		 * `nsleeping` before checking the queues ensures that the
+		 * main thread will wake this thread for any later task. */
+		pthread_mutex_lock(&pool->sleep_mutex);
+		atomic_fetch_add(&pool->nsleeping, 1);
+		while (!atomic_load(&pool->stop_threads) &&
+				!any_work_task(pool)) {
+			pthread_cond_wait(&pool->sleep_cond,
+					&pool->sleep_mutex);
+		}
+		atomic_fetch_sub(&pool->nsleeping, 1);
+		pthread_mutex_unlock(&pool->sleep_mutex);
 	}
-	pthread_mutex_unlock(&pool->work_mutex);
 
 	return NULL;
 }
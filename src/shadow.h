@@ -26,9 +26,12 @@
 #define WAYPIPE_SHADOW_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
 
 #include "dmabuf.h"
 #include "interval.h"
@@ -41,9 +44,13 @@ typedef VAGenericID VASurfaceID;
 typedef VAGenericID VABufferID;
 typedef struct ZSTD_CCtx_s ZSTD_CCtx;
 typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+typedef struct ZSTD_CDict_s ZSTD_CDict;
+typedef struct ZSTD_DDict_s ZSTD_DDict;
 
 struct comp_ctx {
 	void *lz4_extstate;
+	/* Whether lz4_extstate is large enough for the LZ4 HC routines */
+	bool lz4_extstate_hc;
 	ZSTD_CCtx *zstd_ccontext;
 	ZSTD_DCtx *zstd_dcontext;
 };
@@ -54,15 +61,101 @@ enum compression_mode {
 	COMP_ZSTD,
 };
 
+enum zstd_dict_stage {
+	/* Waiting until the next dictionary should be trained */
+	DICT_IDLE,
+	/* Worker threads are adding samples of diffs */
+	DICT_COLLECTING,
+	/* Enough samples have been collected; the next idle worker thread
+	 * will train the dictionary */
+	DICT_FULL,
+	/* A worker thread is training the dictionary */
+	DICT_TRAINING,
+	/* Training finished; `trained_size` is zero if it failed */
+	DICT_TRAINED,
+};
+
+/** State for the zstd dictionaries trained from and used for a connection */
+struct zstd_dict_state {
+	atomic_int stage;
+	/* Protects the samples while collecting; worker threads never wait
+	 * for it, and skip sampling if it is busy */
+	pthread_mutex_t sample_lock;
+	char *samples;
+	size_t samples_used;
+	size_t *sample_sizes;
+	unsigned nsamples;
+	/* Output of the training task */
+	char *trained;
+	size_t trained_size;
+	/* When the last training finished, from CLOCK_MONOTONIC */
+	bool has_trained;
+	struct timespec last_trained;
+
+	/* The dictionary used to compress outgoing data; the main thread
+	 * only replaces it while no compression tasks are running. It is
+	 * remade from `cdict_content` when the compression level changes. */
+	ZSTD_CDict *cdict;
+	char *cdict_content;
+	size_t cdict_size;
+	int cdict_level;
+	/* The dictionary last received, used to decompress incoming data;
+	 * the main thread only replaces it while no incoming tasks run */
+	ZSTD_DDict *ddict;
+	uint32_t ddict_id;
+};
+
 struct shadow_fd_link {
 	struct shadow_fd_link *l_prev, *l_next; /* Doubly linked list */
 };
 
+/** An entry of \ref shadow_index; empty iff sfd is NULL */
+struct shadow_index_slot {
+	int key;
+	struct shadow_fd *sfd;
+};
+/** An open addressed hash table, with linear probing, from integer keys to
+ * shadow structures */
+struct shadow_index {
+	struct shadow_index_slot *slots;
+	int size; /* zero, or a power of two */
+	int count;
+};
+
+/** A file descriptor translated to a shadow structure whose fd_local refers to
+ * the same file */
+struct fd_alias {
+	int fd;
+	struct shadow_fd *sfd;
+};
+
 struct fd_translation_map {
 	struct shadow_fd_link link; /* store in first position */
 
 	int max_local_id;
 	int local_sign;
+
+	/* Indices for the shadow structures in the list, keyed by remote_id,
+	 * and by local file descriptor (both fd_local and pipe.fd) */
+	struct shadow_index rid_index;
+	struct shadow_index fd_index;
+	/* Index of local FDC_FILE shadow structures, by a hash of the device
+	 * and inode of their file; entries must be checked against
+	 * shadow_fd::file_dev and file_ino */
+	struct shadow_index file_index;
+	/* Received file descriptors that were deduplicated to an existing
+	 * shadow structure; they are in fd_index until close_fd_aliases */
+	struct fd_alias *aliases;
+	int naliases, aliases_size;
+	/* If not -1, an epoll instance with which all pipes are registered,
+	 * with their shadow structures as data, and whether to check them for
+	 * readability. This replaces count_npipes and fill_with_pipes */
+	int epoll_fd;
+	bool epoll_check_read;
+	/* List (through shadow_fd::work_link) of the shadow structures which
+	 * may have updates to collect, pipe IO to do, or pending cleanup; the
+	 * others do not need to be visited by the main loop */
+	struct shadow_fd_link work;
 };
 
 /** Thread pool and associated global information */
@@ -73,29 +166,84 @@ struct thread_pool {
 	 * because most rapidly changing application buffers have similar
 	 * content and use the same settings */
 	enum compression_mode compression;
+	/* May be changed by the main thread while no compression tasks are
+	 * queued or running */
 	int compression_level;
+	/* Time in nanoseconds that all threads together have spent running
+	 * compression tasks, since the main thread last reset it */
+	atomic_ullong compression_time;
+	/* If true, and compression is zstd, send diffs compressed using the
+	 * previous contents of the damaged region of the buffer as a prefix */
+	bool zstd_prefix;
+	/* If true, and compression is zstd, periodically train a dictionary
+	 * from samples of diffs, send it to the other side, and use it to
+	 * compress later data */
+	bool zstd_dict;
+	struct zstd_dict_state dict;
+	/* If true, the other side can apply WMSG_BUFFER_FILL_RAW and
+	 * WMSG_BUFFER_DIFF_RAW, so data which does not compress is sent with
+	 * these instead. Otherwise, all data is compressed */
+	bool raw_blocks;
 
 	interval_diff_fn_t diff_func;
 	int diff_alignment_bits;
+	struct merge_policy merge_policy;
 
-	// Mutable state
-	pthread_mutex_t work_mutex;
-	pthread_cond_t work_cond;
-
-	bool do_work;
+	/* Tasks which the main thread has queued, but not yet made available
+	 * to the worker threads. Only the main thread may access these (or,
+	 * with setup_incoming_thread, the thread holding the state lock) */
 	int stack_count, stack_size;
 	struct task_data *stack;
-	// TODO: distinct queues for wayland->channel and channel->wayland,
-	// to make multithreaded decompression possible
-	int tasks_in_progress;
+	/* The thread queue to which the next published task will be given */
+	int next_queue;
+	/* Number of queued tasks which have not yet been completed, for
+	 * wayland->channel data (compression), and for channel->wayland data
+	 * (decompression and application of updates) */
+	atomic_int tasks_in_progress;
+	atomic_int incoming_in_progress;
+	/* Error code from the most recent failed incoming task, or 0 */
+	atomic_int incoming_error;
+	atomic_bool stop_threads;
+
+	/* Worker threads which find no task in any queue sleep on `sleep_cond`;
+	 * the lock is only ever taken when going to sleep or waking threads */
+	pthread_mutex_t sleep_mutex;
+	pthread_cond_t sleep_cond;
+	atomic_int nsleeping;
 
 	// to wake the main loop
 	int selfpipe_r, selfpipe_w;
+	/* If set up by setup_incoming_thread, the thread local data and wakeup
+	 * pipe for a second thread, which handles channel->wayland transfers
+	 * and waits on completions of TASK_APPLY_UPDATE; otherwise, NULL
+	 * and -1, and the main thread does both. */
+	struct thread_data *incoming_local;
+	int incoming_selfpipe_r, incoming_selfpipe_w;
+};
+
+struct task_slot;
+/** A bounded lock-free queue of tasks. Only the main thread adds tasks, while
+ * the thread owning the queue takes them, and other idle threads may steal
+ * them. Each slot has a sequence number indicating whether it is free or
+ * filled for a given position (see Vyukov's bounded MPMC queue.) */
+struct task_queue {
+	struct task_slot *slots;
+	uint32_t mask;
+	/* Position of the next task to be taken */
+	atomic_uint head;
+	/* Keep the positions for producer and consumers on separate cache
+	 * lines */
+	char padding[64];
+	/* Position of the next free slot; only the main thread uses this */
+	uint32_t tail;
 };
 
 struct thread_data {
 	pthread_t thread;
 	struct thread_pool *pool;
+	/* Tasks given to this thread; any thread may also steal from here */
+	struct task_queue queue;
+	int index;
 	/* Thread local data */
 	struct comp_ctx comp_ctx;
 
@@ -103,12 +251,15 @@ struct thread_data {
 	 * compression */
 	void *tmp_buf;
 	int tmp_size;
+	/* Copy of the region of a buffer used as a compression prefix */
+	void *prefix_buf;
+	int prefix_size;
 };
 
 enum task_type {
-	TASK_STOP,
 	TASK_COMPRESS_BLOCK,
 	TASK_COMPRESS_DIFF,
+	TASK_APPLY_UPDATE,
 };
 
 /** Specification for a task to be run on another thread */
@@ -119,13 +270,21 @@ struct task_data {
 	/* For block compression option */
 	int zone_start, zone_end;
 	/* For diff compression option */
-	struct interval *damage_intervals;
+	struct ext_interval *damage_intervals;
 	int damage_len;
 	bool damaged_end;
+	/* For update application option; the message is not owned */
+	enum wmsg_type update_type;
+	struct bytebuf update;
 
 	struct thread_msg_recv_buf *msg_queue;
 };
 
+struct task_slot {
+	atomic_uint seq;
+	struct task_data task;
+};
+
 /** Shadow object types, signifying file descriptor type and usage */
 enum fdcat {
 	FDC_UNKNOWN,
@@ -152,6 +311,9 @@ struct refcount {
 	int transfer;
 	/** Do any thread tasks potentially refer to this */
 	bool compute;
+	/** How many tasks applying incoming updates refer to this; these
+	 * are decremented by the worker threads */
+	atomic_int incoming;
 };
 
 struct pipe_state {
@@ -173,6 +335,10 @@ struct pipe_state {
 	 * (POLLIN|POLLHUP -> readable ; POLLOUT -> writeable) */
 	bool readable, writable;
 	bool pending_w_shutdown;
+	/** The fd registered with the map's epoll instance, or -1, and the
+	 * events it was registered for */
+	int watched_fd;
+	uint32_t watched_events;
 };
 
 enum video_coding_fmt {
@@ -192,6 +358,16 @@ struct shadow_fd {
 	enum fdcat type;
 	int remote_id; // + if created serverside; - if created clientside
 	int fd_local;
+	/* The map containing this structure, and the keys under which its
+	 * fd_index lists it; -1 if unused */
+	struct fd_translation_map *map;
+	int indexed_fds[2];
+	/* Link in map->work; both pointers are NULL when not in the list */
+	struct shadow_fd_link work_link;
+	/* For local FDC_FILE shadows, the file to which fd_local refers */
+	bool file_indexed;
+	dev_t file_dev;
+	ino_t file_ino;
 	/** true iff the shadow structure is newly created and no message
 	 * to create a copy has been sent yet */
 	bool only_here;
@@ -201,7 +377,7 @@ struct shadow_fd {
 	bool is_dirty;  // If so, should this file be scanned for updates?
 	struct damage damage;
 	/* For worker threads, contains their allocated damage intervals */
-	struct interval *damage_task_interval_store;
+	struct ext_interval *damage_task_interval_store;
 
 	struct refcount refcount;
 
@@ -213,6 +389,10 @@ struct shadow_fd {
 	/* exact mirror of the contents, with proper alignment */
 	char *mem_mirror;
 	void *mem_mirror_handle;
+	/* If set, this owns the mirror allocation instead of mem_mirror_handle,
+	 * and transfers not yet acknowledged may point into the mirror, so it
+	 * must be replaced instead of reallocated */
+	struct shared_buffer *mirror_shared;
 
 	// File data
 	size_t remote_bufsize; // used to check for and send file extensions
@@ -226,6 +406,7 @@ struct shadow_fd {
 	struct dmabuf_slice_data dmabuf_info;
 	void *dmabuf_map_handle; /* Nonnull when DMABUF is currently mapped */
 	uint32_t dmabuf_map_stride; /* stride at which mem_local is mapped */
+	uint32_t dmabuf_map_row; /* first row of the DMABUF in mem_local */
 	/* temporary cache of stride-fixed mem_local. Same dimensions as
 	 * mem_mirror */
 	char *dmabuf_warped;
@@ -257,6 +438,9 @@ int setup_thread_pool(struct thread_pool *pool,
 		enum compression_mode compression, int compression_level,
 		int n_threads);
 void cleanup_thread_pool(struct thread_pool *pool);
+/** Prepare thread local data and a wakeup pipe for a thread, other than the
+ * main thread, that applies updates from the channel. Returns -1 on failure */
+int setup_incoming_thread(struct thread_pool *pool);
 
 /** Given a file descriptor, return which type code would be applied to its
  * shadow entry. (For example, FDC_PIPE_IR for a pipe-like object that can only
@@ -274,14 +458,37 @@ const char *fdcat_to_str(enum fdcat cat);
 struct shadow_fd *translate_fd(struct fd_translation_map *map,
 		struct render_data *render, int fd, enum fdcat type, size_t sz,
 		const struct dmabuf_slice_data *info, bool force_pipe_iw);
+/** If `fd` refers to the same file as an FDC_FILE shadow structure which is
+ * in use by protocol objects, return that structure, and, until the next call
+ * to close_fd_aliases, translate `fd` to it. Otherwise return NULL.
+ *
+ * Like the other shadow structures sent more than once, the caller must then
+ * increase the transfer reference count. */
+struct shadow_fd *get_shadow_for_same_file(
+		struct fd_translation_map *map, int fd);
+/** Close all file descriptors registered by get_shadow_for_same_file; this
+ * should be done once they have been translated to remote ids */
+void close_fd_aliases(struct fd_translation_map *map);
 /** Given a struct shadow_fd, produce some number of corresponding file update
- * transfer messages. All pointers will be to existing memory. */
+ * transfer messages. All pointers will be to existing memory. For files, this
+ * first waits for updates being applied to `cur` by apply_update_async. */
 void collect_update(struct thread_pool *threads, struct shadow_fd *cur,
 		struct transfer_queue *transfers, bool use_old_dmavid_req);
 /** After all thread pool tasks have completed, reduce refcounts and clean up
  * related data. The caller should then invoke destroy_shadow_if_unreferenced.
  */
 void finish_update(struct shadow_fd *sfd);
+/** If the thread pool trains zstd dictionaries, start training once enough
+ * samples are available, or start using a newly trained dictionary, adding a
+ * message to `transfers` to send it. This also makes the dictionary follow
+ * changes to `compression_level`. Must be called before collecting updates,
+ * while no compression tasks are in progress. */
+void update_zstd_dictionary(
+		struct thread_pool *threads, struct transfer_queue *transfers);
+/** Apply a WMSG_ZSTD_DICTIONARY message, replacing the dictionary used to
+ * decompress incoming data. No incoming tasks may be in progress. */
+int apply_zstd_dictionary(
+		struct thread_pool *threads, const struct bytebuf *msg);
 /** Apply a data update message to an element in the translation map, creating
  * an entry when there is none.
  *
@@ -291,6 +498,17 @@ void finish_update(struct shadow_fd *sfd);
 int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		struct render_data *render, enum wmsg_type type, int remote_id,
 		const struct bytebuf *msg);
+/** Return true if the update message can be applied by a worker thread, using
+ * apply_update_async. This is the case for buffer fill and diff messages to
+ * writable shared memory files. */
+bool update_is_async(struct fd_translation_map *map, enum wmsg_type type,
+		int remote_id);
+/** Like apply_update, but queue a task on the thread pool to apply the update.
+ * The message data must remain valid until incoming_work_done() holds. Any
+ * errors from the task are reported through `threads->incoming_error`. */
+int apply_update_async(struct fd_translation_map *map,
+		struct thread_pool *threads, enum wmsg_type type, int remote_id,
+		const struct bytebuf *msg);
 /** Get the shadow structure associated to a remote id, or NULL if it dne */
 struct shadow_fd *get_shadow_for_rid(struct fd_translation_map *map, int rid);
 /** Get shadow structure for a local file descriptor, or NULL if it dne */
@@ -308,6 +526,11 @@ int fill_with_pipes(const struct fd_translation_map *map, struct pollfd *pfds,
 /** mark pipe shadows as being ready to read or write */
 void mark_pipe_object_statuses(
 		struct fd_translation_map *map, int nfds, struct pollfd *pfds);
+/** mark a pipe shadow as being ready to read or write, given POLL* flags */
+void mark_pipe_object_status(struct shadow_fd *sfd, int revents);
+/** If the map has an epoll instance, update the events for which pipes are
+ * registered, with the same choice of events as fill_with_pipes. */
+void watch_active_pipes(struct fd_translation_map *map, bool check_read);
 /** For pipes marked writeable, flush as much buffered data as possible */
 void flush_writable_pipes(struct fd_translation_map *map);
 /** For pipes marked readable, read as much data as possible without blocking */
@@ -328,8 +551,20 @@ bool shadow_decref_transfer(struct shadow_fd *);
 struct shadow_fd *shadow_incref_protocol(struct shadow_fd *);
 struct shadow_fd *shadow_incref_transfer(struct shadow_fd *);
 /** If the shadow structure has no references, destroy it and remove it from the
- * map */
+ * map. Otherwise, if nothing remains to be done for it, remove it from the
+ * map's work list. */
 bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd);
+/** Add the shadow structure to its map's work list, if it is not already
+ * there. This must be done whenever it is marked dirty, or pipe state changes
+ * outside of the functions in shadow.c */
+void mark_shadow_active(struct shadow_fd *sfd);
+/** Get the shadow structure for an element of a map's work list */
+static inline struct shadow_fd *shadow_from_work_link(
+		struct shadow_fd_link *link)
+{
+	return (struct shadow_fd *)((char *)link -
+				    offsetof(struct shadow_fd, work_link));
+}
 /** Decrease reference count for all objects in the given list, deleting
  * iff they are owned by protocol objects and have refcount zero */
 void decref_transferred_fds(
@@ -338,20 +573,45 @@ void decref_transferred_rids(
 		struct fd_translation_map *map, int nids, int ids[]);
 
 /** If sfd->type == FDC_FILE, increase the size of the backing data to support
- * at least new_size, and mark the new part of underlying file as dirty */
+ * at least new_size, and mark the new part of underlying file as dirty. This
+ * first waits for updates being applied to `sfd` by apply_update_async, and
+ * for diffs of it being computed, and may run tasks from the thread pool on
+ * the main thread. */
 void extend_shm_shadow(struct thread_pool *threads, struct shadow_fd *sfd,
 		size_t new_size);
 
 /** Notify the threads so that they can start working on the tasks in the pool,
- * and return the total number of tasks */
+ * and return the total number of tasks. Returns -1 if there is no space in
+ * recv_queue for the results of compression tasks; these are then dropped,
+ * and the caller should treat this as an out-of-memory error. */
 int start_parallel_work(struct thread_pool *pool,
 		struct thread_msg_recv_buf *recv_queue);
-/** Return true if there is a work task (not a stop task) remaining for the
- * main thread to work on; also set *is_done if all tasks have completed. */
+/** Return true if there is a work task remaining for the main thread to work
+ * on; also set *is_done if all tasks have completed. Only the main thread
+ * (or, with setup_incoming_thread, whichever of the two threads holds the
+ * lock on the shared state) may call this; it also publishes tasks that did
+ * not yet fit in the thread queues. */
 bool request_work_task(struct thread_pool *pool, struct task_data *task,
 		bool *is_done);
 /** Run a work task */
 void run_task(struct task_data *task, struct thread_data *local);
+/** Mark a task obtained from request_work_task as completed */
+void finish_work_task(struct thread_pool *pool, const struct task_data *task);
+/** Wake the thread which waits for tasks of this type to complete */
+void notify_task_done(struct thread_pool *pool, enum task_type type);
+/** Return true if all tasks queued by apply_update_async have completed */
+bool incoming_work_done(struct thread_pool *pool);
+
+/* internal DMABUF row mapping helpers, made visible for testing */
+/** Convert a position in a DMABUF, as laid out over the wire, to the
+ * corresponding position in its local mapping, which starts at row
+ * sfd->dmabuf_map_row */
+size_t dmabuf_local_offset(const struct shadow_fd *sfd, size_t pos);
+/** Narrow [*row_start, *row_end) to the rows of a DMABUF, as laid out over
+ * the wire, which contain its damage */
+void get_damaged_rows(const struct thread_pool *threads,
+		const struct shadow_fd *sfd, uint32_t *row_start,
+		uint32_t *row_end);
 
 // video.c
 void cleanup_hwcontext(struct render_data *rd);
@@ -564,6 +564,10 @@ static const char *const wmsg_types[] = {
 		"WMSG_CLOSE",
 		"WMSG_OPEN_DMAVID_SRC_V2",
 		"WMSG_OPEN_DMAVID_DST_V2",
+		"WMSG_BUFFER_PREFIX_DIFF",
+		"WMSG_ZSTD_DICTIONARY",
+		"WMSG_BUFFER_FILL_RAW",
+		"WMSG_BUFFER_DIFF_RAW",
 };
 const char *wmsg_type_to_str(enum wmsg_type tp)
 {
@@ -606,41 +610,148 @@ int transfer_add(struct transfer_queue *w, size_t size, void *data)
 	w->vecs[w->end].iov_base = data;
 	w->meta[w->end].msgno = w->last_msgno;
 	w->meta[w->end].static_alloc = false;
+	w->meta[w->end].borrowed = NULL;
 	w->end++;
 	w->last_msgno++;
+	w->unconfirmed_bytes += size;
 	return 0;
 }
 
+struct shared_buffer *shared_buffer_create(void *data, void *handle)
+{
+	struct shared_buffer *buf = calloc(1, sizeof(struct shared_buffer));
+	if (!buf) {
+		return NULL;
+	}
+	buf->refcount = 1;
+	buf->data = data;
+	buf->handle = handle;
+	return buf;
+}
+
+void shared_buffer_unref(struct shared_buffer *buf)
+{
+	if (--buf->refcount > 0) {
+		return;
+	}
+	zeroed_aligned_free(buf->data, &buf->handle);
+	free(buf);
+}
+
 void transfer_async_add(struct thread_msg_recv_buf *q, void *data, size_t sz)
 {
-	struct iovec vec;
-	vec.iov_len = sz;
-	vec.iov_base = data;
-	pthread_mutex_lock(&q->lock);
-	q->data[q->zone_end++] = vec;
-	pthread_mutex_unlock(&q->lock);
+	unsigned int pos = atomic_fetch_add_explicit(
+			&q->zone_end, 1, memory_order_relaxed);
+	struct thread_msg_slot *slot =
+			&q->data[pos & (unsigned int)(q->size - 1)];
+	slot->len = sz;
+	slot->borrowed = NULL;
+	atomic_store_explicit(&slot->base, data, memory_order_release);
+}
+
+void transfer_async_add_borrowed(struct thread_msg_recv_buf *q, void *header,
+		size_t header_sz, struct shared_buffer *src, void *data,
+		size_t data_sz)
+{
+	unsigned int pos = atomic_fetch_add_explicit(
+			&q->zone_end, 2, memory_order_relaxed);
+	unsigned int mask = (unsigned int)(q->size - 1);
+	struct thread_msg_slot *head_slot = &q->data[pos & mask];
+	struct thread_msg_slot *data_slot = &q->data[(pos + 1) & mask];
+	/* Complete the data slot first, so that the main thread never sees
+	 * the header without the data after it */
+	data_slot->len = data_sz;
+	data_slot->borrowed = src;
+	atomic_store_explicit(&data_slot->base, data, memory_order_release);
+	head_slot->len = header_sz;
+	head_slot->borrowed = NULL;
+	atomic_store_explicit(&head_slot->base, header, memory_order_release);
+}
+
+bool transfer_async_pop(struct thread_msg_recv_buf *q, struct iovec *msg,
+		struct shared_buffer **borrowed)
+{
+	unsigned int zend = atomic_load_explicit(
+			&q->zone_end, memory_order_relaxed);
+	if (q->zone_start == zend) {
+		return false;
+	}
+	struct thread_msg_slot *slot =
+			&q->data[q->zone_start & (unsigned int)(q->size - 1)];
+	void *base = atomic_load_explicit(&slot->base, memory_order_acquire);
+	if (!base) {
+		/* The slot is reserved, but not yet filled in */
+		return false;
+	}
+	msg->iov_base = base;
+	msg->iov_len = slot->len;
+	*borrowed = slot->borrowed;
+	atomic_store_explicit(&slot->base, NULL, memory_order_relaxed);
+	q->zone_start++;
+	return true;
+}
+
+int transfer_async_ensure_size(struct thread_msg_recv_buf *q, int count)
+{
+	unsigned int zend = atomic_load(&q->zone_end);
+	int npending = (int)(zend - q->zone_start);
+	if (npending + count <= q->size) {
+		return 0;
+	}
+	int new_size = max(q->size, 64);
+	while (new_size < npending + count) {
+		new_size *= 2;
+	}
+	struct thread_msg_slot *new_data =
+			calloc((size_t)new_size, sizeof(*new_data));
+	if (!new_data) {
+		return -1;
+	}
+	/* Linearize the pending entries */
+	for (int i = 0; i < npending; i++) {
+		struct thread_msg_slot *slot =
+				&q->data[(q->zone_start + (unsigned int)i) &
+						(unsigned int)(q->size - 1)];
+		new_data[i].len = slot->len;
+		new_data[i].borrowed = slot->borrowed;
+		atomic_init(&new_data[i].base, atomic_load(&slot->base));
+	}
+	free(q->data);
+	q->data = new_data;
+	q->size = new_size;
+	q->zone_start = 0;
+	atomic_store(&q->zone_end, (unsigned int)npending);
+	return 0;
 }
 
 int transfer_load_async(struct transfer_queue *w)
 {
-	pthread_mutex_lock(&w->async_recv_queue.lock);
-	int zstart = w->async_recv_queue.zone_start;
-	int zend = w->async_recv_queue.zone_end;
-	w->async_recv_queue.zone_start = zend;
-	pthread_mutex_unlock(&w->async_recv_queue.lock);
-
-	for (int i = zstart; i < zend; i++) {
-		struct iovec v = w->async_recv_queue.data[i];
-		memset(&w->async_recv_queue.data[i], 0, sizeof(struct iovec));
-		if (v.iov_len == 0 || v.iov_base == NULL) {
+	struct iovec v;
+	struct shared_buffer *borrowed;
+	while (transfer_async_pop(&w->async_recv_queue, &v, &borrowed)) {
+		if (v.iov_len == 0) {
 			wp_error("Unexpected empty message");
 			continue;
 		}
+		if (borrowed) {
+			/* The header of this message was just added */
+			if (transfer_ensure_size(w, w->end + 1) == -1) {
+				wp_error("Failed to add message to transfer queue");
+				return -1;
+			}
+			borrowed->refcount++;
+			w->vecs[w->end] = v;
+			w->meta[w->end].msgno = w->last_msgno - 1;
+			w->meta[w->end].static_alloc = true;
+			w->meta[w->end].borrowed = borrowed;
+			w->end++;
+			w->unconfirmed_bytes += v.iov_len;
+			continue;
+		}
 		/* Only fill/diff messages are received async, so msgno
 		 * is always incremented */
 		if (transfer_add(w, v.iov_len, v.iov_base) == -1) {
 			wp_error("Failed to add message to transfer queue");
-			pthread_mutex_unlock(&w->async_recv_queue.lock);
 			return -1;
 		}
 	}
@@ -649,16 +760,21 @@ int transfer_load_async(struct transfer_queue *w)
 
 void cleanup_transfer_queue(struct transfer_queue *td)
 {
-	for (int i = td->async_recv_queue.zone_start;
-			i < td->async_recv_queue.zone_end; i++) {
-		free(td->async_recv_queue.data[i].iov_base);
+	struct iovec v;
+	struct shared_buffer *borrowed;
+	while (transfer_async_pop(&td->async_recv_queue, &v, &borrowed)) {
+		if (!borrowed) {
+			free(v.iov_base);
+		}
 	}
-	pthread_mutex_destroy(&td->async_recv_queue.lock);
 	free(td->async_recv_queue.data);
 	for (int i = 0; i < td->end; i++) {
 		if (!td->meta[i].static_alloc) {
 			free(td->vecs[i].iov_base);
 		}
+		if (td->meta[i].borrowed) {
+			shared_buffer_unref(td->meta[i].borrowed);
+		}
 	}
 	free(td->vecs);
 	free(td->meta);
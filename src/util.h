@@ -27,6 +27,7 @@
 
 #include <assert.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -187,6 +188,12 @@ size_t print_wrapped_error(char *dest, size_t dest_space, const char *message);
  * depending on its flags and local capabilities. */
 #define CONN_NO_DMABUF_SUPPORT (0x1u << 2)
 
+/** The waypipe-server sends this to indicate that it can apply
+ * WMSG_BUFFER_FILL_RAW and WMSG_BUFFER_DIFF_RAW messages, so that the
+ * waypipe-client may send incompressible data without compressing it. Older
+ * clients ignore this bit. */
+#define CONN_RAW_BLOCKS_BIT (0x1u << 3)
+
 /** Indicate which compression format the waypipe-server can accept. For
  * backwards compatibility, if none of these flags is set, assume the server and
  * client match. */
@@ -352,6 +359,20 @@ enum wmsg_type {
 	 * to produce/consume video frames. Format: \ref wmsg_open_dmavid */
 	WMSG_OPEN_DMAVID_SRC_V2,
 	WMSG_OPEN_DMAVID_DST_V2,
+	/** Apply a diff to the file, which was compressed with zstd using the
+	 * given region of the buffer (before the diff) as a prefix.
+	 * Format: \ref wmsg_buffer_prefix_diff */
+	WMSG_BUFFER_PREFIX_DIFF,
+	/** Use the following zstd dictionary to decompress any later frames
+	 * which refer to its dictionary ID, replacing the previous dictionary.
+	 * Format: \ref wmsg_zstd_dictionary */
+	WMSG_ZSTD_DICTIONARY,
+	/** Like WMSG_BUFFER_FILL, but the data is never compressed; used when
+	 * the data would barely shrink. Format: \ref wmsg_buffer_fill */
+	WMSG_BUFFER_FILL_RAW,
+	/** Like WMSG_BUFFER_DIFF, but the diff is never compressed.
+	 * Format: \ref wmsg_buffer_diff */
+	WMSG_BUFFER_DIFF_RAW,
 };
 const char *wmsg_type_to_str(enum wmsg_type tp);
 bool wmsg_type_is_known(enum wmsg_type tp);
@@ -399,6 +420,24 @@ struct wmsg_buffer_diff {
 };
 static_assert(sizeof(struct wmsg_buffer_diff) == 16, "size check");
 
+struct wmsg_buffer_prefix_diff {
+	uint32_t size_and_type;
+	int32_t remote_id;
+	uint32_t diff_size; /**< in bytes, when uncompressed */
+	uint32_t ntrailing; /**< number of 'trailing' bytes, copied to tail */
+	uint32_t prefix_start; /**< [start, end), in bytes of prefix region */
+	uint32_t prefix_end;
+	/* following this, the zstd-compressed diff data */
+};
+static_assert(sizeof(struct wmsg_buffer_prefix_diff) == 24, "size check");
+
+struct wmsg_zstd_dictionary {
+	uint32_t size_and_type;
+	uint32_t dict_id; /**< the ID recorded in the dictionary */
+	/* following this, the dictionary contents */
+};
+static_assert(sizeof(struct wmsg_zstd_dictionary) == 8, "size check");
+
 struct wmsg_basic {
 	uint32_t size_and_type;
 	int32_t remote_id;
@@ -429,17 +468,46 @@ static inline enum wmsg_type transfer_type(uint32_t header)
 	return (enum wmsg_type)(header & ((1u << 5) - 1));
 }
 
+/** A reference counted buffer from zeroed_aligned_alloc, into which transfer
+ * blocks may point instead of holding a copy of the data. Only the main thread
+ * may change the reference count. */
+struct shared_buffer {
+	int refcount;
+	void *data;
+	void *handle;
+};
+/** Take ownership of a buffer, returning the first reference to it, or NULL
+ * on allocation failure */
+struct shared_buffer *shared_buffer_create(void *data, void *handle);
+/** Drop a reference, freeing the buffer once no references are left */
+void shared_buffer_unref(struct shared_buffer *buf);
+
+/** An entry of \ref thread_msg_recv_buf */
+struct thread_msg_slot {
+	size_t len;
+	/** If nonnull, the data points into this buffer, and continues the
+	 * message in the preceding slot */
+	struct shared_buffer *borrowed;
+	/** Nonnull iff the slot contains a complete message */
+	_Atomic(void *) base;
+};
+
 /** Worker tasks write their resulting messages to this receive buffer,
  * and the main thread periodically checks the messages and appends the results
- * to the main thread. */
+ * to the main thread.
+ *
+ * This is a ring buffer to which any number of threads may add messages
+ * without locking. A worker reserves a slot by incrementing `zone_end`, and
+ * then fills in the slot; as valid messages have a nonnull base pointer, the
+ * main thread can tell which of the reserved slots are complete. */
 struct thread_msg_recv_buf {
-	// TODO: make this lock free, using the fact that valid iovecs have
-	// nonzero fields
-	struct iovec *data;
-	/** [zone_start, zone_end] contains the set of entries which might
-	 * contain data */
-	int zone_start, zone_end, size;
-	pthread_mutex_t lock;
+	struct thread_msg_slot *data;
+	/** [zone_start, zone_end) contains the set of entries which might
+	 * contain data; positions are taken modulo `size`, a power of two.
+	 * Only the main thread modifies `zone_start` and `size`. */
+	unsigned int zone_start;
+	atomic_uint zone_end;
+	int size;
 };
 static inline int msgno_gt(uint32_t a, uint32_t b)
 {
@@ -451,6 +519,10 @@ struct transfer_block_meta {
 	uint32_t msgno;
 	/** If true, data is not heap allocated */
 	bool static_alloc;
+	/** If nonnull, the data points into this buffer, of which the block
+	 * holds a reference, and the block continues the message of the
+	 * preceding block */
+	struct shared_buffer *borrowed;
 };
 
 /** A queue of data blocks to be written to the channel. This should only
@@ -470,6 +542,10 @@ struct transfer_queue {
 	/** The most recent message number, to be incremented after almost all
 	 * message types */
 	uint32_t last_msgno;
+	/** Blocks before this are known to have been received by the other
+	 * side; `unconfirmed_bytes` is the size of those after it */
+	int confirm_end;
+	size_t unconfirmed_bytes;
 	/** Messages added from a worker thread are introduced here, and should
 	 * be periodically copied onto the main queue */
 	struct thread_msg_recv_buf async_recv_queue;
@@ -485,8 +561,23 @@ int transfer_add(struct transfer_queue *transfers, size_t size, void *data);
 void cleanup_transfer_queue(struct transfer_queue *transfers);
 /** Move any asynchronously loaded messages to the queue */
 int transfer_load_async(struct transfer_queue *w);
-/** Add a message to the async queue */
+/** Add a message to the async queue. The queue must have space reserved for
+ * it, see \ref transfer_async_ensure_size. Any thread may call this. */
 void transfer_async_add(struct thread_msg_recv_buf *q, void *data, size_t sz);
+/** Add a message to the async queue, made of a heap allocated header, followed
+ * by data in the shared buffer `src`, which must stay alive until the main
+ * thread has loaded the message. This uses two slots of the queue. */
+void transfer_async_add_borrowed(struct thread_msg_recv_buf *q, void *header,
+		size_t header_sz, struct shared_buffer *src, void *data,
+		size_t data_sz);
+/** Remove the oldest message from the async queue, if it is complete. Only the
+ * main thread may call this. If the message is data borrowed from a shared
+ * buffer, `borrowed` is set to the buffer, and otherwise to NULL. */
+bool transfer_async_pop(struct thread_msg_recv_buf *q, struct iovec *msg,
+		struct shared_buffer **borrowed);
+/** Ensure the async queue has space for `count` messages beyond those already
+ * pending. This must not be called while other threads may add messages. */
+int transfer_async_ensure_size(struct thread_msg_recv_buf *q, int count);
 
 /* Functions that are unsually platform specific */
 int create_anon_file(void);
@@ -498,6 +589,11 @@ void *zeroed_aligned_alloc(size_t bytes, size_t alignment, void **handle);
 void *zeroed_aligned_realloc(size_t old_size_bytes, size_t new_size_bytes,
 		size_t alignment, void *data, void **handle);
 void zeroed_aligned_free(void *data, void **handle);
+/** Create a buffer of `size` bytes, which is mapped twice in a row, so that
+ * bytes `i` and `i + size` are the same for `i < size`. `size` must be a
+ * multiple of the page size. Returns NULL on failure. */
+void *create_mirrored_buffer(size_t size);
+void free_mirrored_buffer(void *data, size_t size);
 /** Returns a file descriptor for the folder than can be fchdir'd to, or
  * -1 on failure, setting errno. If `name` is the empty string, opens the
  * current directory.
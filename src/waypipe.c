@@ -75,6 +75,12 @@ static const char usage_string[] =
 		"\n"
 		"Options:\n"
 		"  -c, --compress C     choose compression method: lz4[=#], zstd=[=#], none\n"
+		"                         zstd-prefix[=#] also compresses buffer diffs\n"
+		"                         relative to the previous buffer contents\n"
+		"                         zstd-dict[=#] also trains dictionaries from\n"
+		"                         buffer diffs, to compress later data\n"
+		"                         with =auto instead of =#, adapt the level\n"
+		"                         to the speed of the connection\n"
 		"  -d, --debug          print debug messages\n"
 		"  -h, --help           display this help and exit\n"
 		"  -n, --no-gpu         disable protocols which would use GPU resources\n"
@@ -85,12 +91,19 @@ static const char usage_string[] =
 		"                         ssh: sets the prefix for the socket path\n"
 		"      --version        print waypipe version and exit\n"
 		"      --allow-tiled    allow gpu buffers (DMABUFs) with format modifiers\n"
+		"      --coalesce       server,ssh: while the connection is congested,\n"
+		"                         merge the application's buffer commits\n"
 		"      --control C      server,ssh: set control pipe to reconnect server\n"
 		"      --display D      server,ssh: the Wayland display name or path\n"
 		"      --drm-node R     set the local render node. default: /dev/dri/renderD128\n"
+		"      --duplex         run each direction of transfers on its own thread\n"
 		"      --remote-node R  ssh: set the remote render node path\n"
 		"      --remote-bin R   ssh: set the remote waypipe binary. default: waypipe\n"
 		"      --login-shell    server: if server CMD is empty, run a login shell\n"
+		"      --max-inflight M server,ssh: limit unacknowledged application data\n"
+		"                         to M megabytes, default 128; 0 for no limit\n"
+		"      --raw-blocks     server,ssh: send incompressible buffer data as is;\n"
+		"                         the client must be new enough to accept it\n"
 		"      --threads T      set thread pool size, default=hardware threads/2\n"
 		"      --unlink-socket  server: unlink the socket that waypipe connects to\n"
 		"      --video[=V]      compress certain linear dmabufs only with a video codec\n"
@@ -219,16 +232,25 @@ static void fill_rand_token(char tok[static 8])
 
 /* Scan a suffix which is either empty or has the form =N, returning true
  * if it matches */
-static bool parse_level_choice(const char *str, int *dest, int defval)
+static bool parse_level_choice(
+		const char *str, int *dest, bool *adaptive, int defval)
 {
 	if (str[0] == '\0') {
 		*dest = defval;
+		*adaptive = false;
 		return true;
 	}
 	if (str[0] != '=') {
 		return false;
 	}
 	str++;
+	if (!strcmp(str, "auto")) {
+		/* Start from the default level, and let the main loop adjust it
+		 * to match the connection */
+		*dest = defval;
+		*adaptive = true;
+		return true;
+	}
 	int sign = 1;
 	if (str[0] == '-') {
 		sign = -1;
@@ -239,6 +261,7 @@ static bool parse_level_choice(const char *str, int *dest, int defval)
 		return false;
 	}
 	*dest = sign * (int)val;
+	*adaptive = false;
 	return true;
 }
 
@@ -393,6 +416,10 @@ static const bool feature_flags[] = {
 #define ARG_CONTROL 1010
 #define ARG_WAYPIPE_BINARY 1011
 #define ARG_BENCH_TEST_SIZE 1012
+#define ARG_DUPLEX 1013
+#define ARG_MAX_INFLIGHT 1014
+#define ARG_RAW_BLOCKS 1015
+#define ARG_COALESCE 1016
 
 static const struct option options[] = {
 		{"compress", required_argument, NULL, 'c'},
@@ -414,6 +441,10 @@ static const struct option options[] = {
 		{"display", required_argument, NULL, ARG_DISPLAY},
 		{"control", required_argument, NULL, ARG_CONTROL},
 		{"test-size", required_argument, NULL, ARG_BENCH_TEST_SIZE},
+		{"duplex", no_argument, NULL, ARG_DUPLEX},
+		{"max-inflight", required_argument, NULL, ARG_MAX_INFLIGHT},
+		{"raw-blocks", no_argument, NULL, ARG_RAW_BLOCKS},
+		{"coalesce", no_argument, NULL, ARG_COALESCE},
 		{0, 0, NULL, 0}};
 struct arg_permissions {
 	int val;
@@ -441,6 +472,10 @@ static const struct arg_permissions arg_permissions[] = {
 		{ARG_DISPLAY, MODE_SSH | MODE_SERVER},
 		{ARG_CONTROL, MODE_SSH | MODE_SERVER},
 		{ARG_BENCH_TEST_SIZE, MODE_BENCH},
+		{ARG_DUPLEX, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_MAX_INFLIGHT, MODE_SSH | MODE_SERVER},
+		{ARG_RAW_BLOCKS, MODE_SSH | MODE_SERVER},
+		{ARG_COALESCE, MODE_SSH | MODE_SERVER},
 };
 
 /* envp is nonstandard, so use environ */
@@ -458,6 +493,7 @@ int main(int argc, char **argv)
 	char *remote_drm_node = NULL;
 	char *comp_string = NULL;
 	char *nthread_string = NULL;
+	char *max_inflight_string = NULL;
 	char *wayland_display = NULL;
 	char *waypipe_binary = "waypipe";
 	char *control_path = NULL;
@@ -468,12 +504,19 @@ int main(int argc, char **argv)
 			.drm_node = NULL,
 			.compression = COMP_NONE,
 			.compression_level = 0,
+			.adaptive_level = false,
+			.zstd_prefix = false,
+			.zstd_dict = false,
+			.raw_blocks = false,
 			.no_gpu = false,
 			.only_linear_dmabuf = true,
 			.video_if_possible = false,
 			.video_bpf = 0,
 			.video_fmt = VIDEO_H264,
-			.prefer_hwvideo = false};
+			.prefer_hwvideo = false,
+			.thread_per_direction = false,
+			.max_inflight = (size_t)128 << 20,
+			.coalesce = false};
 
 	/* We do not parse any getopt arguments happening after the mode choice
 	 * string, so as not to interfere with them. */
@@ -534,22 +577,57 @@ int main(int argc, char **argv)
 			if (!strcmp(optarg, "none")) {
 				config.compression = COMP_NONE;
 				config.compression_level = 0;
+				config.adaptive_level = false;
+				config.zstd_prefix = false;
+				config.zstd_dict = false;
 			} else if (!strncmp(optarg, "lz4", 3) &&
 					parse_level_choice(optarg + 3,
 							&config.compression_level,
+							&config.adaptive_level,
 							-1)) {
 #ifdef HAS_LZ4
 				config.compression = COMP_LZ4;
+				config.zstd_prefix = false;
+				config.zstd_dict = false;
 #else
 				fprintf(stderr, "Compression method lz4 not available: this copy of Waypipe was not built with LZ4 compression support.\n");
 				return EXIT_FAILURE;
+#endif
+			} else if (!strncmp(optarg, "zstd-prefix", 11) &&
+					parse_level_choice(optarg + 11,
+							&config.compression_level,
+							&config.adaptive_level,
+							5)) {
+#ifdef HAS_ZSTD
+				config.compression = COMP_ZSTD;
+				config.zstd_prefix = true;
+				config.zstd_dict = false;
+#else
+				fprintf(stderr, "Compression method zstd not available: this copy of Waypipe was not built with Zstd compression support.\n");
+				return EXIT_FAILURE;
+#endif
+			} else if (!strncmp(optarg, "zstd-dict", 9) &&
+					parse_level_choice(optarg + 9,
+							&config.compression_level,
+							&config.adaptive_level,
+							5)) {
+#ifdef HAS_ZSTD
+				config.compression = COMP_ZSTD;
+				config.zstd_prefix = false;
+				config.zstd_dict = true;
+#else
+				fprintf(stderr, "Compression method zstd not available: this copy of Waypipe was not built with Zstd compression support.\n");
+				return EXIT_FAILURE;
 #endif
 			} else if (!strncmp(optarg, "zstd", 4) &&
 					parse_level_choice(optarg + 4,
 							&config.compression_level,
+							&config.adaptive_level,
 							5)) {
 #ifdef HAS_ZSTD
 				config.compression = COMP_ZSTD;
+				config.zstd_prefix = false;
+				config.zstd_dict = false;
 #else
 				fprintf(stderr, "Compression method zstd not available: this copy of Waypipe was not built with Zstd compression support.\n");
 				return EXIT_FAILURE;
@@ -598,6 +676,15 @@ int main(int argc, char **argv)
 		case ARG_ALLOW_TILED:
 			config.only_linear_dmabuf = false;
 			break;
+		case ARG_DUPLEX:
+			config.thread_per_direction = true;
+			break;
+		case ARG_RAW_BLOCKS:
+			config.raw_blocks = true;
+			break;
+		case ARG_COALESCE:
+			config.coalesce = true;
+			break;
 #ifdef HAS_VIDEO
 		case ARG_VIDEO:
 			config.video_if_possible = true;
@@ -628,6 +715,15 @@ int main(int argc, char **argv)
 			config.n_worker_threads = (int)nthreads;
 			nthread_string = optarg;
 		} break;
+		case ARG_MAX_INFLIGHT: {
+			uint32_t nmegabytes;
+			if (parse_uint32(optarg, &nmegabytes) == -1 ||
+					nmegabytes > (1u << 20)) {
+				fail = true;
+			}
+			config.max_inflight = (size_t)nmegabytes << 20;
+			max_inflight_string = optarg;
+		} break;
 		case ARG_WAYPIPE_BINARY:
 			waypipe_binary = optarg;
 			break;
@@ -902,8 +998,11 @@ int main(int argc, char **argv)
 				     2 * (control_path != NULL) +
 				     config.video_if_possible +
 				     !config.only_linear_dmabuf +
+				     config.thread_per_direction +
+				     config.raw_blocks + config.coalesce +
 				     2 * needs_login_shell +
-				     2 * (config.n_worker_threads != 0);
+				     2 * (config.n_worker_threads != 0) +
+				     2 * (max_inflight_string != NULL);
 			char **arglist = calloc((size_t)(argc + nextra),
 					sizeof(char *));
 
@@ -978,6 +1077,9 @@ int main(int argc, char **argv)
 				arglist[dstidx + 1 + offset++] =
 						"--allow-tiled";
 			}
+			if (config.thread_per_direction) {
+				arglist[dstidx + 1 + offset++] = "--duplex";
+			}
 			if (remote_drm_node) {
 				arglist[dstidx + 1 + offset++] = "--drm-node";
 				arglist[dstidx + 1 + offset++] =
@@ -987,6 +1089,18 @@ int main(int argc, char **argv)
 				arglist[dstidx + 1 + offset++] = "--threads";
 				arglist[dstidx + 1 + offset++] = nthread_string;
 			}
+			if (max_inflight_string) {
+				arglist[dstidx + 1 + offset++] =
+						"--max-inflight";
+				arglist[dstidx + 1 + offset++] =
+						max_inflight_string;
+			}
+			if (config.raw_blocks) {
+				arglist[dstidx + 1 + offset++] = "--raw-blocks";
+			}
+			if (config.coalesce) {
+				arglist[dstidx + 1 + offset++] = "--coalesce";
+			}
 			if (control_path) {
 				arglist[dstidx + 1 + offset++] = "--control";
 				arglist[dstidx + 1 + offset++] = control_path;
@@ -124,6 +124,7 @@ void send_wayland_msg(struct test_state *src, const struct msg msg,
 			goto cleanup;
 		}
 	}
+	close_fd_aliases(&src->glob.map);
 
 	for (struct shadow_fd_link *lcur = src->glob.map.link.l_next,
 				   *lnxt = lcur->l_next;
@@ -145,7 +146,7 @@ void send_wayland_msg(struct test_state *src, const struct msg msg,
 		struct task_data task;
 		while (request_work_task(&src->glob.threads, &task, &is_done)) {
 			run_task(&task, &src->glob.threads.threads[0]);
-			src->glob.threads.tasks_in_progress--;
+			finish_work_task(&src->glob.threads, &task);
 		}
 		(void)transfer_load_async(transfers);
 	}
@@ -317,7 +318,6 @@ void send_protocol_msg(struct test_state *src, struct test_state *dst,
 
 	struct transfer_queue transfers;
 	memset(&transfers, 0, sizeof(transfers));
-	pthread_mutex_init(&transfers.async_recv_queue.lock, NULL);
 
 	/* On destination side, a bit easier; process transfers, and
 	 * then deliver all messages */
@@ -383,6 +383,7 @@ void cleanup_state(struct test_state *s)
 	cleanup_render_data(&s->glob.render);
 	cleanup_hwcontext(&s->glob.render);
 	cleanup_thread_pool(&s->glob.threads);
+	free(s->glob.held_frame_events.data);
 
 	for (int i = 0; i < s->nrcvd; i++) {
 		free(s->rcvd[i].data);
@@ -305,6 +305,94 @@ static int get_coverage(const int c, const struct interval *li)
 	return n;
 }
 
+static struct merge_policy test_policy = {
+		.margin = 256,
+		.max_entries = 1 << 20,
+		.max_rows = 1 << 20,
+		.time_limit_ns = INT64_MAX,
+};
+
+/** Check that damage records keep tall extended intervals intact unless
+ * they come close to each other */
+static bool test_strided_records(void)
+{
+	/* start, width, rep, stride; the third interleaves with the first */
+	struct ext_interval rects[3] = {
+			{100, 40, 1000, 5000},
+			{6000000, 64, 500, 512},
+			{2100, 40, 1000, 5000},
+	};
+	struct damage record = {0};
+	bool pass = true;
+	for (int n = 1; n <= 3; n++) {
+		merge_damage_records(&record, 1, &rects[n - 1], &test_policy);
+		int nrows = 0;
+		for (int i = 0; i < record.ndamage_intvs; i++) {
+			nrows += record.damage[i].rep;
+		}
+		struct interval *rows =
+				malloc(sizeof(struct interval) * (size_t)nrows);
+		convert_to_simple(rows, record.ndamage_intvs, record.damage);
+		bool subpass = check_solution_properties(
+				n, rects, nrows, rows, 256);
+		if (n < 3) {
+			/* no interaction, so nothing should be split */
+			subpass &= record.ndamage_intvs == n;
+		}
+		printf("strided records, %d rectangles: %d extended intervals, %d intervals, %s\n",
+				n, record.ndamage_intvs, nrows,
+				subpass ? "pass" : "FAIL");
+		pass &= subpass;
+		free(rows);
+	}
+	reset_damage(&record);
+	return pass;
+}
+
+/** Check that damage records fall back to covering groups of extended
+ * intervals by their span when the merge limits are reached */
+static bool test_limited_records(void)
+{
+	/* Two groups of interleaved rectangles, far apart */
+	struct ext_interval rects[4] = {
+			{100, 40, 1000, 5000},
+			{2100, 40, 1000, 5000},
+			{8000000, 40, 1000, 5000},
+			{8002100, 40, 1000, 5000},
+	};
+	/* Expected number of extended intervals with a row limit, a time
+	 * limit (which is checked before merging each group), and an
+	 * interval limit */
+	struct merge_policy policies[3] = {test_policy, test_policy,
+			test_policy};
+	policies[0].max_rows = 1000;
+	policies[1].time_limit_ns = 0;
+	policies[2].max_entries = 3;
+	int expected[3] = {2, 2, 1};
+	bool pass = true;
+	for (int k = 0; k < 3; k++) {
+		struct damage record = {0};
+		merge_damage_records(&record, 4, rects, &policies[k]);
+		int nrows = 0;
+		for (int i = 0; i < record.ndamage_intvs; i++) {
+			nrows += record.damage[i].rep;
+		}
+		struct interval *rows =
+				malloc(sizeof(struct interval) * (size_t)nrows);
+		convert_to_simple(rows, record.ndamage_intvs, record.damage);
+		bool subpass = check_solution_properties(
+				4, rects, nrows, rows, 256);
+		subpass &= record.ndamage_intvs == expected[k];
+		printf("limited records, policy %d: %d extended intervals, %d intervals, %s\n",
+				k, record.ndamage_intvs, nrows,
+				subpass ? "pass" : "FAIL");
+		pass &= subpass;
+		free(rows);
+		reset_damage(&record);
+	}
+	return pass;
+}
+
 log_handler_func_t log_funcs[2] = {test_log_handler, test_log_handler};
 int main(int argc, char **argv)
 {
@@ -350,7 +438,7 @@ int main(int argc, char **argv)
 				continue;
 			}
 
-			const char *names[2] = {"simple", "merges"};
+			const char *names[2] = {"simple    ", "merges    "};
 			for (int k = 0; k < 2; k++) {
 				int dst_count = 0;
 				struct interval *dst_list = NULL;
@@ -390,9 +478,49 @@ int main(int argc, char **argv)
 						pass ? "pass" : "FAIL");
 				free(dst_list);
 			}
+
+			/* Damage records keep extended intervals where they
+			 * do not interact, so check the run-length encoded
+			 * result covers the same region */
+			struct damage record = {0};
+			struct timespec t0, t1;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			merge_damage_records(
+					&record, nvec[z], data, &test_policy);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			double elapsed01 =
+					1.0 * (double)(t1.tv_sec - t0.tv_sec) +
+					1e-9 * (double)(t1.tv_nsec -
+								t0.tv_nsec);
+
+			int nrows = 0;
+			for (int i = 0; i < record.ndamage_intvs; i++) {
+				nrows += record.damage[i].rep;
+			}
+			struct interval *rows = malloc(
+					sizeof(struct interval) *
+					(size_t)max(nrows, 1));
+			convert_to_simple(rows, record.ndamage_intvs,
+					record.damage);
+			/* The margin of merge_damage_records is larger, so
+			 * it also satisfies margins[z] */
+			bool pass = check_solution_properties(nvec[z], data,
+					nrows, rows, margins[z]);
+			all_success &= pass;
+			printf("records    operation took %9.5f ms, %d intervals, %d extended, %d bytes, %s\n",
+					elapsed01 * 1e3, nrows,
+					record.ndamage_intvs,
+					get_coverage(nrows, rows),
+					pass ? "pass" : "FAIL");
+			free(rows);
+			reset_damage(&record);
 			free(data);
 		}
 	}
 
+	printf("\n");
+	all_success &= test_strided_records();
+	all_success &= test_limited_records();
+
 	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -28,6 +28,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,15 +41,19 @@
 struct compression_settings {
 	enum compression_mode mode;
 	int level;
+	bool zstd_prefix;
+	bool raw_blocks;
 };
 
 static const struct compression_settings comp_modes[] = {
-		{COMP_NONE, 0},
+		{COMP_NONE, 0, false, false},
 #ifdef HAS_LZ4
-		{COMP_LZ4, 1},
+		{COMP_LZ4, 1, false, true},
+		{COMP_LZ4, 1, false, false},
 #endif
 #ifdef HAS_ZSTD
-		{COMP_ZSTD, 5},
+		{COMP_ZSTD, 5, false, true},
+		{COMP_ZSTD, 5, true, true},
 #endif
 };
 
@@ -59,6 +64,19 @@ static const struct compression_settings comp_modes[] = {
 #define TEST_2CPP_FORMAT 0
 #endif
 
+/* Fill the region with either a constant, or (to check that data sent
+ * uncompressed because it does not compress well is handled) noise */
+static void fill_region(char *data, size_t start, size_t end, int seqno)
+{
+	if (seqno % 3 == 2) {
+		for (size_t i = start; i < end; i++) {
+			data[i] = (char)rand();
+		}
+	} else {
+		memset(data + start, seqno, end - start);
+	}
+}
+
 static int update_file(int file_fd, struct gbm_bo *bo, size_t sz, int seqno)
 {
 	(void)bo;
@@ -80,7 +98,7 @@ static int update_file(int file_fd, struct gbm_bo *bo, size_t sz, int seqno)
 		start = end;
 		end = tmp;
 	}
-	memset((char *)data + start, seqno, end - start);
+	fill_region((char *)data, start, end, seqno);
 
 	munmap(data, sz);
 	return (int)(end - start);
@@ -108,7 +126,7 @@ static int update_dmabuf(int file_fd, struct gbm_bo *bo, size_t sz, int seqno)
 		start = end;
 		end = tmp;
 	}
-	memset((char *)data + start, seqno, end - start);
+	fill_region((char *)data, start, end, seqno);
 
 	unmap_dmabuf(bo, map_handle);
 	return (int)(end - start);
@@ -222,10 +240,7 @@ static void wait_for_thread_pool(struct thread_pool *pool)
 
 		if (has_task) {
 			run_task(&task, &pool->threads[0]);
-
-			pthread_mutex_lock(&pool->work_mutex);
-			pool->tasks_in_progress--;
-			pthread_mutex_unlock(&pool->work_mutex);
+			finish_work_task(pool, &task);
 			/* To skip the next poll */
 		} else {
 			/* Wait a short amount */
@@ -237,6 +252,22 @@ static void wait_for_thread_pool(struct thread_pool *pool)
 	}
 }
 
+/* Complete all updates applied by apply_update_async */
+static bool wait_for_incoming_work(struct thread_pool *pool)
+{
+	while (!incoming_work_done(pool)) {
+		bool done;
+		struct task_data task;
+		if (request_work_task(pool, &task, &done)) {
+			run_task(&task, &pool->threads[0]);
+			finish_work_task(pool, &task);
+		} else {
+			sched_yield();
+		}
+	}
+	return atomic_exchange(&pool->incoming_error, 0) == 0;
+}
+
 static bool test_transfer(struct fd_translation_map *src_map,
 		struct fd_translation_map *dst_map,
 		struct thread_pool *src_pool, struct thread_pool *dst_pool,
@@ -244,7 +275,6 @@ static bool test_transfer(struct fd_translation_map *src_map,
 {
 	struct transfer_queue transfer_data;
 	memset(&transfer_data, 0, sizeof(struct transfer_queue));
-	pthread_mutex_init(&transfer_data.async_recv_queue.lock, NULL);
 
 	struct shadow_fd *src_shadow = get_shadow_for_rid(src_map, rid);
 	collect_update(src_pool, src_shadow, &transfer_data, false);
@@ -276,6 +306,7 @@ static bool test_transfer(struct fd_translation_map *src_map,
 	struct bytebuf res = combine_transfer_blocks(&transfer_data);
 	cleanup_transfer_queue(&transfer_data);
 
+	bool types_ok = true;
 	size_t start = 0;
 	while (start < res.size) {
 		struct bytebuf tmp;
@@ -283,11 +314,33 @@ static bool test_transfer(struct fd_translation_map *src_map,
 		uint32_t hb = ((uint32_t *)tmp.data)[0];
 		int32_t xid = ((int32_t *)tmp.data)[1];
 		tmp.size = transfer_size(hb);
-		apply_update(dst_map, dst_pool, render_data, transfer_type(hb),
-				xid, &tmp);
+		enum wmsg_type type = transfer_type(hb);
+		bool raw_type = type == WMSG_BUFFER_FILL_RAW ||
+				type == WMSG_BUFFER_DIFF_RAW;
+		if (raw_type && !src_pool->raw_blocks) {
+			wp_error("Sent raw update type %s, which the other side was not known to accept",
+					wmsg_type_to_str(type));
+			types_ok = false;
+		}
+		if (update_is_async(dst_map, transfer_type(hb), xid)) {
+			apply_update_async(dst_map, dst_pool,
+					transfer_type(hb), xid, &tmp);
+		} else {
+			wait_for_incoming_work(dst_pool);
+			apply_update(dst_map, dst_pool, render_data,
+					transfer_type(hb), xid, &tmp);
+		}
 		start += alignz(tmp.size, 4);
 	}
+	bool incoming_ok = wait_for_incoming_work(dst_pool);
 	free(res.data);
+	if (!incoming_ok) {
+		wp_error("Applying an update on a worker thread failed");
+		return false;
+	}
+	if (!types_ok) {
+		return false;
+	}
 
 	/* first round, this only exists after the transfer */
 	struct shadow_fd *dst_shadow = get_shadow_for_rid(dst_map, rid);
@@ -310,6 +363,8 @@ static bool test_mirror(int new_file_fd, size_t sz,
 	struct thread_pool src_pool;
 	setup_thread_pool(&src_pool, comp_mode.mode, comp_mode.level,
 			n_src_threads);
+	src_pool.zstd_prefix = comp_mode.zstd_prefix;
+	src_pool.raw_blocks = comp_mode.raw_blocks;
 
 	struct fd_translation_map dst_map;
 	setup_translation_map(&dst_map, true);
@@ -317,6 +372,7 @@ static bool test_mirror(int new_file_fd, size_t sz,
 	struct thread_pool dst_pool;
 	setup_thread_pool(&dst_pool, comp_mode.mode, comp_mode.level,
 			n_dst_threads);
+	dst_pool.zstd_prefix = comp_mode.zstd_prefix;
 
 	size_t fdsz = 0;
 	enum fdcat fdtype;
@@ -384,6 +440,171 @@ static bool test_mirror(int new_file_fd, size_t sz,
 	return pass;
 }
 
+/* Check that extending or diffing a file first waits for updates to it
+ * which are still being applied. With one thread, such updates stay queued
+ * until extend_shm_shadow or collect_update runs them. */
+static bool test_update_during_apply(bool extend)
+{
+	size_t sz = 65536;
+	int fd = create_anon_file();
+	if (fd == -1) {
+		wp_error("Failed to create test file: %s", strerror(errno));
+		return false;
+	}
+	if (ftruncate(fd, (off_t)sz) == -1) {
+		wp_error("Failed to resize test file: %s", strerror(errno));
+		checked_close(fd);
+		return false;
+	}
+
+	struct fd_translation_map src_map, dst_map;
+	struct thread_pool src_pool, dst_pool;
+	setup_translation_map(&src_map, false);
+	setup_translation_map(&dst_map, true);
+	setup_thread_pool(&src_pool, COMP_NONE, 0, 1);
+	setup_thread_pool(&dst_pool, COMP_NONE, 0, 1);
+
+	struct shadow_fd *src_shadow = translate_fd(
+			&src_map, NULL, fd, FDC_FILE, sz, NULL, false);
+	int rid = src_shadow->remote_id;
+	bool pass = test_transfer(&src_map, &dst_map, &src_pool, &dst_pool,
+			rid, true, NULL);
+	if (!pass) {
+		goto end;
+	}
+
+	memset(src_shadow->mem_local, 0x5a, sz);
+	src_shadow->is_dirty = true;
+	damage_everything(&src_shadow->damage);
+	struct transfer_queue transfer_data;
+	memset(&transfer_data, 0, sizeof(struct transfer_queue));
+	collect_update(&src_pool, src_shadow, &transfer_data, false);
+	start_parallel_work(&src_pool, &transfer_data.async_recv_queue);
+	wait_for_thread_pool(&src_pool);
+	finish_update(src_shadow);
+	transfer_load_async(&transfer_data);
+	struct bytebuf res = combine_transfer_blocks(&transfer_data);
+	cleanup_transfer_queue(&transfer_data);
+
+	struct shadow_fd *dst_shadow = get_shadow_for_rid(&dst_map, rid);
+	for (size_t start = 0; start < res.size;) {
+		struct bytebuf tmp;
+		tmp.data = &res.data[start];
+		uint32_t hb = ((uint32_t *)tmp.data)[0];
+		tmp.size = transfer_size(hb);
+		if (!update_is_async(&dst_map, transfer_type(hb), rid)) {
+			wp_error("Update type %s was not applied asynchronously",
+					wmsg_type_to_str(transfer_type(hb)));
+			pass = false;
+			break;
+		}
+		apply_update_async(&dst_map, &dst_pool, transfer_type(hb), rid,
+				&tmp);
+		start += alignz(tmp.size, 4);
+	}
+	if (pass && atomic_load(&dst_shadow->refcount.incoming) == 0) {
+		wp_error("No update was left queued");
+		pass = false;
+	}
+
+	if (pass && extend &&
+			ftruncate(dst_shadow->fd_local, (off_t)(2 * sz)) ==
+					-1) {
+		wp_error("Failed to resize test file: %s", strerror(errno));
+		pass = false;
+	}
+	if (pass && extend) {
+		extend_shm_shadow(&dst_pool, dst_shadow, 2 * sz);
+		if (atomic_load(&dst_shadow->refcount.incoming) != 0) {
+			wp_error("File was extended while updates to it were being applied");
+			pass = false;
+		}
+	} else if (pass) {
+		dst_shadow->is_dirty = true;
+		damage_everything(&dst_shadow->damage);
+		memset(&transfer_data, 0, sizeof(struct transfer_queue));
+		collect_update(&dst_pool, dst_shadow, &transfer_data, false);
+		if (atomic_load(&dst_shadow->refcount.incoming) != 0) {
+			wp_error("File was diffed while updates to it were being applied");
+			pass = false;
+		}
+		start_parallel_work(&dst_pool, &transfer_data.async_recv_queue);
+		wait_for_thread_pool(&dst_pool);
+		finish_update(dst_shadow);
+		cleanup_transfer_queue(&transfer_data);
+	}
+	pass &= wait_for_incoming_work(&dst_pool);
+	free(res.data);
+	if (pass) {
+		for (size_t i = 0; i < sz; i++) {
+			if (dst_shadow->mem_local[i] != 0x5a) {
+				wp_error("Mismatch at byte %zu after %s", i,
+						extend ? "extending" : "diffing");
+				pass = false;
+				break;
+			}
+		}
+	}
+
+end:
+	cleanup_translation_map(&src_map);
+	cleanup_translation_map(&dst_map);
+	cleanup_thread_pool(&src_pool);
+	cleanup_thread_pool(&dst_pool);
+	return pass;
+}
+
+/* Check that the damage to a DMABUF selects the right rows to map, and that
+ * positions in the wire layout are found in a mapping which starts at a
+ * later row and has a different stride */
+static bool test_dmabuf_rows(void)
+{
+	struct thread_pool pool;
+	memset(&pool, 0, sizeof(pool));
+	pool.diff_alignment_bits = 5;
+	pool.merge_policy = (struct merge_policy){
+			.margin = MIN_MERGE_MARGIN,
+			.max_entries = 1024,
+			.max_rows = 1024,
+			.time_limit_ns = INT64_MAX};
+	struct shadow_fd *sfd = calloc(1, sizeof(struct shadow_fd));
+	if (!sfd) {
+		return false;
+	}
+	sfd->dmabuf_info.height = 64;
+	sfd->dmabuf_info.strides[0] = 1024;
+
+	/* A 16x8 rectangle at (20,10), with 4 bytes per pixel */
+	struct ext_interval rect = {
+			.start = 10 * 1024 + 80, .width = 64, .rep = 8,
+			.stride = 1024};
+	merge_damage_records(&sfd->damage, 1, &rect, &pool.merge_policy);
+	uint32_t row_start = 0, row_end = 64;
+	get_damaged_rows(&pool, sfd, &row_start, &row_end);
+	bool pass = row_start == 10 && row_end == 18;
+
+	sfd->dmabuf_map_row = row_start;
+	sfd->dmabuf_map_stride = 1280;
+	pass &= dmabuf_local_offset(sfd, 10 * 1024 + 80) == 80;
+	pass &= dmabuf_local_offset(sfd, 17 * 1024 + 144) == 7 * 1280 + 144;
+
+	/* Damage at the end of a row is diffed in whole alignment blocks,
+	 * which reach into the next row */
+	reset_damage(&sfd->damage);
+	struct ext_interval tail = {
+			.start = 30 * 1024 + 1000, .width = 40, .rep = 1};
+	merge_damage_records(&sfd->damage, 1, &tail, &pool.merge_policy);
+	row_start = 0;
+	row_end = 64;
+	get_damaged_rows(&pool, sfd, &row_start, &row_end);
+	pass &= row_start == 30 && row_end == 32;
+
+	reset_damage(&sfd->damage);
+	free(sfd);
+	printf("DMABUF damaged rows: %s\n", pass ? "pass" : "FAIL");
+	return pass;
+}
+
 log_handler_func_t log_funcs[2] = {NULL, test_atomic_log_handler};
 int main(int argc, char **argv)
 {
@@ -428,6 +649,9 @@ int main(int argc, char **argv)
 	}
 
 	bool all_success = true;
+	all_success &= test_dmabuf_rows();
+	all_success &= test_update_during_apply(true);
+	all_success &= test_update_during_apply(false);
 	srand(0);
 	for (size_t c = 0; c < sizeof(comp_modes) / sizeof(comp_modes[0]);
 			c++) {
@@ -117,7 +117,6 @@ int main(int argc, char **argv)
 
 		struct transfer_queue transfers;
 		memset(&transfers, 0, sizeof(transfers));
-		pthread_mutex_init(&transfers.async_recv_queue.lock, NULL);
 
 		if (wayland_side) {
 			/* Send a message (incl fds) */
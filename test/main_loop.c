@@ -0,0 +1,528 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "main.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+/* Object ids used by the fake application */
+#define ID_DISPLAY 1
+#define ID_REGISTRY 2
+#define ID_SHM 3
+#define ID_COMPOSITOR 4
+#define ID_POOL 5
+#define ID_BUFFER 6
+#define ID_SURFACE 7
+#define ID_CALLBACK 8
+
+#define SURFACE_REQ_ATTACH 1
+#define SURFACE_REQ_FRAME 3
+#define SURFACE_REQ_COMMIT 6
+#define SURFACE_REQ_DAMAGE_BUFFER 9
+
+#define BUF_WIDTH 1024
+#define BUF_HEIGHT 1024
+#define BUF_STRIDE (4 * BUF_WIDTH)
+#define BUF_SIZE (BUF_STRIDE * BUF_HEIGHT)
+
+struct loop_setup {
+	int chanfd;
+	int progfd;
+	struct main_config *mc;
+};
+
+static void *run_app_side_loop(void *data)
+{
+	struct loop_setup *setup = (struct loop_setup *)data;
+	main_interface_loop(setup->chanfd, setup->progfd, -1, setup->mc,
+			false);
+	return NULL;
+}
+
+struct app_msg {
+	uint32_t words[32];
+	int len;
+};
+
+static void msg_start(struct app_msg *m, uint32_t obj_id)
+{
+	m->words[0] = obj_id;
+	m->len = 2;
+}
+static void msg_uint(struct app_msg *m, uint32_t v) { m->words[m->len++] = v; }
+static void msg_string(struct app_msg *m, const char *str)
+{
+	size_t slen = strlen(str) + 1;
+	m->words[m->len++] = (uint32_t)slen;
+	memset(&m->words[m->len], 0, alignz(slen, 4));
+	memcpy(&m->words[m->len], str, slen);
+	m->len += (int)(alignz(slen, 4) / 4);
+}
+/* Send the message as the application would, with an optional fd */
+static int msg_send(int progfd, struct app_msg *m, uint32_t opcode, int fd)
+{
+	m->words[1] = ((uint32_t)m->len << 18) | opcode;
+	struct iovec the_iovec;
+	the_iovec.iov_len = (size_t)m->len * 4;
+	the_iovec.iov_base = m->words;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &the_iovec;
+	msg.msg_iovlen = 1;
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} uc;
+	memset(uc.buf, 0, sizeof(uc.buf));
+	if (fd != -1) {
+		msg.msg_control = uc.buf;
+		msg.msg_controllen = sizeof(uc.buf);
+		struct cmsghdr *frst = CMSG_FIRSTHDR(&msg);
+		frst->cmsg_level = SOL_SOCKET;
+		frst->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(frst), &fd, sizeof(int));
+		frst->cmsg_len = CMSG_LEN(sizeof(int));
+	}
+	if (sendmsg(progfd, &msg, 0) == -1) {
+		wp_error("Failed to send message: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+static int send_damage_commit(int progfd, int y, int height)
+{
+	struct app_msg m;
+	msg_start(&m, ID_SURFACE);
+	msg_uint(&m, 0);
+	msg_uint(&m, (uint32_t)y);
+	msg_uint(&m, BUF_WIDTH);
+	msg_uint(&m, (uint32_t)height);
+	if (msg_send(progfd, &m, SURFACE_REQ_DAMAGE_BUFFER, -1) == -1) {
+		return -1;
+	}
+	msg_start(&m, ID_SURFACE);
+	return msg_send(progfd, &m, SURFACE_REQ_COMMIT, -1);
+}
+/* Create a surface with a shared memory buffer, and commit it */
+static int send_surface_setup(int progfd, int memfd)
+{
+	struct app_msg m;
+	msg_start(&m, ID_DISPLAY);
+	msg_uint(&m, ID_REGISTRY);
+	int r = msg_send(progfd, &m, 1, -1);
+	msg_start(&m, ID_REGISTRY);
+	msg_uint(&m, 1);
+	msg_string(&m, "wl_shm");
+	msg_uint(&m, 1);
+	msg_uint(&m, ID_SHM);
+	r = r ? r : msg_send(progfd, &m, 0, -1);
+	msg_start(&m, ID_REGISTRY);
+	msg_uint(&m, 2);
+	msg_string(&m, "wl_compositor");
+	msg_uint(&m, 4);
+	msg_uint(&m, ID_COMPOSITOR);
+	r = r ? r : msg_send(progfd, &m, 0, -1);
+	msg_start(&m, ID_SHM);
+	msg_uint(&m, ID_POOL);
+	msg_uint(&m, BUF_SIZE);
+	r = r ? r : msg_send(progfd, &m, 0, memfd);
+	msg_start(&m, ID_POOL);
+	msg_uint(&m, ID_BUFFER);
+	msg_uint(&m, 0);
+	msg_uint(&m, BUF_WIDTH);
+	msg_uint(&m, BUF_HEIGHT);
+	msg_uint(&m, BUF_STRIDE);
+	msg_uint(&m, 0);
+	r = r ? r : msg_send(progfd, &m, 0, -1);
+	msg_start(&m, ID_COMPOSITOR);
+	msg_uint(&m, ID_SURFACE);
+	r = r ? r : msg_send(progfd, &m, 0, -1);
+	msg_start(&m, ID_SURFACE);
+	msg_uint(&m, ID_BUFFER);
+	msg_uint(&m, 0);
+	msg_uint(&m, 0);
+	r = r ? r : msg_send(progfd, &m, SURFACE_REQ_ATTACH, -1);
+	return r ? r : send_damage_commit(progfd, 0, BUF_HEIGHT);
+}
+
+/* What the main loop sent to the channel, in order */
+struct chan_record {
+	enum wmsg_type type;
+	/* For WMSG_PROTOCOL, the number of commit and frame requests */
+	int ncommits;
+	int nframes;
+	/* For WMSG_BUFFER_DIFF, the first word of changed data */
+	uint32_t diff_word;
+};
+struct chan_log {
+	struct chan_record *records;
+	int nrecords;
+	int ncommits;
+	bool closed;
+	char *buf;
+	int buf_size;
+};
+
+static int read_exact(int fd, char *data, size_t len)
+{
+	size_t nread = 0;
+	while (nread < len) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		int p = poll(&pfd, 1, 5000);
+		if (p == -1 && errno == EINTR) {
+			continue;
+		} else if (p <= 0) {
+			wp_error("Timed out waiting for channel data");
+			return -1;
+		}
+		ssize_t r = read(fd, data + nread, len - nread);
+		if (r <= 0) {
+			wp_error("Failed to read from channel");
+			return -1;
+		}
+		nread += (size_t)r;
+	}
+	return 0;
+}
+/* Read channel messages until `ncommits` surface commits have been sent, or
+ * the main loop has closed the connection */
+static int read_channel_until(int chanfd, struct chan_log *log, int ncommits)
+{
+	while (log->ncommits < ncommits && !log->closed) {
+		uint32_t header;
+		if (read_exact(chanfd, (char *)&header, sizeof(header)) ==
+				-1) {
+			return -1;
+		}
+		size_t sz = transfer_size(header);
+		if (sz < sizeof(header)) {
+			wp_error("Invalid message size %zu", sz);
+			return -1;
+		}
+		size_t padded = alignz(sz, 4);
+		if (buf_ensure_size((int)padded, 1, &log->buf_size,
+				    (void **)&log->buf) == -1) {
+			return -1;
+		}
+		if (read_exact(chanfd, log->buf, padded - sizeof(header)) ==
+				-1) {
+			return -1;
+		}
+		struct chan_record rec;
+		memset(&rec, 0, sizeof(rec));
+		rec.type = transfer_type(header);
+		if (rec.type == WMSG_PROTOCOL) {
+			const uint32_t *words = (const uint32_t *)log->buf;
+			size_t nwords = (sz - sizeof(header)) / 4;
+			for (size_t i = 0; i + 1 < nwords;) {
+				uint32_t msg_len = words[i + 1] >> 16;
+				uint32_t opcode = words[i + 1] & 0xffff;
+				if (words[i] == ID_SURFACE &&
+						opcode == SURFACE_REQ_COMMIT) {
+					rec.ncommits++;
+				}
+				if (words[i] == ID_SURFACE &&
+						opcode == SURFACE_REQ_FRAME) {
+					rec.nframes++;
+				}
+				if (msg_len < 8) {
+					break;
+				}
+				i += msg_len / 4;
+			}
+		}
+		if (rec.type == WMSG_BUFFER_DIFF && sz >= 28) {
+			/* After the header, the diff starts with the first
+			 * span's ends, then its data */
+			rec.diff_word = ((const uint32_t *)log->buf)[5];
+		}
+		log->ncommits += rec.ncommits;
+		log->closed = rec.type == WMSG_CLOSE;
+		void *nr = realloc(log->records, sizeof(struct chan_record) *
+							 (size_t)(log->nrecords +
+									 1));
+		if (!nr) {
+			return -1;
+		}
+		log->records = nr;
+		log->records[log->nrecords++] = rec;
+	}
+	return 0;
+}
+
+static void sleep_ms(int ms)
+{
+	struct timespec ts = {.tv_sec = 0, .tv_nsec = ms * 1000000L};
+	nanosleep(&ts, NULL);
+}
+
+struct loop_test {
+	/* The application's end of its connection, and the other end of
+	 * the channel */
+	int progfd;
+	int chanfd;
+	int memfd;
+	char *mem;
+	struct main_config config;
+	struct loop_setup setup;
+	pthread_t thread;
+	struct chan_log log;
+	/* The first record after the buffer has been sent in full */
+	int first_update;
+};
+
+/* Start an application side main loop, create a surface and commit its
+ * buffer twice. The update for the second commit is much larger than the
+ * channel's buffer, and stays queued, as the channel is not read. */
+static int start_loop_test(struct loop_test *t, bool coalesce)
+{
+	memset(t, 0, sizeof(*t));
+	int way_fds[2], conn_fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, way_fds) == -1) {
+		wp_error("Socketpair failed");
+		return -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, conn_fds) == -1) {
+		wp_error("Socketpair failed");
+		checked_close(way_fds[0]);
+		checked_close(way_fds[1]);
+		return -1;
+	}
+	t->progfd = way_fds[0];
+	t->chanfd = conn_fds[0];
+	t->memfd = create_anon_file();
+	if (t->memfd == -1 || ftruncate(t->memfd, BUF_SIZE) == -1) {
+		wp_error("Failed to create buffer file");
+		goto fail_file;
+	}
+	t->mem = mmap(NULL, BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			t->memfd, 0);
+	if (t->mem == MAP_FAILED) {
+		wp_error("Failed to map buffer file");
+		goto fail_file;
+	}
+
+	t->config = (struct main_config){
+			.drm_node = NULL,
+			.n_worker_threads = 1,
+			.compression = COMP_NONE,
+			.compression_level = 0,
+			.no_gpu = true,
+			.only_linear_dmabuf = true,
+			.max_inflight = 0,
+			.coalesce = coalesce,
+	};
+	t->setup = (struct loop_setup){.chanfd = conn_fds[1],
+			.progfd = way_fds[1],
+			.mc = &t->config};
+	if (pthread_create(&t->thread, NULL, run_app_side_loop, &t->setup) !=
+			0) {
+		wp_error("Thread failed");
+		munmap(t->mem, BUF_SIZE);
+		goto fail_file;
+	}
+
+	if (send_surface_setup(t->progfd, t->memfd) == -1 ||
+			read_channel_until(t->chanfd, &t->log, 1) == -1) {
+		return -1;
+	}
+	t->first_update = t->log.nrecords;
+	memset(t->mem, 0x11, BUF_SIZE);
+	if (send_damage_commit(t->progfd, 0, BUF_HEIGHT) == -1) {
+		return -1;
+	}
+	sleep_ms(100);
+	return 0;
+
+fail_file:
+	if (t->memfd != -1) {
+		checked_close(t->memfd);
+	}
+	checked_close(t->progfd);
+	checked_close(t->chanfd);
+	checked_close(conn_fds[1]);
+	checked_close(way_fds[1]);
+	t->progfd = -1;
+	return -1;
+}
+static bool finish_loop_test(struct loop_test *t, bool pass)
+{
+	if (t->progfd != -1) {
+		checked_close(t->progfd);
+		if (pass) {
+			/* Let the main loop see the application close, and
+			 * stop */
+			pass = read_channel_until(t->chanfd, &t->log,
+						INT32_MAX) != -1;
+		}
+		checked_close(t->chanfd);
+		pthread_join(t->thread, NULL);
+		munmap(t->mem, BUF_SIZE);
+		checked_close(t->memfd);
+	}
+	free(t->log.records);
+	free(t->log.buf);
+	printf("Test: %s\n", pass ? "pass" : "FAIL");
+	return pass;
+}
+/* Return the index of the first record at or after `i` with a commit */
+static int next_commit_record(const struct chan_log *log, int i)
+{
+	while (i < log->nrecords && log->records[i].ncommits == 0) {
+		i++;
+	}
+	return i;
+}
+
+/* Commit the buffer twice while the update for the last commit is still
+ * queued */
+static bool test_congested_commits(bool coalesce)
+{
+	struct loop_test t;
+	bool pass = false;
+	if (start_loop_test(&t, coalesce) == -1) {
+		goto end;
+	}
+
+	struct app_msg m;
+	msg_start(&m, ID_SURFACE);
+	msg_uint(&m, ID_CALLBACK);
+	memset(t.mem, 0x22, BUF_STRIDE);
+	if (msg_send(t.progfd, &m, SURFACE_REQ_FRAME, -1) == -1 ||
+			send_damage_commit(t.progfd, 0, 1) == -1) {
+		goto end;
+	}
+	sleep_ms(20);
+	memset(t.mem + BUF_SIZE - BUF_STRIDE, 0x33, BUF_STRIDE);
+	if (send_damage_commit(t.progfd, BUF_HEIGHT - 1, 1) == -1) {
+		goto end;
+	}
+	sleep_ms(100);
+
+	if (read_channel_until(t.chanfd, &t.log, 4) == -1) {
+		goto end;
+	}
+
+	/* Check what follows the message with the second commit */
+	int nframes_first = 0, ndiffs = 0, commits_together = 0;
+	for (int i = next_commit_record(&t.log, t.first_update) + 1;
+			i < t.log.nrecords; i++) {
+		const struct chan_record *rec = &t.log.records[i];
+		if (rec->type == WMSG_BUFFER_DIFF) {
+			ndiffs++;
+		} else if (rec->type == WMSG_PROTOCOL && ndiffs == 0) {
+			nframes_first += rec->nframes;
+		}
+		if (rec->ncommits > 0) {
+			commits_together = rec->ncommits;
+			break;
+		}
+	}
+	if (coalesce) {
+		/* The frame request was sent before the update; the commits
+		 * were held back and sent together after it */
+		pass = nframes_first == 1 && ndiffs > 0 &&
+		       commits_together == 2;
+	} else {
+		pass = nframes_first == 0 && ndiffs > 0 &&
+		       commits_together == 1;
+	}
+	printf("Coalesce %c: frame requests before update %d, diffs %d, commits sent together %d\n",
+			coalesce ? 'Y' : 'n', nframes_first, ndiffs,
+			commits_together);
+end:
+	return finish_loop_test(&t, pass);
+}
+
+/* Commit the buffer while the update for the last commit is still queued,
+ * and change it again afterwards. The update for the commit should have been
+ * computed while the channel was blocked, and show the committed contents. */
+static bool test_overlapped_update(void)
+{
+	struct loop_test t;
+	bool pass = false;
+	if (start_loop_test(&t, false) == -1) {
+		goto end;
+	}
+
+	memset(t.mem, 0x22, BUF_STRIDE);
+	if (send_damage_commit(t.progfd, 0, 1) == -1) {
+		goto end;
+	}
+	sleep_ms(100);
+	memset(t.mem, 0x44, BUF_STRIDE);
+
+	if (read_channel_until(t.chanfd, &t.log, 3) == -1) {
+		goto end;
+	}
+	uint32_t diff_word = 0;
+	for (int i = next_commit_record(&t.log, t.first_update) + 1;
+			i < t.log.nrecords; i++) {
+		if (t.log.records[i].type == WMSG_BUFFER_DIFF) {
+			diff_word = t.log.records[i].diff_word;
+			break;
+		}
+	}
+	pass = diff_word == 0x22222222;
+	printf("Overlap: update computed from data %08x\n", diff_word);
+end:
+	return finish_loop_test(&t, pass);
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_atomic_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	struct sigaction act;
+	act.sa_handler = SIG_IGN;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	if (sigaction(SIGPIPE, &act, NULL) == -1) {
+		printf("Sigaction failed\n");
+		return EXIT_SUCCESS;
+	}
+
+	bool all_success = true;
+	all_success &= test_congested_commits(false);
+	all_success &= test_congested_commits(true);
+	all_success &= test_overlapped_update();
+	printf("\nSuccess: %c\n", all_success ? 'Y' : 'n');
+	return all_success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
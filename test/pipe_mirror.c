@@ -41,7 +41,6 @@ static int shadow_sync(struct fd_translation_map *src_map,
 {
 	struct transfer_queue queue;
 	memset(&queue, 0, sizeof(queue));
-	pthread_mutex_init(&queue.async_recv_queue.lock, NULL);
 
 	read_readable_pipes(src_map);
 
@@ -226,6 +225,7 @@ static bool test_pipe_mirror(bool close_src, bool can_read, bool can_write,
 			struct shadow_fd *mod_sfd =
 					from_src ? src_shadow : dst_shadow;
 			mod_sfd->pipe.readable = true;
+			mark_shadow_active(mod_sfd);
 
 			/* Write successful */
 			if (shadow_sync(from_src ? &src_map : &dst_map,
@@ -283,6 +283,7 @@ static bool test_pipe_mirror(bool close_src, bool can_read, bool can_write,
 
 	cls_shadow->pipe.readable = cls_shadow->pipe.can_read;
 	cls_shadow->pipe.writable = cls_shadow->pipe.can_write;
+	mark_shadow_active(cls_shadow);
 
 	if (shadow_sync(close_src ? &src_map : &dst_map,
 			    close_src ? &dst_map : &src_map) == -1) {
@@ -236,6 +236,354 @@ end:
 	return pass;
 }
 
+/* Check that recommitting a buffer only updates the damaged region */
+static bool test_shm_buffer_damage(void)
+{
+	fprintf(stdout, "\n  shm buffer damage test\n");
+
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	bool pass = true;
+
+	char *testpat = make_filled_pattern(16384, 0xFEDCBA98);
+	int fd = make_filled_file(16384, testpat);
+	int ret_fd = -1;
+
+	struct wp_objid display = {0x1}, registry = {0x2}, shm = {0x3},
+			compositor = {0x4}, pool = {0x5}, buffer = {0x6},
+			surface = {0x7};
+
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_registry_evt_global(&T, registry, 1, "wl_shm", 1);
+	send_wl_registry_evt_global(&T, registry, 2, "wl_compositor", 1);
+	send_wl_registry_req_bind(&T, registry, 1, "wl_shm", 1, shm);
+	send_wl_registry_req_bind(
+			&T, registry, 2, "wl_compositor", 1, compositor);
+	send_wl_shm_req_create_pool(&T, shm, pool, fd, 16384);
+	ret_fd = get_only_fd_from_msg(T.comp);
+	send_wl_shm_pool_req_create_buffer(
+			&T, pool, buffer, 0, 64, 64, 256, 0x30334258);
+	send_wl_compositor_req_create_surface(&T, compositor, surface);
+	send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 64, 64);
+	send_wl_surface_req_commit(&T, surface);
+
+	/* Change the first and last rows, but only report the first */
+	char *mem = (char *)mmap(NULL, 16384, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	memset(mem, 0x11, 256);
+	memset(mem + 16384 - 256, 0x22, 256);
+	munmap(mem, 16384);
+	memset(testpat, 0x11, 256);
+
+	send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 64, 1);
+	send_wl_surface_req_commit(&T, surface);
+
+	if (ret_fd == -1) {
+		wp_error("Fd not passed through");
+		pass = false;
+		goto end;
+	}
+	pass = check_file_contents(ret_fd, 16384, testpat);
+	if (!pass) {
+		wp_error("Damaged row was not copied, or undamaged row was");
+	}
+end:
+	free(testpat);
+	checked_close(fd);
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
+/* Check that surface damage is mapped onto a scaled and transformed buffer,
+ * and that replaying damage committed with a different scale or transform
+ * than the current one makes the entire buffer be updated */
+static bool test_shm_buffer_transformed_damage(void)
+{
+	fprintf(stdout, "\n  shm buffer transformed damage test\n");
+
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	bool pass = true;
+
+	char *testpat = make_filled_pattern(32768, 0xFEDCBA98);
+	int fd = make_filled_file(32768, testpat);
+	int ret_fd = -1;
+	char *mem = NULL;
+
+	struct wp_objid display = {0x1}, registry = {0x2}, shm = {0x3},
+			compositor = {0x4}, pool = {0x5}, buffer = {0x6},
+			surface = {0x7}, buffer2 = {0x8};
+
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_registry_evt_global(&T, registry, 1, "wl_shm", 1);
+	send_wl_registry_evt_global(&T, registry, 2, "wl_compositor", 1);
+	send_wl_registry_req_bind(&T, registry, 1, "wl_shm", 1, shm);
+	send_wl_registry_req_bind(
+			&T, registry, 2, "wl_compositor", 1, compositor);
+	send_wl_shm_req_create_pool(&T, shm, pool, fd, 32768);
+	ret_fd = get_only_fd_from_msg(T.comp);
+	send_wl_shm_pool_req_create_buffer(
+			&T, pool, buffer, 0, 64, 64, 256, 0x30334258);
+	send_wl_shm_pool_req_create_buffer(
+			&T, pool, buffer2, 16384, 64, 64, 256, 0x30334258);
+	send_wl_compositor_req_create_surface(&T, compositor, surface);
+	/* The 64x64 buffer is shown as a 32x32 surface, rotated by 90
+	 * degrees, so the top row of the surface is the left edge of the
+	 * buffer */
+	send_wl_surface_req_set_buffer_scale(&T, surface, 2);
+	send_wl_surface_req_set_buffer_transform(&T, surface, 1);
+	send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 32, 32);
+	send_wl_surface_req_commit(&T, surface);
+	if (ret_fd == -1) {
+		wp_error("Fd not passed through");
+		pass = false;
+		goto end;
+	}
+
+	/* Change the two leftmost columns and the last pixel, but only
+	 * report the top row of the surface */
+	mem = (char *)mmap(NULL, 32768, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (mem == MAP_FAILED) {
+		wp_error("Failed to map file");
+		mem = NULL;
+		pass = false;
+		goto end;
+	}
+	for (int y = 0; y < 64; y++) {
+		memset(mem + 256 * y, 0x11, 8);
+		memset(testpat + 256 * y, 0x11, 8);
+	}
+	memset(mem + 16384 - 4, 0x22, 4);
+
+	send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 32, 1);
+	send_wl_surface_req_commit(&T, surface);
+	/* Only the first buffer has been committed so far */
+	pass = check_file_contents(ret_fd, 16384, testpat);
+	if (!pass) {
+		wp_error("Damaged columns were not copied, or undamaged pixel was");
+		goto end;
+	}
+
+	/* Commit the other buffer, and then return to the first with a new
+	 * scale and transform. The damage from the other buffer's commit can
+	 * not be mapped with these, so the first buffer should be updated
+	 * entirely */
+	send_wl_surface_req_attach(&T, surface, buffer2, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 32, 32);
+	send_wl_surface_req_commit(&T, surface);
+	memset(testpat + 16384 - 4, 0x22, 4);
+	send_wl_surface_req_set_buffer_scale(&T, surface, 1);
+	send_wl_surface_req_set_buffer_transform(&T, surface, 0);
+	send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 1, 1);
+	send_wl_surface_req_commit(&T, surface);
+	pass = check_file_contents(ret_fd, 32768, testpat);
+	if (!pass) {
+		wp_error("Buffer was not fully updated after the scale and transform changed");
+	}
+end:
+	if (mem) {
+		munmap(mem, 32768);
+	}
+	free(testpat);
+	checked_close(fd);
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
+/* Check that surface damage to a surface with a viewport makes the entire
+ * buffer be updated, while buffer damage stays precise */
+static bool test_viewport_damage(void)
+{
+	fprintf(stdout, "\n  viewport damage test\n");
+
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	bool pass = true;
+
+	char *testpat = make_filled_pattern(16384, 0xFEDCBA98);
+	int fd = make_filled_file(16384, testpat);
+	int ret_fd = -1;
+	char *mem = NULL;
+
+	struct wp_objid display = {0x1}, registry = {0x2}, shm = {0x3},
+			compositor = {0x4}, pool = {0x5}, buffer = {0x6},
+			surface = {0x7}, viewporter = {0x8}, viewport = {0x9};
+
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_registry_evt_global(&T, registry, 1, "wl_shm", 1);
+	send_wl_registry_evt_global(&T, registry, 2, "wl_compositor", 1);
+	send_wl_registry_evt_global(&T, registry, 3, "wp_viewporter", 1);
+	send_wl_registry_req_bind(&T, registry, 1, "wl_shm", 1, shm);
+	send_wl_registry_req_bind(
+			&T, registry, 2, "wl_compositor", 1, compositor);
+	send_wl_registry_req_bind(
+			&T, registry, 3, "wp_viewporter", 1, viewporter);
+	send_wl_shm_req_create_pool(&T, shm, pool, fd, 16384);
+	ret_fd = get_only_fd_from_msg(T.comp);
+	send_wl_shm_pool_req_create_buffer(
+			&T, pool, buffer, 0, 64, 64, 256, 0x30334258);
+	send_wl_compositor_req_create_surface(&T, compositor, surface);
+	send_wp_viewporter_req_get_viewport(&T, viewporter, viewport, surface);
+	send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 64, 64);
+	send_wl_surface_req_commit(&T, surface);
+	if (ret_fd == -1) {
+		wp_error("Fd not passed through");
+		pass = false;
+		goto end;
+	}
+
+	mem = (char *)mmap(NULL, 16384, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (mem == MAP_FAILED) {
+		wp_error("Failed to map file");
+		mem = NULL;
+		pass = false;
+		goto end;
+	}
+	/* The viewport may crop and scale the buffer, so the first row of
+	 * the surface could show any part of it */
+	memset(mem, 0x11, 256);
+	memset(mem + 16384 - 256, 0x22, 256);
+	memset(testpat, 0x11, 256);
+	memset(testpat + 16384 - 256, 0x22, 256);
+	send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 64, 1);
+	send_wl_surface_req_commit(&T, surface);
+	pass = check_file_contents(ret_fd, 16384, testpat);
+	if (!pass) {
+		wp_error("Buffer was not fully updated after surface damage");
+		goto end;
+	}
+
+	/* Buffer damage does not depend on the viewport */
+	memset(mem, 0x33, 256);
+	memset(mem + 16384 - 256, 0x44, 256);
+	memset(testpat, 0x33, 256);
+	send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+	send_wl_surface_req_damage_buffer(&T, surface, 0, 0, 64, 1);
+	send_wl_surface_req_commit(&T, surface);
+	pass = check_file_contents(ret_fd, 16384, testpat);
+	if (!pass) {
+		wp_error("Damaged row was not copied, or undamaged row was");
+	}
+end:
+	if (mem) {
+		munmap(mem, 16384);
+	}
+	free(testpat);
+	checked_close(fd);
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
+static bool test_shared_shm_pool(void)
+{
+	fprintf(stdout, "\n  shm_pools sharing a file test\n");
+
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	bool pass = true;
+
+	char *testpat = make_filled_pattern(32768, 0xFEDCBA98);
+	int fd = make_filled_file(16384, testpat);
+	int ret_fd1 = -1, ret_fd2 = -1;
+
+	struct wp_objid display = {0x1}, registry = {0x2}, shm = {0x3},
+			compositor = {0x4}, pool1 = {0x5}, pool2 = {0x6},
+			buffer1 = {0x7}, buffer2 = {0x8}, surface = {0x9};
+
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_registry_evt_global(&T, registry, 1, "wl_shm", 1);
+	send_wl_registry_evt_global(&T, registry, 2, "wl_compositor", 1);
+	send_wl_registry_req_bind(&T, registry, 1, "wl_shm", 1, shm);
+	send_wl_registry_req_bind(
+			&T, registry, 2, "wl_compositor", 1, compositor);
+	send_wl_shm_req_create_pool(&T, shm, pool1, fd, 16384);
+	ret_fd1 = get_only_fd_from_msg(T.comp);
+	send_wl_shm_pool_req_create_buffer(
+			&T, pool1, buffer1, 0, 64, 64, 256, 0x30334258);
+	send_wl_compositor_req_create_surface(&T, compositor, surface);
+	send_wl_surface_req_attach(&T, surface, buffer1, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 64, 64);
+	send_wl_surface_req_commit(&T, surface);
+
+	/* Grow the file, and make a second, larger pool from it */
+	memset(testpat + 16384, 0x3c, 16384);
+	ftruncate(fd, 32768);
+	char *mem = (char *)mmap(NULL, 32768, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	memcpy(mem + 16384, testpat + 16384, 16384);
+	munmap(mem, 32768);
+
+	/* A different file descriptor for the same file */
+	int fd2 = dup(fd);
+	send_wl_shm_req_create_pool(&T, shm, pool2, fd2, 32768);
+	checked_close(fd2);
+	ret_fd2 = get_only_fd_from_msg(T.comp);
+	send_wl_shm_pool_req_create_buffer(
+			&T, pool2, buffer2, 16384, 64, 64, 256, 0x30334258);
+	send_wl_surface_req_attach(&T, surface, buffer2, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 64, 64);
+	send_wl_surface_req_commit(&T, surface);
+
+	if (ret_fd1 == -1 || ret_fd2 == -1) {
+		wp_error("Fd not passed through");
+		pass = false;
+		goto end;
+	}
+	if (!files_equiv(ret_fd1, ret_fd2)) {
+		wp_error("Pools from the same file were given different copies");
+		pass = false;
+		goto end;
+	}
+	pass = check_file_contents(ret_fd2, 32768, testpat);
+	if (!pass) {
+		wp_error("Failed to transfer file");
+		goto end;
+	}
+
+	/* Looking up the shadow's own fd must not register it as an alias */
+	struct fd_translation_map *map = &T.app->glob.map;
+	struct shadow_fd *sfd = (struct shadow_fd *)map->link.l_next;
+	if (get_shadow_for_same_file(map, sfd->fd_local) != sfd ||
+			map->naliases != 0) {
+		wp_error("Shadow fd was registered as an alias of itself");
+		pass = false;
+	}
+end:
+	free(testpat);
+	checked_close(fd);
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
 static bool test_fixed_shm_screencopy_copy(void)
 {
 	fprintf(stdout, "\n screencopy test\n");
@@ -917,6 +1265,56 @@ end:
 	return pass;
 }
 
+/* Check that frame callback events are held back from the application while
+ * it has too much data in flight, unlike other callbacks */
+static bool test_frame_throttle(void)
+{
+	fprintf(stdout, "\n  Frame throttle test\n");
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	bool pass = true;
+
+	struct wp_objid display = {0x1}, registry = {0x2}, compositor = {0x3},
+			surface = {0x4}, frame = {0x5}, sync = {0x6};
+
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_registry_evt_global(&T, registry, 1, "wl_compositor", 1);
+	send_wl_registry_req_bind(
+			&T, registry, 1, "wl_compositor", 1, compositor);
+	send_wl_compositor_req_create_surface(&T, compositor, surface);
+	send_wl_surface_req_frame(&T, surface, frame);
+	send_wl_surface_req_commit(&T, surface);
+	send_wl_display_req_sync(&T, display, sync);
+
+	T.app->glob.inflight_throttle = true;
+	send_wl_callback_evt_done(&T, frame, 1);
+	send_wl_display_evt_delete_id(&T, display, frame.id);
+	send_wl_callback_evt_done(&T, sync, 2);
+
+	const struct msg *last = &T.app->rcvd[T.app->nrcvd - 3];
+	if (last[0].len != 0 || last[1].len != 0) {
+		wp_error("Frame callback events were not held back");
+		pass = false;
+	}
+	if (last[2].len != 12) {
+		wp_error("Sync callback event was held back");
+		pass = false;
+	}
+	if (T.app->glob.held_frame_events.zone_end != 24) {
+		wp_error("Held %d bytes of events, expected 24",
+				T.app->glob.held_frame_events.zone_end);
+		pass = false;
+	}
+
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
 /* Check whether the video encoding feature can replicate a uniform
  * color image */
 static bool test_fixed_video_color_copy(enum video_coding_fmt fmt, bool hw)
@@ -935,9 +1333,13 @@ int main(int argc, char **argv)
 
 	set_initial_fds();
 
-	int ntest = 20;
+	int ntest = 25;
 	int nsuccess = 0;
 	nsuccess += test_fixed_shm_buffer_copy();
+	nsuccess += test_shm_buffer_damage();
+	nsuccess += test_shm_buffer_transformed_damage();
+	nsuccess += test_viewport_damage();
+	nsuccess += test_shared_shm_pool();
 	nsuccess += test_fixed_shm_screencopy_copy();
 	nsuccess += test_fixed_keymap_copy();
 	nsuccess += test_fixed_dmabuf_copy(COPY_LINUX_DMABUF);
@@ -954,6 +1356,7 @@ int main(int argc, char **argv)
 	nsuccess += test_data_source(DDT_WLR);
 	nsuccess += test_gamma_control();
 	nsuccess += test_presentation_time();
+	nsuccess += test_frame_throttle();
 	nsuccess += test_fixed_video_color_copy(VIDEO_H264, false);
 	nsuccess += test_fixed_video_color_copy(VIDEO_H264, true);
 	nsuccess += test_fixed_video_color_copy(VIDEO_VP9, false);